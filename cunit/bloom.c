@@ -0,0 +1,65 @@
+/* Unit test for lib/bloom.c */
+#include <stdio.h>
+#include "cunit/cunit.h"
+#include "bloom.h"
+
+#define NKEYS	2000
+
+static void test_empty(void)
+{
+    struct bloom b = BLOOM_INITIALIZER;
+
+    /* an uninitialised filter can't rule anything out */
+    CU_ASSERT_EQUAL(bloom_check(&b, "lorem", 5), 1);
+
+    bloom_init(&b, 100);
+    CU_ASSERT_EQUAL(bloom_check(&b, "lorem", 5), 0);
+    CU_ASSERT_EQUAL(bloom_check(&b, "", 0), 0);
+    bloom_fini(&b);
+    CU_ASSERT_PTR_NULL(b.bits);
+}
+
+static void test_no_false_negatives(void)
+{
+    struct bloom b = BLOOM_INITIALIZER;
+    char key[32];
+    int i;
+    int nfound = 0;
+
+    bloom_init(&b, NKEYS);
+    for (i = 0 ; i < NKEYS ; i++) {
+	snprintf(key, sizeof(key), "<%d@example.com>", i);
+	bloom_add(&b, key, strlen(key));
+    }
+
+    for (i = 0 ; i < NKEYS ; i++) {
+	snprintf(key, sizeof(key), "<%d@example.com>", i);
+	nfound += bloom_check(&b, key, strlen(key));
+    }
+    CU_ASSERT_EQUAL(nfound, NKEYS);
+
+    bloom_fini(&b);
+}
+
+static void test_false_positives(void)
+{
+    struct bloom b = BLOOM_INITIALIZER;
+    char key[32];
+    int i;
+    int nfalse = 0;
+
+    bloom_init(&b, NKEYS);
+    for (i = 0 ; i < NKEYS ; i++) {
+	snprintf(key, sizeof(key), "<%d@example.com>", i);
+	bloom_add(&b, key, strlen(key));
+    }
+
+    /* sized for about 1%, allow some slack */
+    for (i = 0 ; i < NKEYS ; i++) {
+	snprintf(key, sizeof(key), "<%d@example.org>", i);
+	nfalse += bloom_check(&b, key, strlen(key));
+    }
+    CU_ASSERT(nfalse < NKEYS / 25);
+
+    bloom_fini(&b);
+}
@@ -0,0 +1,157 @@
+/* Unit test for lib/scoreboard.c */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "cunit/cunit.h"
+#include "libconfig.h"
+#include "scoreboard.h"
+
+#define NSLOTS	4
+
+static char dir[] = "/tmp/cunit-scoreboard-XXXXXX";
+
+static int set_up(void)
+{
+    if (!mkdtemp(dir)) return -1;
+    config_dir = dir;
+    return scoreboard_create(NSLOTS);
+}
+
+static int tear_down(void)
+{
+    char path[1024];
+
+    scoreboard_detach();
+    snprintf(path, sizeof(path), "%s%s", dir, FNAME_SCOREBOARD);
+    unlink(path);
+    return rmdir(dir);
+}
+
+/* find the slot held by pid, or -1 */
+static int find_slot(pid_t pid, struct scoreboard_slot *copy)
+{
+    unsigned i;
+
+    for (i = 0; i < scoreboard_nslots(); i++) {
+	if (!scoreboard_read(i, copy) && copy->pid == pid) return i;
+    }
+    return -1;
+}
+
+static void test_empty(void)
+{
+    struct scoreboard_slot slot;
+    unsigned i;
+
+    CU_ASSERT_EQUAL(scoreboard_nslots(), NSLOTS);
+    for (i = 0; i < NSLOTS; i++)
+	CU_ASSERT_EQUAL(scoreboard_read(i, &slot), -1);
+    CU_ASSERT_EQUAL(scoreboard_read(NSLOTS, &slot), -1);
+}
+
+static void test_lifecycle(void)
+{
+    struct scoreboard_slot slot;
+    pid_t pid = getpid();
+
+    /* reporting without a slot is harmless */
+    scoreboard_busy();
+    CU_ASSERT_EQUAL(find_slot(pid, &slot), -1);
+
+    CU_ASSERT_EQUAL(scoreboard_claim("imap"), 0);
+    CU_ASSERT_NOT_EQUAL(find_slot(pid, &slot), -1);
+    CU_ASSERT_EQUAL(slot.state, SCOREBOARD_READY);
+    CU_ASSERT_STRING_EQUAL(slot.service, "imap");
+    CU_ASSERT_STRING_EQUAL(slot.client, "");
+
+    scoreboard_busy();
+    scoreboard_session("client.example.com [10.0.0.1]", "fred", NULL);
+    scoreboard_command("Select", 123, 4567);
+    find_slot(pid, &slot);
+    CU_ASSERT_EQUAL(slot.state, SCOREBOARD_BUSY);
+    CU_ASSERT_STRING_EQUAL(slot.client, "client.example.com [10.0.0.1]");
+    CU_ASSERT_STRING_EQUAL(slot.user, "fred");
+    CU_ASSERT_STRING_EQUAL(slot.mailbox, "");
+    CU_ASSERT_STRING_EQUAL(slot.command, "Select");
+    CU_ASSERT_EQUAL(slot.bytes_in, 123);
+    CU_ASSERT_EQUAL(slot.bytes_out, 4567);
+    CU_ASSERT_EQUAL(slot.seq % 2, 0);
+
+    /* the connection's details go with it */
+    scoreboard_ready();
+    find_slot(pid, &slot);
+    CU_ASSERT_EQUAL(slot.state, SCOREBOARD_READY);
+    CU_ASSERT_STRING_EQUAL(slot.user, "");
+    CU_ASSERT_STRING_EQUAL(slot.command, "");
+    CU_ASSERT_EQUAL(slot.bytes_out, 0);
+
+    /* as master would, once we've exited */
+    scoreboard_release(pid);
+    CU_ASSERT_EQUAL(find_slot(pid, &slot), -1);
+}
+
+/* fork a process that claims a slot, reports whether it got one, and
+ * then waits to be killed */
+static pid_t claimer(int *claimed)
+{
+    int p[2];
+    pid_t pid;
+    char c = 0;
+
+    if (pipe(p)) return -1;
+
+    pid = fork();
+    if (!pid) {
+	close(p[0]);
+	scoreboard_attach(1);
+	c = scoreboard_claim("pop3") ? 'n' : 'y';
+	if (write(p[1], &c, 1) != 1) _exit(1);
+	pause();
+	_exit(0);
+    }
+
+    close(p[1]);
+    if (read(p[0], &c, 1) != 1) c = 0;
+    close(p[0]);
+    *claimed = (c == 'y');
+    return pid;
+}
+
+static void test_full(void)
+{
+    struct scoreboard_slot slot;
+    pid_t pids[NSLOTS + 1];
+    int i, claimed;
+
+    for (i = 0; i < NSLOTS; i++) {
+	pids[i] = claimer(&claimed);
+	CU_ASSERT(pids[i] > 0);
+	CU_ASSERT_EQUAL(claimed, 1);
+	CU_ASSERT_NOT_EQUAL(find_slot(pids[i], &slot), -1);
+    }
+
+    /* no room for another */
+    pids[NSLOTS] = claimer(&claimed);
+    CU_ASSERT_EQUAL(claimed, 0);
+    kill(pids[NSLOTS], SIGKILL);
+    waitpid(pids[NSLOTS], NULL, 0);
+
+    /* a slot whose process died unnoticed can be taken over */
+    kill(pids[0], SIGKILL);
+    waitpid(pids[0], NULL, 0);
+    pids[0] = claimer(&claimed);
+    CU_ASSERT_EQUAL(claimed, 1);
+    CU_ASSERT_NOT_EQUAL(find_slot(pids[0], &slot), -1);
+    CU_ASSERT_STRING_EQUAL(slot.service, "pop3");
+
+    for (i = 0; i < NSLOTS; i++) {
+	kill(pids[i], SIGKILL);
+	waitpid(pids[i], NULL, 0);
+	scoreboard_release(pids[i]);
+	CU_ASSERT_EQUAL(find_slot(pids[i], &slot), -1);
+    }
+}
@@ -2305,9 +2305,18 @@ int annotatemore_rename(const char *oldmboxname, const char *newmboxname,
 
 int annotatemore_delete(const char *mboxname)
 {
-    /* we treat a deleteion as a rename without a new name */
+    char key[MAX_MAILBOX_PATH+1];
+    int keylen, r;
+
+    /* every entry for the mailbox starts with "mboxname\0" */
+    keylen = strlcpy(key, mboxname, sizeof(key)) + 1;
+    if (keylen > (int) sizeof(key)) return IMAP_MAILBOX_BADNAME;
+
+    do {
+	r = cyrusdb_delete_range(DB, anndb, key, keylen, NULL);
+    } while (r == CYRUSDB_AGAIN);
 
-    return annotatemore_rename(mboxname, NULL, NULL, NULL);
+    return r ? IMAP_IOERROR : 0;
 }
 
 /*************************  Annotation Initialization  ************************/
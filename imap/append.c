@@ -413,16 +413,20 @@ int append_fromstage(struct appendstate *as, struct body **body,
 
     r = mailbox_copyfile(stagefile, fname, nolink);
     destfile = fopen(fname, "r");
-    if (!r && destfile) {
-	/* ok, we've successfully created the file */
-	if (!*body || (as->nummsg - 1))
+    if (!r && !destfile) r = IMAP_IOERROR;
+    if (!r) {
+	/* ok, we've successfully created the file; the caller may
+	   already have parsed the stage, in which case we're done
+	   reading it */
+	if (!*body)
 	    r = message_parse_file(destfile, NULL, NULL, body);
 	if (!r) r = message_create_record(&record, *body);
     }
     if (destfile) {
 	/* this will hopefully ensure that the link() actually happened
-	   and makes sure that the file actually hits disk */
-	r = fsync(fileno(destfile));
+	   and makes sure that the file actually hits disk (it's cheap if
+	   the stage was already fsync()ed) */
+	if (fsync(fileno(destfile)) && !r) r = IMAP_IOERROR;
 	fclose(destfile);
     }
     if (r) {
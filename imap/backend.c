@@ -500,6 +500,7 @@ struct backend *backend_connect(struct backend *ret_backend, const char *server,
     ret->sock = sock;
     prot_setflushonread(ret->in, ret->out);
     ret->prot = prot;
+    ret->enabled = ret->incomplete = 0;
 
     /* use literal+ to send literals */
     prot_setisclient(ret->in, 1);
@@ -70,6 +70,10 @@ struct backend {
     struct backend **current, **inbox; /* pointers to current/inbox be ptrs */
     struct prot_waitevent *timeout; /* event for idle timeout */
 
+    /* state a reset can't undo, so the connection can't be reused */
+    int enabled;		/* CONDSTORE/QRESYNC are in effect */
+    int incomplete;		/* a command (IDLE, literal) is unfinished */
+
     sasl_conn_t *saslconn;
 #ifdef HAVE_SSL
     SSL *tlsconn;
@@ -94,7 +94,6 @@ const int config_need_data = 0;
 extern int optind;
 extern char *optarg;
 
-const int PER_COMMIT = 1000;
 
 enum mboxop { DUMP,
 	      M_POPULATE,
@@ -570,18 +569,21 @@ void do_undump(void)
     int r = 0;
     char buf[16384];
     int line = 0;
-    char last_commit[MAX_MAILBOX_BUFFER];
     char *key=NULL, *data=NULL;
     int keylen, datalen;
-    int untilCommit = PER_COMMIT;
-    struct txn *tid = NULL;
-    
-    last_commit[0] = '\0';
+    struct cyrusdb_load *load = NULL;
+
+    /* a dump comes out sorted, so this can usually go in bulk */
+    r = cyrusdb_load_start(config_mboxlist_db, mbdb, &load);
+    if (r) {
+	fprintf(stderr, "db error: %s\n", cyrusdb_strerror(r));
+	return;
+    }
 
     while (fgets(buf, sizeof(buf), stdin)) {
 	char *name, *partition, *acl;
 	char *p;
-	int mbtype = 0, tries = 0;
+	int mbtype = 0;
 	struct mboxlist_entry *newmbentry = NULL;
 
 	line++;
@@ -634,50 +636,21 @@ void do_undump(void)
 
 	mboxlist_entry_free(&newmbentry);
 
-	tries = 0;
-    retry:
-	r = config_mboxlist_db->store(mbdb, key, keylen, data, datalen, &tid);
-	switch (r) {
-	case 0:
-	    break;
-	case CYRUSDB_AGAIN:
-	    if (tries++ < 5) {
-		fprintf(stderr, "warning: DB_LOCK_DEADLOCK; retrying\n");
-		goto retry;
-	    }
-	    fprintf(stderr, "error: too many deadlocks, aborting\n");
-	    break;
-	default:
-	    r = IMAP_IOERROR;
-	    break;
-	}
+	r = cyrusdb_load_add(load, key, keylen, data, datalen);
 	
 	free(data);
 
-	if(--untilCommit == 0) {
-	    /* commit */
-	    r = config_mboxlist_db->commit(mbdb, tid);
-	    if(r) break;
-	    tid = NULL;
-	    untilCommit = PER_COMMIT;
-	    strlcpy(last_commit,key,sizeof(last_commit));
-	}
-
 	if (r) break;
     }
 
-    if(!r && tid) {
-	/* commit the last transaction */
-	r=config_mboxlist_db->commit(mbdb, tid);
-    }
-
     if (r) {
-	if(tid) config_mboxlist_db->abort(mbdb, tid);
+	cyrusdb_load_abort(load);
 	fprintf(stderr, "db error: %s\n", cyrusdb_strerror(r));
 	if(key) fprintf(stderr, "was processing mailbox: %s\n", key);
-	if(last_commit[0]) fprintf(stderr, "last commit was at: %s\n",
-				   last_commit);
-	else fprintf(stderr, "no commits\n");
+    }
+    else {
+	r = cyrusdb_load_commit(load);
+	if (r) fprintf(stderr, "db error: %s\n", cyrusdb_strerror(r));
     }
     
 
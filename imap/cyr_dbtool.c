@@ -141,6 +141,8 @@ int main(int argc, char *argv[])
     int use_stdin = 0;
     int db_flags = 0;
     struct txn *tid = NULL;
+    struct cyrusdb_load *load = NULL;
+    int ret = 0;
 
     while ((opt = getopt(argc, argv, "C:n")) != EOF) {
 	switch (opt) {
@@ -218,10 +220,26 @@ int main(int argc, char *argv[])
           }
           loop = 1;
         }
+        if ( use_stdin && !is_get ) {
+          /* sorted input can be loaded in bulk */
+          r = cyrusdb_load_start(DB_OLD, odb, &load);
+          if (r) fatal("can't load database", EC_TEMPFAIL);
+        }
         while ( loop ) {
           if (is_get) {
             DB_OLD->fetch(odb, key, keylen, &res, &reslen, &tid);
             printf("%.*s\n", reslen, res);
+          } else if (load) {
+            r = cyrusdb_load_add(load, key, keylen,
+                                 is_set ? value : NULL, vallen);
+            if (r) {
+              printf("Error loading %.*s: %s\n", keylen, key,
+                     cyrusdb_strerror(r));
+              cyrusdb_load_abort(load);
+              load = NULL;
+              ret = EC_IOERR;
+              break;
+            }
           } else if (is_set) {
             DB_OLD->store(odb, key, keylen, value, vallen, &tid);
           } else if (is_delete) {
@@ -247,6 +265,15 @@ int main(int argc, char *argv[])
     } else {
         printf("Unknown action %s\n", action);
     }
+    if (load) {
+      r = cyrusdb_load_commit(load);
+      if (r) {
+        printf("Error committing load to %s: %s\n", old_db,
+               cyrusdb_strerror(r));
+        ret = EC_IOERR;
+      }
+      load = NULL;
+    }
     if (tid) {
       DB_OLD->commit(odb, tid);
       tid = NULL;
@@ -256,5 +283,5 @@ int main(int argc, char *argv[])
     
     cyrus_done();
 
-    return 0;
+    return ret;
 }
@@ -55,11 +55,13 @@
 #include <sys/stat.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 
 #include "global.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
 #include "proc.h"
+#include "scoreboard.h"
 #include "util.h"
 #include "../master/masterconf.h"
 #include "xmalloc.h"
@@ -84,6 +86,7 @@ static void usage(void)
     fprintf(stderr, "Where command is one of:\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "  * proc       - listing of all open processes\n");
+    fprintf(stderr, "  * top        - what every service process is doing\n");
     fprintf(stderr, "  * allconf    - listing of all config values\n");
     fprintf(stderr, "  * conf       - listing of non-default config values\n");
     fprintf(stderr, "  * lint       - unknown config keys\n");
@@ -107,6 +110,105 @@ static void do_proc(void)
     proc_foreach(print_procinfo, NULL);
 }
 
+static int sort_slots(const void *a, const void *b)
+{
+    const struct scoreboard_slot *sa = (const struct scoreboard_slot *) a;
+    const struct scoreboard_slot *sb = (const struct scoreboard_slot *) b;
+    int r;
+
+    /* by service, busy processes first */
+    r = strcmp(sa->service, sb->service);
+    if (!r) r = sb->state - sa->state;
+    if (!r) r = sa->pid - sb->pid;
+    return r;
+}
+
+static const char *format_secs(char *buf, size_t len, time_t secs)
+{
+    if (secs < 0) secs = 0;
+
+    if (secs >= 3600)
+	snprintf(buf, len, "%ld:%02ld:%02ld", (long) secs / 3600,
+		 (long) secs / 60 % 60, (long) secs % 60);
+    else
+	snprintf(buf, len, "%ld:%02ld", (long) secs / 60, (long) secs % 60);
+    return buf;
+}
+
+static const char *format_bytes(char *buf, size_t len, unsigned long n)
+{
+    const char *unit = "KMGT";
+    double v = n;
+
+    if (n < 1024) {
+	snprintf(buf, len, "%lu", n);
+	return buf;
+    }
+    for (v /= 1024; v >= 1024 && unit[1]; v /= 1024) unit++;
+    snprintf(buf, len, "%.1f%c", v, *unit);
+    return buf;
+}
+
+static void print_scoreboard(void)
+{
+    struct scoreboard_slot *slots;
+    unsigned nslots = scoreboard_nslots();
+    unsigned i, n = 0, busy = 0;
+    time_t now = time(NULL);
+    char since[16], cmdtime[16], in[16], out[16];
+
+    slots = xmalloc(nslots * sizeof(struct scoreboard_slot));
+    for (i = 0; i < nslots; i++) {
+	if (scoreboard_read(i, &slots[n])) continue;
+	if (slots[n].state == SCOREBOARD_BUSY) busy++;
+	n++;
+    }
+    qsort(slots, n, sizeof(struct scoreboard_slot), sort_slots);
+
+    printf("%u processes: %u busy, %u ready (%u slots)\n\n",
+	   n, busy, n - busy, nslots);
+    printf("%7s %-8s %-5s %8s %-24s %-16s %-20s %-8s %8s %7s %7s\n",
+	   "PID", "SERVICE", "STATE", "TIME", "CLIENT", "USER", "MAILBOX",
+	   "COMMAND", "CMDTIME", "IN", "OUT");
+
+    for (i = 0; i < n; i++) {
+	struct scoreboard_slot *s = &slots[i];
+
+	printf("%7d %-8.8s %-5s %8s %-24.24s %-16.16s %-20.20s %-8.8s %8s %7s %7s\n",
+	       (int) s->pid, s->service,
+	       s->state == SCOREBOARD_BUSY ? "busy" : "ready",
+	       format_secs(since, sizeof(since), now - s->since),
+	       s->client, s->user, s->mailbox, s->command,
+	       s->cmdtime ? format_secs(cmdtime, sizeof(cmdtime),
+					now - s->cmdtime) : "",
+	       s->state == SCOREBOARD_BUSY ?
+		   format_bytes(in, sizeof(in), s->bytes_in) : "",
+	       s->state == SCOREBOARD_BUSY ?
+		   format_bytes(out, sizeof(out), s->bytes_out) : "");
+    }
+
+    free(slots);
+}
+
+static void do_top(void)
+{
+    /* one snapshot when output goes somewhere else */
+    int interactive = isatty(fileno(stdout));
+
+    do {
+	/* map it afresh each time, in case master was restarted */
+	if (interactive) printf("\033[H\033[J");
+	if (scoreboard_attach(0)) {
+	    printf("no scoreboard: is scoreboard_size set, and master running?\n");
+	}
+	else {
+	    print_scoreboard();
+	    scoreboard_detach();
+	}
+	fflush(stdout);
+    } while (interactive && !sleep(1));
+}
+
 static void print_overflow(const char *key, const char *val,
 			  void *rock __attribute__((unused)))
 {
@@ -305,6 +407,8 @@ int main(int argc, char *argv[])
 
     if (!strcmp(argv[optind], "proc"))
 	do_proc();
+    else if (!strcmp(argv[optind], "top"))
+	do_top();
     else if (!strcmp(argv[optind], "allconf"))
 	do_conf(0);
     else if (!strcmp(argv[optind], "conf"))
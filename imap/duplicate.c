@@ -77,6 +77,7 @@
 #include "exitcodes.h"
 #include "util.h"
 #include "cyrusdb.h"
+#include "bloom.h"
 
 #include "duplicate.h"
 
@@ -85,6 +86,288 @@
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
 
+/*
+ * With duplicate_bucket_hours set, entries are stored in one database
+ * per time bucket, named for the start of the bucket, according to
+ * their mark.  Lookups go newest bucket first, so a re-marked entry
+ * returns its latest mark, and pruning removes whole buckets which are
+ * older than every expiry time.
+ *
+ * The current bucket takes new entries, and later ones take the future
+ * marks of vacation responses, so those are "live" and consulted
+ * directly.  Older buckets are only ever pruned, so we keep an
+ * in-memory bloom filter of their keys to avoid touching the disk for
+ * entries we've never seen, and keep their databases closed except
+ * while we look inside.  A filter is rebuilt whenever the backend
+ * reports a new generation for its database file.
+ */
+struct dupbucket {
+    time_t start;
+    char *fname;
+    struct db *db;
+    struct cyrusdb_generation gen;	/* generation the bloom was built at */
+    struct bloom bloom;
+};
+
+static time_t bucket_width = 0;		/* 0: single database */
+static char *bucket_dir = NULL;
+static time_t bucket_dirmtime = 0;
+static time_t bucket_scantime = 0;
+static struct dupbucket *buckets = NULL;	/* sorted newest first */
+static int nbuckets = 0;
+
+static void bucket_close(struct dupbucket *b)
+{
+    int r;
+
+    if (b->db) {
+	r = (DB->close)(b->db);
+	if (r) {
+	    syslog(LOG_ERR, "DBERROR: error closing %s: %s",
+		   b->fname, cyrusdb_strerror(r));
+	}
+	b->db = NULL;
+    }
+}
+
+static void bucket_free(struct dupbucket *b)
+{
+    bucket_close(b);
+    bloom_fini(&b->bloom);
+    free(b->fname);
+    b->fname = NULL;
+}
+
+static int bucket_cmp(const void *a, const void *b)
+{
+    const struct dupbucket *ba = (const struct dupbucket *) a;
+    const struct dupbucket *bb = (const struct dupbucket *) b;
+
+    if (ba->start > bb->start) return -1;
+    if (ba->start < bb->start) return 1;
+    return 0;
+}
+
+static struct dupbucket *bucket_add(time_t start)
+{
+    struct dupbucket *b;
+    char name[32];
+
+    buckets = xrealloc(buckets, (nbuckets + 1) * sizeof(struct dupbucket));
+    b = &buckets[nbuckets++];
+    memset(b, 0, sizeof(struct dupbucket));
+    b->start = start;
+    snprintf(name, sizeof(name), "/%ld", (long) start);
+    b->fname = strconcat(bucket_dir, name, (char *)NULL);
+
+    return b;
+}
+
+/* bring our list of buckets up to date with the bucket directory,
+ * keeping any databases we already have open */
+static void bucket_scan(int force)
+{
+    struct stat sbuf;
+    struct dupbucket *old = buckets;
+    int nold = nbuckets;
+    DIR *dirp;
+    struct dirent *dirent;
+    const char *p;
+    time_t start;
+    int i;
+
+    if (stat(bucket_dir, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: stat %s: %m", bucket_dir);
+	return;
+    }
+    if (!force && sbuf.st_mtime == bucket_dirmtime &&
+	bucket_scantime > bucket_dirmtime) return;
+
+    dirp = opendir(bucket_dir);
+    if (!dirp) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", bucket_dir);
+	return;
+    }
+
+    bucket_dirmtime = sbuf.st_mtime;
+    bucket_scantime = time(NULL);
+    buckets = NULL;
+    nbuckets = 0;
+
+    while ((dirent = readdir(dirp)) != NULL) {
+	for (p = dirent->d_name; *p && Uisdigit(*p); p++);
+	if (p == dirent->d_name || *p) continue;
+	start = (time_t) strtol(dirent->d_name, NULL, 10);
+
+	for (i = 0; i < nold; i++) {
+	    if (old[i].fname && old[i].start == start) break;
+	}
+	if (i < nold) {
+	    buckets = xrealloc(buckets,
+			       (nbuckets + 1) * sizeof(struct dupbucket));
+	    buckets[nbuckets++] = old[i];
+	    old[i].fname = NULL;
+	}
+	else {
+	    bucket_add(start);
+	}
+    }
+    closedir(dirp);
+
+    /* anything left over has been removed by someone else */
+    for (i = 0; i < nold; i++) {
+	if (old[i].fname) bucket_free(&old[i]);
+    }
+    free(old);
+
+    qsort(buckets, nbuckets, sizeof(struct dupbucket), bucket_cmp);
+}
+
+static int bucket_open(struct dupbucket *b, int create)
+{
+    int r;
+
+    if (b->db) return 0;
+
+    r = (DB->open)(b->fname, create ? CYRUSDB_CREATE : 0, &b->db);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: opening %s: %s", b->fname,
+	       cyrusdb_strerror(r));
+	b->db = NULL;
+    }
+
+    return r;
+}
+
+/* may bucket b still take new entries? */
+static int bucket_live(const struct dupbucket *b, time_t now)
+{
+    return b->start >= now - bucket_width;
+}
+
+/* we're done looking inside bucket b for now */
+static void bucket_release(struct dupbucket *b, time_t now)
+{
+    if (!bucket_live(b, now)) bucket_close(b);
+}
+
+/* return the bucket for entries with 'mark', with its database open
+ * (and created if need be), or NULL */
+static struct dupbucket *bucket_get(time_t mark)
+{
+    time_t start = mark - (mark % bucket_width);
+    struct dupbucket *b = NULL;
+    int i;
+
+    bucket_scan(0);
+    for (i = 0; i < nbuckets; i++) {
+	if (buckets[i].start == start) {
+	    b = &buckets[i];
+	    break;
+	}
+    }
+
+    if (!b) {
+	bucket_add(start);
+	qsort(buckets, nbuckets, sizeof(struct dupbucket), bucket_cmp);
+	for (i = 0; buckets[i].start != start; i++);
+	b = &buckets[i];
+    }
+
+    if (bucket_open(b, 1)) return NULL;
+
+    return b;
+}
+
+static int bloom_count_cb(void *rock,
+			  const char *key __attribute__((unused)),
+			  int keylen __attribute__((unused)),
+			  const char *data __attribute__((unused)),
+			  int datalen __attribute__((unused)))
+{
+    (*(unsigned *) rock)++;
+    return 0;
+}
+
+static int bloom_add_cb(void *rock, const char *key, int keylen,
+			const char *data __attribute__((unused)),
+			int datalen __attribute__((unused)))
+{
+    bloom_add((struct bloom *) rock, key, keylen);
+    return 0;
+}
+
+/* could 'key' be in this bucket? */
+static int bucket_maybe(struct dupbucket *b, const char *key, int keylen,
+			time_t now)
+{
+    struct cyrusdb_generation gen;
+    unsigned count = 0;
+
+    /* live buckets change too often to be worth filtering */
+    if (bucket_live(b, now)) return 1;
+    if (!DB->generation || DB->generation(b->fname, &gen)) return 1;
+
+    if (!b->bloom.bits || !CYRUSDB_GENERATION_EQUAL(&gen, &b->gen)) {
+	/* anything written after we took the generation just makes the
+	 * filter a superset, and we'll rebuild again next time */
+	if (bucket_open(b, 0)) return 1;
+	bloom_fini(&b->bloom);
+	DB->foreach(b->db, "", 0, NULL, &bloom_count_cb, &count, NULL);
+	bloom_init(&b->bloom, count);
+	DB->foreach(b->db, "", 0, NULL, &bloom_add_cb, &b->bloom, NULL);
+	b->gen = gen;
+    }
+
+    return bloom_check(&b->bloom, key, keylen);
+}
+
+static int bucket_fetch(const char *key, int keylen,
+			const char **data, int *datalen)
+{
+    time_t now = time(NULL);
+    int i, r = CYRUSDB_NOTFOUND;
+
+    bucket_scan(0);
+    for (i = 0; i < nbuckets; i++) {
+	struct dupbucket *b = &buckets[i];
+
+	if (r == CYRUSDB_NOTFOUND && bucket_maybe(b, key, keylen, now) &&
+	    !bucket_open(b, 0)) {
+	    do {
+		r = DB->fetch(b->db, key, keylen, data, datalen, NULL);
+	    } while (r == CYRUSDB_AGAIN);
+
+	    /* *data may point into the database, so leave it open
+	       until next time */
+	    if (r != CYRUSDB_NOTFOUND) continue;
+	}
+	bucket_release(b, now);
+    }
+
+    return r;
+}
+
+/* have we already reported this key from a newer bucket? */
+static int bucket_seen(struct hash_table *seen, const char *key, int keylen)
+{
+    char buf[1024];
+    char *p;
+
+    if (!seen || keylen >= (int) sizeof(buf)) return 0;
+
+    /* key is "id\0to\0" */
+    memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+    p = buf + strlen(buf);
+    if (p < buf + keylen) *p = '\t';
+
+    if (hash_lookup(buf, seen)) return 1;
+    hash_insert(buf, (void *) 1, seen);
+
+    return 0;
+}
+
 /* must be called after cyrus_init */
 int duplicate_init(const char *fname, int myflags __attribute__((unused)))
 {
@@ -106,12 +389,29 @@ int duplicate_init(const char *fname, int myflags __attribute__((unused)))
 	    fname = tofree;
 	}
 
-	r = (DB->open)(fname, CYRUSDB_CREATE, &dupdb);
-	if (r != 0)
-	    syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
-		   cyrusdb_strerror(r));
-	else
-	    duplicate_dbopen = 1;
+	bucket_width = config_getint(IMAPOPT_DUPLICATE_BUCKET_HOURS) * 3600;
+	if (bucket_width > 0) {
+	    bucket_dir = strconcat(fname, ".d", (char *)NULL);
+	    if (mkdir(bucket_dir, 0755) == -1 && errno != EEXIST) {
+		syslog(LOG_ERR, "IOERROR: creating %s: %m", bucket_dir);
+		free(bucket_dir);
+		bucket_dir = NULL;
+		r = IMAP_IOERROR;
+	    }
+	    else {
+		bucket_scan(1);
+		duplicate_dbopen = 1;
+	    }
+	}
+	else {
+	    bucket_width = 0;
+	    r = (DB->open)(fname, CYRUSDB_CREATE, &dupdb);
+	    if (r != 0)
+		syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+		       cyrusdb_strerror(r));
+	    else
+		duplicate_dbopen = 1;
+	}
 
 	free(tofree);
     }
@@ -135,7 +435,10 @@ time_t duplicate_check(const char *id, int idlen, const char *to, int tolen)
     memcpy(buf + idlen + 1, to, tolen);
     buf[idlen + tolen + 1] = '\0';
 
-    do {
+    if (bucket_width) {
+	r = bucket_fetch(buf, idlen + tolen + 2, &data, &len);
+    }
+    else do {
 	r = DB->fetch(dupdb, buf,
 		      idlen + tolen + 2, /* +2 b/c 1 for the center null;
 					    +1 for the terminating null */
@@ -177,6 +480,8 @@ void duplicate_mark(const char *id, int idlen,
 		    time_t mark, unsigned long uid)
 {
     char buf[1024], data[100];
+    struct dupbucket *b = NULL;
+    struct db *db = dupdb;
     int r;
 
     if (!duplicate_dbopen) return;
@@ -190,13 +495,20 @@ void duplicate_mark(const char *id, int idlen,
     memcpy(data, &mark, sizeof(mark));
     memcpy(data + sizeof(mark), &uid, sizeof(uid));
 
+    if (bucket_width) {
+	if (!(b = bucket_get(mark))) return;
+	db = b->db;
+    }
+
     do {
-	r = DB->store(dupdb, buf,
+	r = DB->store(db, buf,
 		      idlen + tolen + 2, /* +2 b/c 1 for the center null;
 					    +1 for the terminating null */
 		      data, sizeof(mark)+sizeof(uid), NULL);
     } while (r == CYRUSDB_AGAIN);
 
+    if (b) bucket_release(b, time(NULL));
+
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %ld %lu",
 	   buf, buf+idlen+1, mark, uid);
 
@@ -206,6 +518,7 @@ void duplicate_mark(const char *id, int idlen,
 struct findrock {
     duplicate_find_proc_t proc;
     void *rock;
+    struct hash_table *seen;
 };
 
 static int find_p(void *rock __attribute__((unused)),
@@ -221,8 +534,7 @@ static int find_p(void *rock __attribute__((unused)),
     return (rcpt[0] != '.');
 }
 
-static int find_cb(void *rock, const char *id,
-		   int idlen __attribute__((unused)),
+static int find_cb(void *rock, const char *id, int idlen,
 		   const char *data, int datalen)
 {
     struct findrock *frock = (struct findrock *) rock;
@@ -231,6 +543,8 @@ static int find_cb(void *rock, const char *id,
     unsigned long uid = 0;
     int r;
 
+    if (bucket_seen(frock->seen, id, idlen)) return 0;
+
     /* grab the rcpt */
     rcpt = id + strlen(id) + 1;
 
@@ -249,11 +563,31 @@ int duplicate_find(const char *msgid,
 		   void *rock)
 {
     struct findrock frock;
+    struct hash_table seen;
+    time_t now = time(NULL);
+    int i;
 
     if (!msgid) msgid = "";
 
     frock.proc = proc;
     frock.rock = rock;
+    frock.seen = NULL;
+
+    if (bucket_width) {
+	frock.seen = construct_hash_table(&seen, 64, 0);
+
+	/* newest first, so we report the latest mark for each entry */
+	bucket_scan(0);
+	for (i = 0; i < nbuckets; i++) {
+	    if (bucket_open(&buckets[i], 0)) continue;
+	    DB->foreach(buckets[i].db, msgid, strlen(msgid),
+			&find_p, &find_cb, &frock, NULL);
+	    bucket_release(&buckets[i], now);
+	}
+
+	free_hash_table(&seen, NULL);
+	return 0;
+    }
 
     /* check each entry in our database */
     DB->foreach(dupdb, msgid, strlen(msgid), &find_p, &find_cb, &frock, NULL);
@@ -309,6 +643,66 @@ static int prune_cb(void *rock, const char *id, int idlen,
     return 0;
 }
 
+struct exprange {
+    time_t min;
+    time_t max;
+};
+
+static void exprange_cb(char *key __attribute__((unused)),
+			void *data, void *rock)
+{
+    struct exprange *range = (struct exprange *) rock;
+    time_t expmark = *((time_t *) data);
+
+    if (expmark < range->min) range->min = expmark;
+    if (expmark > range->max) range->max = expmark;
+}
+
+/* drop buckets which are entirely expired and prune those which are
+ * partially expired entry by entry */
+static void bucket_prune(struct prunerock *prock)
+{
+    struct exprange range;
+    time_t now = time(NULL);
+    int i, dropped = 0, pruned = 0;
+
+    range.min = range.max = prock->expmark;
+    if (prock->expire_table)
+	hash_enumerate(prock->expire_table, &exprange_cb, &range);
+
+    bucket_scan(1);
+    for (i = nbuckets - 1; i >= 0; i--) {
+	struct dupbucket *b = &buckets[i];
+
+	if (b->start + bucket_width <= range.min) {
+	    /* every mark in here is older than any expiry time */
+	    if (b->db) {
+		(DB->close)(b->db);
+		b->db = NULL;
+	    }
+	    if (unlink(b->fname) == -1 && errno != ENOENT) {
+		syslog(LOG_ERR, "IOERROR: unlinking %s: %m", b->fname);
+		continue;
+	    }
+	    bucket_free(b);
+	    memmove(b, b + 1, (nbuckets - i - 1) * sizeof(struct dupbucket));
+	    nbuckets--;
+	    dropped++;
+	}
+	else if (b->start < range.max) {
+	    if (bucket_open(b, 0)) continue;
+	    prock->db = b->db;
+	    DB->foreach(b->db, "", 0, &prune_p, &prune_cb, prock, NULL);
+	    bucket_release(b, now);
+	    pruned++;
+	}
+    }
+
+    syslog(LOG_NOTICE,
+	   "duplicate_prune: removed %d buckets, pruned %d buckets",
+	   dropped, pruned);
+}
+
 int duplicate_prune(int seconds, struct hash_table *expire_table)
 {
     struct prunerock prock;
@@ -321,9 +715,14 @@ int duplicate_prune(int seconds, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: pruning back %0.2f days",
 	   (double)(seconds/86400));
 
-    /* check each entry in our database */
-    prock.db = dupdb;
-    DB->foreach(dupdb, "", 0, &prune_p, &prune_cb, &prock, NULL);
+    if (bucket_width) {
+	bucket_prune(&prock);
+    }
+    else {
+	/* check each entry in our database */
+	prock.db = dupdb;
+	DB->foreach(dupdb, "", 0, &prune_p, &prune_cb, &prock, NULL);
+    }
 
     syslog(LOG_NOTICE, "duplicate_prune: purged %d out of %d entries",
 	   prock.deletions, prock.count);
@@ -334,10 +733,11 @@ int duplicate_prune(int seconds, struct hash_table *expire_table)
 struct dumprock {
     FILE *f;
     int count;
+    struct hash_table *seen;
 };
 
 static int dump_cb(void *rock,
-		   const char *key, int keylen __attribute__((unused)),
+		   const char *key, int keylen,
 		   const char *data, int datalen)
 {
     struct dumprock *drock = (struct dumprock *) rock;
@@ -349,6 +749,8 @@ static int dump_cb(void *rock,
     assert((datalen == sizeof(time_t)) ||
 	   (datalen == sizeof(time_t) + sizeof(unsigned long)));
 
+    if (bucket_seen(drock->seen, key, keylen)) return 0;
+
     drock->count++;
 
     memcpy(&mark, data, sizeof(time_t));
@@ -382,9 +784,27 @@ static int dump_cb(void *rock,
 int duplicate_dump(FILE *f)
 {
     struct dumprock drock;
+    struct hash_table seen;
+    time_t now = time(NULL);
+    int i;
 
     drock.f = f;
     drock.count = 0;
+    drock.seen = NULL;
+
+    if (bucket_width) {
+	drock.seen = construct_hash_table(&seen, 4096, 0);
+
+	bucket_scan(0);
+	for (i = 0; i < nbuckets; i++) {
+	    if (bucket_open(&buckets[i], 0)) continue;
+	    DB->foreach(buckets[i].db, "", 0, NULL, &dump_cb, &drock, NULL);
+	    bucket_release(&buckets[i], now);
+	}
+
+	free_hash_table(&seen, NULL);
+	return drock.count;
+    }
 
     /* check each entry in our database */
     DB->foreach(dupdb, "", 0, NULL, &dump_cb, &drock, NULL);
@@ -396,7 +816,20 @@ int duplicate_done(void)
 {
     int r = 0;
 
-    if (duplicate_dbopen) {
+    if (duplicate_dbopen && bucket_width) {
+	int i;
+
+	for (i = 0; i < nbuckets; i++) bucket_free(&buckets[i]);
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+	free(bucket_dir);
+	bucket_dir = NULL;
+	bucket_width = 0;
+	bucket_dirmtime = bucket_scantime = 0;
+	duplicate_dbopen = 0;
+    }
+    else if (duplicate_dbopen) {
 	r = (DB->close)(dupdb);
 	if (r) {
 	    syslog(LOG_ERR, "DBERROR: error closing deliverdb: %s",
@@ -216,6 +216,10 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 				  config_getswitch(IMAPOPT_USERNAME_TOLOWER));
 	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_UNSAFE,
 				  config_getswitch(IMAPOPT_SKIPLIST_UNSAFE));
+	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_INDEX,
+				  config_getswitch(IMAPOPT_SKIPLIST_INDEX));
+	libcyrus_config_setint(CYRUSOPT_SKIPLIST_COMPRESS,
+			       config_getint(IMAPOPT_SKIPLIST_COMPRESS));
 	libcyrus_config_setstring(CYRUSOPT_TEMP_PATH,
 				  config_getstring(IMAPOPT_TEMP_PATH));
 	libcyrus_config_setint(CYRUSOPT_PTS_CACHE_TIMEOUT,
@@ -62,6 +62,7 @@
 #include "mboxname.h"
 #include "mupdate-client.h"
 #include "prot.h"
+#include "stristr.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcat.h"
@@ -117,7 +118,8 @@ struct protocol_t imap_protocol =
     NULL, AUTO_CAPA_AUTH_OK },
   { "Z01 COMPRESS DEFLATE", "* ", "Z01 OK" },
   { "N01 NOOP", "* ", "N01 OK" },
-  { "Q01 LOGOUT", "* ", "Q01 " }
+  { "Q01 LOGOUT", "* ", "Q01 " },
+  { "U01 UNSELECT", "* ", "U01 " }
 };
 
 void proxy_gentag(char *tag, size_t len)
@@ -275,6 +277,14 @@ static int pipe_response(struct backend *s, const char *tag, int include_last,
 
 	    /* copy the literal over */
 	    if (islit) {
+		if (!last || include_last) {
+		    /* straight from socket to socket, if we can */
+		    if (prot_splice(s->in, imapd_out, litlen) == EOF) {
+			/* EOF or other error */
+			return -1;
+		    }
+		    litlen = 0;
+		}
 		while (litlen > 0) {
 		    int j = (litlen > (int) sizeof(buf) ?
 			     (int) sizeof(buf) : litlen);
@@ -284,7 +294,6 @@ static int pipe_response(struct backend *s, const char *tag, int include_last,
 			/* EOF or other error */
 			return -1;
 		    }
-		    if (!last || include_last) prot_write(imapd_out, buf, j);
 		    litlen -= j;
 		}
 
@@ -346,6 +355,9 @@ int pipe_command(struct backend *s, int optimistic_literal)
     
     eol[0] = '\0';
 
+    /* if we don't get to the end, the server's still waiting for it */
+    s->incomplete = 1;
+
     /* again, the complication here are literals */
     for (;;) {
 	if (!prot_fgets(buf, sizeof(buf), imapd_in)) {
@@ -355,6 +367,12 @@ int pipe_command(struct backend *s, int optimistic_literal)
 
 	sl = strlen(buf);
 
+	/* FETCH MODSEQ, STORE UNCHANGEDSINCE, SEARCH MODSEQ and the like
+	   enable CONDSTORE on the server for the rest of the connection */
+	if (stristr(buf, "MODSEQ") || stristr(buf, "CHANGEDSINCE")) {
+	    s->enabled = 1;
+	}
+
 	if (sl == (sizeof(buf) - 1) && buf[sl-1] != '\n') {
             /* only got part of a line */
 	    strcpy(eol, buf + sl - 64);
@@ -414,22 +432,15 @@ int pipe_command(struct backend *s, int optimistic_literal)
 			/* strncpy(s->last_result, p + 1, LAST_RESULT_LEN);*/
 
 			/* stop sending command now */
+			s->incomplete = 0;
 			return 1;
 		    }
 		}
 
 		/* gobble literal and sent it onward */
-		while (litlen > 0) {
-		    int j = (litlen > (int) sizeof(buf) ?
-			     (int) sizeof(buf) : litlen);
-
-		    j = prot_read(imapd_in, buf, j);
-		    if(!j) {
-			/* EOF or other error */
-			return -1;
-		    }
-		    prot_write(s->out, buf, j);
-		    litlen -= j;
+		if (prot_splice(imapd_in, s->out, litlen) == EOF) {
+		    /* EOF or other error */
+		    return -1;
 		}
 
 		eol[0] = '\0';
@@ -439,6 +450,7 @@ int pipe_command(struct backend *s, int optimistic_literal)
 	    } else {
 		/* no literal, so we're done! */
 		prot_write(s->out, eol, strlen(eol));
+		s->incomplete = 0;
 
 		return 0;
 	    }
@@ -972,17 +984,11 @@ void proxy_copy(const char *tag, char *sequence, char *name, int myrights,
 		    /* append p to s->out */
 		    prot_printf(s->out, " (%s) \"%s\" {%d+}\r\n", 
 				q->flags, q->idate, sz);
-		    while (sz) {
-			char buf[2048];
-			int j = (sz > (int) sizeof(buf) ?
-				 (int) sizeof(buf) : sz);
-
-			j = prot_read(backend_current->in, buf, j);
-			if(!j) break;
-			prot_write(s->out, buf, j);
-			sz -= j;
+		    if (prot_splice(backend_current->in, s->out, sz) == EOF) {
+			/* EOF or other error */
+			c = EOF;
 		    }
-		    c = prot_getc(backend_current->in);
+		    else c = prot_getc(backend_current->in);
 		}
 
 		break; /* end of case */
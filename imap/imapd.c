@@ -99,6 +99,7 @@
 #include "mupdate-client.h"
 #include "proc.h"
 #include "quota.h"
+#include "scoreboard.h"
 #include "seen.h"
 #include "statuscache.h"
 #include "sync_log.h"
@@ -185,6 +186,7 @@ struct appendstage {
     strarray_t flags;
     time_t internaldate;
     int binary;
+    struct body *body;	/* parsed as soon as it's staged */
 } **stage = NULL;
 unsigned long numstage = 0;
 
@@ -652,14 +654,16 @@ static void imapd_reset(void)
     
     proc_cleanup();
 
-    /* close backend connections */
+    /* close backend connections, or keep them for a later session */
     i = 0;
     while (backend_cached && backend_cached[i]) {
-	proxy_downserver(backend_cached[i]);
-	if (backend_cached[i]->last_result.s) {
-	    free(backend_cached[i]->last_result.s);
+	if (!proxy_releaseserver(backend_cached[i], proxy_userid)) {
+	    proxy_downserver(backend_cached[i]);
+	    if (backend_cached[i]->last_result.s) {
+		free(backend_cached[i]->last_result.s);
+	    }
+	    free(backend_cached[i]);
 	}
-	free(backend_cached[i]);
 	i++;
     }
     if (backend_cached) free(backend_cached);
@@ -1005,6 +1009,7 @@ void shut_down(int code)
 	i++;
     }
     if (backend_cached) free(backend_cached);
+    proxy_emptypool();
 
     if (idling)
 	idle_done(imapd_index ? imapd_index->mailbox->name : NULL);
@@ -1087,6 +1092,10 @@ void fatal(const char *s, int code)
 	    if (curstage->f != NULL) fclose(curstage->f);
 	    append_removestage(curstage->stage);
 	    strarray_fini(&curstage->flags);
+	    if (curstage->body) {
+		message_free_body(curstage->body);
+		free(curstage->body);
+	    }
 	    free(curstage);
 	}
 	free(stage);
@@ -1215,6 +1224,8 @@ void cmdloop(void)
 	}
 	lcase(cmd.s);
 	strncpy(cmdname, cmd.s, 99);
+	scoreboard_command(cmdname, prot_bytes_in(imapd_in),
+			   prot_bytes_out(imapd_out));
 	cmd.s[0] = toupper((unsigned char) cmd.s[0]);
 
 	/* if we need to force a kick, do so */
@@ -2735,6 +2746,7 @@ void cmd_idle(char *tag)
 	/* Tell client we are idling and waiting for end of command */
 	prot_printf(imapd_out, "+ idling\r\n");
 	prot_flush(imapd_out);
+	prot_setidle(imapd_out, 1);
 
 	/* Start doing mailbox updates */
 	if (imapd_index) index_check(imapd_index, 1, 0);
@@ -2762,6 +2774,7 @@ void cmd_idle(char *tag)
 	if (CAPA(backend_current, CAPA_IDLE)) {
 	    /* Start IDLE on backend */
 	    prot_printf(backend_current->out, "%s IDLE\r\n", tag);
+	    backend_current->incomplete = 1;
 	    if (!prot_fgets(buf, sizeof(buf), backend_current->in)) {
 
 		/* If we received nothing from the backend, fail */
@@ -2773,6 +2786,7 @@ void cmd_idle(char *tag)
 		/* If we received anything but a continuation response,
 		   spit out what we received and quit */
 		prot_write(imapd_out, buf, strlen(buf));
+		backend_current->incomplete = 0;
 		return;
 	    }
 	}
@@ -2780,6 +2794,7 @@ void cmd_idle(char *tag)
 	/* Tell client we are idling and waiting for end of command */
 	prot_printf(imapd_out, "+ idling\r\n");
 	prot_flush(imapd_out);
+	prot_setidle(imapd_out, 1);
 
 	/* Pipe updates to client while waiting for end of command */
 	while (!done) {
@@ -2813,6 +2828,7 @@ void cmd_idle(char *tag)
 	       In either case we're done, so terminate IDLE on backend */
 	    prot_printf(backend_current->out, "Done\r\n");
 	    pipe_until_tag(backend_current, tag, 0);
+	    backend_current->incomplete = 0;
 	}
 
 	if (shutdown) {
@@ -2824,6 +2840,7 @@ void cmd_idle(char *tag)
 	}
     }
 
+    prot_setidle(imapd_out, 0);
     imapd_check(NULL, 1);
 
     if (c != EOF) {
@@ -3422,16 +3439,19 @@ void cmd_append(char *tag, char *name, const char *cur_name)
 	    r = message_copy_strict(imapd_in, curstage->f, size, curstage->binary);
 	}
 	totalsize += size;
-	/* If this is a non-BINARY message, close the stage file.
-	 * Otherwise, leave it open so we can encode the binary parts.
-	 *
-	 * XXX  For BINARY MULTIAPPEND, we may have to close the stage files
-	 * anyways to avoid too many open files.
-	 */
-	if (!curstage->binary) {
-	    fclose(curstage->f);
-	    curstage->f = NULL;
+
+	/* Parse the message (encoding any binary parts) while it's still
+	 * in the page cache and before we lock the mailbox, so that
+	 * appending it is just linking the stage file into place */
+	if (!r) {
+	    if (curstage->binary)
+		r = message_parse_binary_file(curstage->f, &curstage->body);
+	    else
+		r = message_parse_file(curstage->f, NULL, NULL,
+				       &curstage->body);
 	}
+	fclose(curstage->f);
+	curstage->f = NULL;
 
 	/* if we see a SP, we're trying to append more than one message */
 
@@ -3458,23 +3478,13 @@ void cmd_append(char *tag, char *name, const char *cur_name)
 			 imapd_userid, imapd_authstate, ACL_INSERT, totalsize);
     }
     if (!r) {
-	struct body *body;
-
 	doappenduid = (appendstate.myrights & ACL_READ);
 
+	/* all the messages go in under one lock and one commit */
 	for (i = 0; !r && i < numstage; i++) {
-	    body = NULL;
-	    if (stage[i]->binary) {
-		r = message_parse_binary_file(stage[i]->f, &body);
-		fclose(stage[i]->f);
-		stage[i]->f = NULL;
-	    }
-	    if (!r) {
-		r = append_fromstage(&appendstate, &body, stage[i]->stage,
-				     stage[i]->internaldate,
-				     &stage[i]->flags, 0);
-	    }
-	    if (body) message_free_body(body);
+	    r = append_fromstage(&appendstate, &stage[i]->body,
+				 stage[i]->stage, stage[i]->internaldate,
+				 &stage[i]->flags, 0);
 	}
 
 	if (!r) {
@@ -3491,6 +3501,10 @@ void cmd_append(char *tag, char *name, const char *cur_name)
 	if (curstage->f != NULL) fclose(curstage->f);
 	append_removestage(curstage->stage);
 	strarray_fini(&curstage->flags);
+	if (curstage->body) {
+	    message_free_body(curstage->body);
+	    free(curstage->body);
+	}
 	free(curstage);
     }
     if (stage) free(stage);
@@ -3700,6 +3714,7 @@ void cmd_select(char *tag, char *cmd, char *name)
 		prot_printf(backend_current->out, " Condstore");
 	    prot_printf(backend_current->out, "\r\n");
 	    pipe_until_tag(backend_current, mytag, 0);
+	    backend_current->enabled = 1;
 	}
 
 	/* Send SELECT command to backend */
@@ -96,6 +96,8 @@ void index_fetchmsg(struct index_state *state,
 		    const char *msg_base, unsigned long msg_size,
 		    unsigned offset, unsigned size,
 		    unsigned start_octet, unsigned octet_count);
+static int index_partdatahint(const char *msg_base, unsigned long msg_size,
+			      const char *part, int decode);
 static int index_fetchsection(struct index_state *state, const char *resp,
 			      const char *msg_base, unsigned long msg_size,
 			      char *section,
@@ -1736,7 +1738,13 @@ void index_fetchmsg(struct index_state *state, const char *msg_base,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg_base + offset, n);
+    if (state->msgfile_base && msg_base == state->msgfile_base) {
+	prot_sendfile(state->out, state->msgfile_fd, msg_base + offset,
+		      offset, n);
+    }
+    else {
+	prot_write(state->out, msg_base + offset, n);
+    }
     while (n++ < size) {
 	/* File too short, resynch client.
 	 *
@@ -1750,6 +1758,61 @@ void index_fetchmsg(struct index_state *state, const char *msg_base,
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 }
 
+/* MIME types whose content is already compressed */
+static const char * const compressed_types[] = {
+    "image/jpeg", "image/png", "image/gif", "image/webp",
+    "audio/mpeg", "audio/mp4", "audio/ogg", "video/",
+    "application/zip", "application/gzip", "application/x-gzip",
+    "application/x-bzip2", "application/x-xz",
+    "application/x-7z-compressed", "application/x-rar-compressed",
+    "application/java-archive", "application/vnd.openxmlformats-",
+    "application/vnd.oasis.opendocument.",
+    NULL
+};
+
+/*
+ * Tell from the Content-Type in the MIME header of the body part whose
+ * section cache entry is at 'part' what the protstream should expect
+ * its content to be (once decoded, if 'decode' is set)
+ */
+static int index_partdatahint(const char *msg_base, unsigned long msg_size,
+			      const char *part, int decode)
+{
+    unsigned offset = CACHE_ITEM_BIT32(part);
+    unsigned size = CACHE_ITEM_BIT32(part + CACHE_ITEM_SIZE_SKIP);
+    int encoding = CACHE_ITEM_BIT32(part + 4 * 4) & 0xff;
+    const char *p, *end;
+    int i;
+
+    if (!msg_base || size == (bit32) -1 || offset + size > msg_size)
+	return PROT_DATA_UNKNOWN;
+    if (!decode && encoding == ENCODING_QP) return PROT_DATA_UNKNOWN;
+
+    p = msg_base + offset;
+    end = p + size;
+    while (end - p > 13) {
+	if (!strncasecmp(p, "Content-Type:", 13)) {
+	    for (p += 13; p < end && (*p == ' ' || *p == '\t'); p++);
+
+	    for (i = 0; compressed_types[i]; i++) {
+		size_t len = strlen(compressed_types[i]);
+
+		if ((size_t) (end - p) >= len &&
+		    !strncasecmp(p, compressed_types[i], len)) {
+		    return (!decode && encoding == ENCODING_BASE64) ?
+			PROT_DATA_ENCODED : PROT_DATA_COMPRESSED;
+		}
+	    }
+	    return PROT_DATA_UNKNOWN;
+	}
+
+	if (!(p = memchr(p, '\n', end - p))) break;
+	p++;
+    }
+
+    return PROT_DATA_UNKNOWN;
+}
+
 /*
  * Helper function to fetch a body section
  */
@@ -1761,6 +1824,7 @@ static int index_fetchsection(struct index_state *state, const char *resp,
     const char *p;
     int32_t skip = 0;
     int fetchmime = 0;
+    int datahint = PROT_DATA_UNKNOWN;
     unsigned offset = 0;
     char *decbuf = NULL;
 
@@ -1831,7 +1895,12 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 
     if (*p == 'M') fetchmime++;
 
-    cachestr += skip * 5 * 4 + CACHE_ITEM_SIZE_SKIP + (fetchmime ? 0 : 2 * 4);
+    cachestr += skip * 5 * 4 + CACHE_ITEM_SIZE_SKIP;
+    if (!fetchmime) {
+	datahint = index_partdatahint(msg_base, msg_size, cachestr,
+				      strstr(resp, "BINARY") != NULL);
+	cachestr += 2 * 4;
+    }
     
     if (CACHE_ITEM_BIT32(cachestr + CACHE_ITEM_SIZE_SKIP) == (bit32) -1)
 	goto badpart;
@@ -1874,8 +1943,10 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 
     /* Output body part */
     prot_printf(state->out, "%s", resp);
+    if (datahint) prot_data_hint(state->out, datahint);
     index_fetchmsg(state, msg_base, msg_size, offset, size,
 		   start_octet, octet_count);
+    if (datahint) prot_data_hint(state->out, PROT_DATA_UNKNOWN);
 
     if (decbuf) free(decbuf);
     return 0;
@@ -2352,30 +2423,38 @@ static void index_fetchflags(struct index_state *state,
     bit32 flagmask = 0;
     struct index_map *im = &state->map[msgno-1];
 
-    prot_printf(state->out, "* %u FETCH (FLAGS ", msgno);
+    prot_printatom(state->out, "* ");
+    prot_printnum(state->out, msgno);
+    prot_printatom(state->out, " FETCH (FLAGS ");
 
     if (im->isrecent) {
-	prot_printf(state->out, "%c\\Recent", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Recent");
 	sepchar = ' ';
     }
     if (im->record.system_flags & FLAG_ANSWERED) {
-	prot_printf(state->out, "%c\\Answered", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Answered");
 	sepchar = ' ';
     }
     if (im->record.system_flags & FLAG_FLAGGED) {
-	prot_printf(state->out, "%c\\Flagged", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Flagged");
 	sepchar = ' ';
     }
     if (im->record.system_flags & FLAG_DRAFT) {
-	prot_printf(state->out, "%c\\Draft", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Draft");
 	sepchar = ' ';
     }
     if (im->record.system_flags & FLAG_DELETED) {
-	prot_printf(state->out, "%c\\Deleted", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Deleted");
 	sepchar = ' ';
     }
     if (im->isseen) {
-	prot_printf(state->out, "%c\\Seen", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "\\Seen");
 	sepchar = ' ';
     }
     for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
@@ -2383,7 +2462,8 @@ static void index_fetchflags(struct index_state *state,
 	    flagmask = im->record.user_flags[flag/32];
 	}
 	if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
-	    prot_printf(state->out, "%c%s", sepchar, state->flagname[flag]);
+	    (void)prot_putc(sepchar, state->out);
+	    prot_printatom(state->out, state->flagname[flag]);
 	    sepchar = ' ';
 	}
     }
@@ -2401,11 +2481,16 @@ static void index_printflags(struct index_state *state,
     /* http://www.rfc-editor.org/errata_search.php?rfc=5162
      * Errata ID: 1807 - MUST send UID and MODSEQ to all
      * untagged FETCH unsolicited responses */
-    if (usinguid || state->qresync)
-	prot_printf(state->out, " UID %u", im->record.uid);
-    if (state->qresync)
-	prot_printf(state->out, " MODSEQ (" MODSEQ_FMT ")", im->record.modseq);
-    prot_printf(state->out, ")\r\n");
+    if (usinguid || state->qresync) {
+	prot_printatom(state->out, " UID ");
+	prot_printnum(state->out, im->record.uid);
+    }
+    if (state->qresync) {
+	prot_printatom(state->out, " MODSEQ (");
+	prot_printnum(state->out, im->record.modseq);
+	(void)prot_putc(')', state->out);
+    }
+    prot_printatom(state->out, ")\r\n");
 }
 
 /*
@@ -2444,6 +2529,13 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	    prot_printf(state->out, "\r\n");
 	    return 0;
 	}
+
+	/* large literals can go from the file straight to the socket */
+	if (msg_size >= PROT_SENDFILE_MIN && prot_cansendfile(state->out)) {
+	    state->msgfile_fd =
+		open(mailbox_message_fname(mailbox, im->record.uid), O_RDONLY);
+	    if (state->msgfile_fd != -1) state->msgfile_base = msg_base;
+	}
     }
 
     /* display flags if asked _OR_ if they've changed */
@@ -2454,11 +2546,15 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     else if ((fetchitems & ~FETCH_SETSEEN) ||  fetchargs->fsections ||
 	     fetchargs->headers.count || fetchargs->headers_not.count) {
 	/* these fetch items will always succeed, so start the response */
-	prot_printf(state->out, "* %u FETCH ", msgno);
+	prot_printatom(state->out, "* ");
+	prot_printnum(state->out, msgno);
+	prot_printatom(state->out, " FETCH ");
 	started = 1;
     }
     if (fetchitems & FETCH_UID) {
-	prot_printf(state->out, "%cUID %u", sepchar, im->record.uid);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "UID ");
+	prot_printnum(state->out, im->record.uid);
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_INTERNALDATE) {
@@ -2467,44 +2563,52 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
 	time_to_rfc3501(msgdate, datebuf, sizeof(datebuf));
 
-	prot_printf(state->out, "%cINTERNALDATE \"%s\"",
-		    sepchar, datebuf);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "INTERNALDATE ");
+	prot_printstring(state->out, datebuf);
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_MODSEQ) {
-	prot_printf(state->out, "%cMODSEQ (" MODSEQ_FMT ")",
-		    sepchar, im->record.modseq);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "MODSEQ (");
+	prot_printnum(state->out, im->record.modseq);
+	(void)prot_putc(')', state->out);
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_SIZE) {
-	prot_printf(state->out, "%cRFC822.SIZE %u", 
-		    sepchar, im->record.size);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "RFC822.SIZE ");
+	prot_printnum(state->out, im->record.size);
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_ENVELOPE) {
         if (!mailbox_cacherecord(mailbox, &im->record)) {
-	    prot_printf(state->out, "%cENVELOPE ", sepchar);
+	    (void)prot_putc(sepchar, state->out);
+	    prot_printatom(state->out, "ENVELOPE ");
 	    sepchar = ' ';
 	    prot_putbuf(state->out, cacheitem_buf(&im->record, CACHE_ENVELOPE));
 	}
     }
     if (fetchitems & FETCH_BODYSTRUCTURE) {
         if (!mailbox_cacherecord(mailbox, &im->record)) {
-	    prot_printf(state->out, "%cBODYSTRUCTURE ", sepchar);
+	    (void)prot_putc(sepchar, state->out);
+	    prot_printatom(state->out, "BODYSTRUCTURE ");
 	    sepchar = ' ';
 	    prot_putbuf(state->out, cacheitem_buf(&im->record, CACHE_BODYSTRUCTURE));
 	}
     }
     if (fetchitems & FETCH_BODY) {
         if (!mailbox_cacherecord(mailbox, &im->record)) {
-	    prot_printf(state->out, "%cBODY ", sepchar);
+	    (void)prot_putc(sepchar, state->out);
+	    prot_printatom(state->out, "BODY ");
 	    sepchar = ' ';
 	    prot_putbuf(state->out, cacheitem_buf(&im->record, CACHE_BODY));
 	}
     }
 
     if (fetchitems & FETCH_HEADER) {
-	prot_printf(state->out, "%cRFC822.HEADER ", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "RFC822.HEADER ");
 	sepchar = ' ';
 	index_fetchmsg(state, msg_base, msg_size, 0,
 		       im->record.header_size,
@@ -2514,7 +2618,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 		         fetchargs->octet_count : 0);
     }
     else if (fetchargs->headers.count || fetchargs->headers_not.count) {
-	prot_printf(state->out, "%cRFC822.HEADER ", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "RFC822.HEADER ");
 	sepchar = ' ';
 	if (fetchargs->cache_atleast > im->record.cache_version) {
 	    index_fetchheader(state, msg_base, msg_size,
@@ -2526,7 +2631,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
 
     if (fetchitems & FETCH_TEXT) {
-	prot_printf(state->out, "%cRFC822.TEXT ", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "RFC822.TEXT ");
 	sepchar = ' ';
 	index_fetchmsg(state, msg_base, msg_size,
 		       im->record.header_size, im->record.size - im->record.header_size,
@@ -2536,7 +2642,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 		         fetchargs->octet_count : 0);
     }
     if (fetchitems & FETCH_RFC822) {
-	prot_printf(state->out, "%cRFC822 ", sepchar);
+	(void)prot_putc(sepchar, state->out);
+	prot_printatom(state->out, "RFC822 ");
 	sepchar = ' ';
 	index_fetchmsg(state, msg_base, msg_size, 0, im->record.size,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2646,7 +2753,11 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
     if (sepchar != '(') {
 	/* finsh the response if we have one */
-	prot_printf(state->out, ")\r\n");
+	prot_printatom(state->out, ")\r\n");
+    }
+    if (state->msgfile_base) {
+	close(state->msgfile_fd);
+	state->msgfile_base = NULL;
     }
     if (msg_base) 
 	mailbox_unmap_message(mailbox, im->record.uid, &msg_base, &msg_size);
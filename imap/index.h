@@ -119,6 +119,10 @@ struct index_state {
     struct protstream *out;
     int qresync;
     struct auth_state *authstate;
+    /* message file being fetched, if index_fetchmsg() may
+       prot_sendfile() straight from it */
+    const char *msgfile_base;
+    int msgfile_fd;
 };
 
 struct copyargs {
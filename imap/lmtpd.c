@@ -592,53 +592,84 @@ void deliver_remote(message_data_t *msgdata,
 		    struct dest *dlist, enum rcpt_status *status)
 {
     struct dest *d;
-
-    /* run the txns */
-    d = dlist;
-    while (d) {
-	struct lmtp_txn *lt = LMTP_TXN_ALLOC(d->rnum);
+    struct lmtp_txn **lt, **btxn;
+    struct backend **remote, **bconn;
+    int *ran;
+    int ndest, n, nb, k;
+
+    for (d = dlist, ndest = 0; d != NULL; d = d->next) ndest++;
+    if (!ndest) return;
+
+    lt = xmalloc(ndest * sizeof(struct lmtp_txn *));
+    remote = xmalloc(ndest * sizeof(struct backend *));
+    ran = xzmalloc(ndest * sizeof(int));
+    btxn = xmalloc(ndest * sizeof(struct lmtp_txn *));
+    bconn = xmalloc(ndest * sizeof(struct backend *));
+
+    /* set up the txns */
+    for (d = dlist, n = 0; d != NULL; d = d->next, n++) {
 	struct rcpt *rc;
-	struct backend *remote;
 	int i = 0;
 
-	lt->from = msgdata->return_path;
-	lt->auth = d->authas[0] ? d->authas : NULL;
-	lt->isdotstuffed = 0;
-	lt->tempfail_unknown_mailbox = 1;
+	lt[n] = LMTP_TXN_ALLOC(d->rnum);
+	lt[n]->from = msgdata->return_path;
+	lt[n]->auth = d->authas[0] ? d->authas : NULL;
+	lt[n]->isdotstuffed = 0;
+	lt[n]->tempfail_unknown_mailbox = 1;
 	
 	prot_rewind(msgdata->data);
-	lt->data = msgdata->data;
-	lt->rcpt_num = d->rnum;
-	rc = d->to;
+	lt[n]->data = msgdata->data;
+	lt[n]->rcpt_num = d->rnum;
 	for (rc = d->to; rc != NULL; rc = rc->next, i++) {
 	    assert(i < d->rnum);
-	    lt->rcpt[i].addr = rc->rcpt;
-	    lt->rcpt[i].ignorequota =
+	    lt[n]->rcpt[i].addr = rc->rcpt;
+	    lt[n]->rcpt[i].ignorequota =
 		msg_getrcpt_ignorequota(msgdata, rc->rcpt_num);
 	}
 	assert(i == d->rnum);
 
-	remote = proxy_findserver(d->server, &lmtp_protocol, "",
-				  &backend_cached, NULL, NULL, NULL);
-	if (remote) {
-	    lmtp_runtxn(remote, lt);
-	} else {
+	remote[n] = proxy_findserver(d->server, &lmtp_protocol, "",
+				     &backend_cached, NULL, NULL, NULL);
+	if (!remote[n]) {
 	    /* remote server not available; tempfail all deliveries */
-	    for (rc = d->to, i = 0; i < d->rnum; i++) {
-		lt->rcpt[i].result = RCPT_TEMPFAIL;
-		lt->rcpt[i].r = IMAP_SERVER_UNAVAILABLE;
+	    for (i = 0; i < d->rnum; i++) {
+		lt[n]->rcpt[i].result = RCPT_TEMPFAIL;
+		lt[n]->rcpt[i].r = IMAP_SERVER_UNAVAILABLE;
 	    }
+	    ran[n] = 1;
+	}
+    }
+
+    /* run the txns, talking to all of the servers at once; a server
+       with more than one txn (different authas) gets them in turn */
+    for (;;) {
+	for (n = 0, nb = 0; n < ndest; n++) {
+	    if (ran[n]) continue;
+	    for (k = 0; k < nb && bconn[k] != remote[n]; k++);
+	    if (k < nb) continue;
+	    bconn[nb] = remote[n];
+	    btxn[nb++] = lt[n];
+	    ran[n] = 1;
 	}
+	if (!nb) break;
+
+	if (nb == 1) prot_rewind(msgdata->data);
+	lmtp_runtxns(bconn, btxn, nb);
+    }
+
+    /* process results of the txns, propogating error state to the
+       recipients */
+    for (d = dlist, n = 0; d != NULL; d = d->next, n++) {
+	struct rcpt *rc;
+	int i;
 
-	/* process results of the txn, propogating error state to the
-	   recipients */
 	for (rc = d->to, i = 0; rc != NULL; rc = rc->next, i++) {
 	    int j = rc->rcpt_num;
 	    switch (status[j]) {
 	    case s_wait:
 		/* hmmm, if something fails we'll want to try an 
 		   error delivery */
-		if (lt->rcpt[i].result != RCPT_GOOD) {
+		if (lt[n]->rcpt[i].result != RCPT_GOOD) {
 		    status[j] = s_err;
 		}
 		break;
@@ -648,7 +679,7 @@ void deliver_remote(message_data_t *msgdata,
 		break;
 	    case nosieve:
 		/* this is the only delivery we're attempting for this rcpt */
-		msg_setrcpt_status(msgdata, j, lt->rcpt[i].r);
+		msg_setrcpt_status(msgdata, j, lt[n]->rcpt[i].r);
 		status[j] = done;
 		break;
 	    case done:
@@ -660,9 +691,14 @@ void deliver_remote(message_data_t *msgdata,
 	    }
 	}
 
-	free(lt);
-	d = d->next;
+	free(lt[n]);
     }
+
+    free(lt);
+    free(remote);
+    free(ran);
+    free(btxn);
+    free(bconn);
 }
 
 int deliver_local(deliver_data_t *mydata, const strarray_t *flags,
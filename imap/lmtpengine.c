@@ -1842,144 +1842,231 @@ static void pushmsg(struct protstream *in, struct protstream *out,
     }
 }
 
+/* something fatal happened during the transaction; assign 'code' to
+   all of its recipients */
+static void failall(struct lmtp_txn *txn, int code)
+{
+    int j;
+
+    for (j = 0; j < txn->rcpt_num; j++) {
+	if (ISGOOD(code)) {
+	    txn->rcpt[j].r = 0;
+	    txn->rcpt[j].result = RCPT_GOOD;
+	} else if (TEMPFAIL(code)) {
+	    txn->rcpt[j].r = IMAP_AGAIN;
+	    txn->rcpt[j].result = RCPT_TEMPFAIL;
+	} else if (PERMFAIL(code)) {
+	    txn->rcpt[j].r = IMAP_PROTOCOL_ERROR;
+	    txn->rcpt[j].result = RCPT_PERMFAIL;
+	} else {
+	    /* code should have been a valid number */
+	    abort();
+	}
+    }
+}
+
+/* send what's been written to every transaction still going, so that
+   all the servers work on it while we wait for the first one */
+static void flushall(struct backend **conns, int *going, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (going[i]) prot_flush(conns[i]->out);
+    }
+}
+
 int lmtp_runtxn(struct backend *conn, struct lmtp_txn *txn)
 {
-    int j, code, r = 0;
+    return lmtp_runtxns(&conn, &txn, 1);
+}
+
+/*
+ * Run transactions on 'n' different connections at once.  Each step
+ * (RSET, MAIL, each RCPT, DATA, the message and its replies) is sent on
+ * every connection before any reply is read, so the whole thing takes
+ * about as long as the slowest server rather than all of them together.
+ */
+int lmtp_runtxns(struct backend **conns, struct lmtp_txn **txns, int n)
+{
+    int i, j, code, r = 0, rr, maxrcpt = 0;
+    int *going, *onegood;
     char buf[8192];
-    int onegood;
 
-    assert(conn && txn);
-    /* pipelining v. no pipelining? */
+    going = xmalloc(n * sizeof(int));
+    onegood = xzmalloc(n * sizeof(int));
+    for (i = 0; i < n; i++) {
+	assert(conns[i] && txns[i]);
+	going[i] = 1;
+	if (txns[i]->rcpt_num > maxrcpt) maxrcpt = txns[i]->rcpt_num;
+    }
 
     /* here's the straightforward non-pipelining version */
 
     /* rset */
-    prot_printf(conn->out, "RSET\r\n");
-    r = getlastresp(buf, sizeof(buf)-1, &code, conn->in);
-    if (!ISGOOD(code)) {
-	goto failall;
+    for (i = 0; i < n; i++) {
+	prot_printf(conns[i]->out, "RSET\r\n");
+    }
+    flushall(conns, going, n);
+    for (i = 0; i < n; i++) {
+	rr = getlastresp(buf, sizeof(buf)-1, &code, conns[i]->in);
+	if (!ISGOOD(code)) {
+	    failall(txns[i], code);
+	    if (!r) r = rr;
+	    going[i] = 0;
+	}
     }
 
     /* mail from */
-    if (!txn->from) {
-	prot_printf(conn->out, "MAIL FROM:<>");
-    } else if (txn->from[0] == '<') {
-	prot_printf(conn->out, "MAIL FROM:%s", txn->from);
-    } else {
-	prot_printf(conn->out, "MAIL FROM:<%s>", txn->from);
-    }
-    if (CAPA(conn, CAPA_AUTH)) {
-	prot_printf(conn->out, " AUTH=%s", 
-		    txn->auth && txn->auth[0] ? txn->auth : "<>");
-    }
-    prot_printf(conn->out, "\r\n");
-    r = getlastresp(buf, sizeof(buf)-1, &code, conn->in);
-    if (!ISGOOD(code)) {
-	goto failall;
-    }
+    for (i = 0; i < n; i++) {
+	struct backend *conn = conns[i];
+	struct lmtp_txn *txn = txns[i];
 
-    /* rcpt to */
-    onegood = 0;
-    for (j = 0; j < txn->rcpt_num; j++) {
-	prot_printf(conn->out, "RCPT TO:<%s>", txn->rcpt[j].addr);
-	if (txn->rcpt[j].ignorequota && CAPA(conn, CAPA_IGNOREQUOTA)) {
-	    prot_printf(conn->out, " IGNOREQUOTA");
-	}
-	prot_printf(conn->out, "\r\n");
-	r = getlastresp(buf, sizeof(buf)-1, &code, conn->in);
-	if (r) {
-	    goto failall;
-	}
-	txn->rcpt[j].r = revconvert_lmtp(buf);
-	if (ISGOOD(code)) {
-	    onegood = 1;
-	    txn->rcpt[j].result = RCPT_GOOD;
-	} else if (TEMPFAIL(code)) {
-	    txn->rcpt[j].result = RCPT_TEMPFAIL;
-	} else if (PERMFAIL(code)) {
-	    if(txn->tempfail_unknown_mailbox &&
-	       txn->rcpt[j].r == IMAP_MAILBOX_NONEXISTENT) {
-		/* If there is a nonexistant error, we have been told
-		 * to mask it (e.g. proxy got out-of-date mupdate data) */
-		txn->rcpt[j].result = RCPT_TEMPFAIL;
-		txn->rcpt[j].r = IMAP_AGAIN;
-	    } else {
-		txn->rcpt[j].result = RCPT_PERMFAIL;
-	    }
+	if (!going[i]) continue;
+
+	if (!txn->from) {
+	    prot_printf(conn->out, "MAIL FROM:<>");
+	} else if (txn->from[0] == '<') {
+	    prot_printf(conn->out, "MAIL FROM:%s", txn->from);
 	} else {
-	    /* yikes?!? */
-	    code = 400;
-	    goto failall;
+	    prot_printf(conn->out, "MAIL FROM:<%s>", txn->from);
+	}
+	if (CAPA(conn, CAPA_AUTH)) {
+	    prot_printf(conn->out, " AUTH=%s", 
+			txn->auth && txn->auth[0] ? txn->auth : "<>");
 	}
+	prot_printf(conn->out, "\r\n");
     }
-    if (!onegood) {
-	/* all recipients failed! */
-	return 0;
+    flushall(conns, going, n);
+    for (i = 0; i < n; i++) {
+	if (!going[i]) continue;
+	rr = getlastresp(buf, sizeof(buf)-1, &code, conns[i]->in);
+	if (!ISGOOD(code)) {
+	    failall(txns[i], code);
+	    if (!r) r = rr;
+	    going[i] = 0;
+	}
     }
 
-    /* data */
-    prot_printf(conn->out, "DATA\r\n");
-    r = getlastresp(buf, sizeof(buf)-1, &code, conn->in);
-    if (r) {
-	goto failall;
-    }
-    if (code != 354) {
-	/* erg? */
-	if (ISGOOD(code)) code = 400;
-	r = IMAP_PROTOCOL_ERROR;
-	goto failall;
-    }
+    /* rcpt to */
+    for (j = 0; j < maxrcpt; j++) {
+	for (i = 0; i < n; i++) {
+	    struct backend *conn = conns[i];
+	    struct lmtp_txn *txn = txns[i];
 
-    /* send the data, dot-stuffing as needed */
-    pushmsg(txn->data, conn->out, txn->isdotstuffed);
+	    if (!going[i] || j >= txn->rcpt_num) continue;
 
-    /* read the response codes, one for each accepted RCPT TO */
-    for (j = 0; j < txn->rcpt_num; j++) {
-	if (txn->rcpt[j].result == RCPT_GOOD) {
-	    /* expecting a status code for this recipient */
-	    r = getlastresp(buf, sizeof(buf)-1, &code, conn->in);
-	    if (r) {
-		/* technically, some recipients might've succeeded here, 
-		   but we'll be paranoid */
-		goto failall;
+	    prot_printf(conn->out, "RCPT TO:<%s>", txn->rcpt[j].addr);
+	    if (txn->rcpt[j].ignorequota && CAPA(conn, CAPA_IGNOREQUOTA)) {
+		prot_printf(conn->out, " IGNOREQUOTA");
+	    }
+	    prot_printf(conn->out, "\r\n");
+	}
+	flushall(conns, going, n);
+	for (i = 0; i < n; i++) {
+	    struct lmtp_txn *txn = txns[i];
+
+	    if (!going[i] || j >= txn->rcpt_num) continue;
+
+	    rr = getlastresp(buf, sizeof(buf)-1, &code, conns[i]->in);
+	    if (rr) {
+		failall(txn, code);
+		if (!r) r = rr;
+		going[i] = 0;
+		continue;
 	    }
 	    txn->rcpt[j].r = revconvert_lmtp(buf);
 	    if (ISGOOD(code)) {
-		onegood = 1;
+		onegood[i] = 1;
 		txn->rcpt[j].result = RCPT_GOOD;
 	    } else if (TEMPFAIL(code)) {
 		txn->rcpt[j].result = RCPT_TEMPFAIL;
 	    } else if (PERMFAIL(code)) {
-		txn->rcpt[j].result = RCPT_PERMFAIL;
+		if(txn->tempfail_unknown_mailbox &&
+		   txn->rcpt[j].r == IMAP_MAILBOX_NONEXISTENT) {
+		    /* If there is a nonexistant error, we have been told
+		     * to mask it (e.g. proxy got out-of-date mupdate data) */
+		    txn->rcpt[j].result = RCPT_TEMPFAIL;
+		    txn->rcpt[j].r = IMAP_AGAIN;
+		} else {
+		    txn->rcpt[j].result = RCPT_PERMFAIL;
+		}
 	    } else {
 		/* yikes?!? */
-		txn->rcpt[j].result = RCPT_TEMPFAIL;
+		failall(txn, 400);
+		going[i] = 0;
 	    }
 	}
     }
-    
-    /* done with txn */
-    return 0;
-    
- failall:
-    /* something fatal happened during the transaction; we should assign
-       'code' to all recipients and return */
-    for (j = 0; j < txn->rcpt_num; j++) {
-	if (ISGOOD(code)) {
-	    txn->rcpt[j].r = 0;
-	    txn->rcpt[j].result = RCPT_GOOD;
-	} else if (TEMPFAIL(code)) {
-	    txn->rcpt[j].r = IMAP_AGAIN;
-	    txn->rcpt[j].result = RCPT_TEMPFAIL;
-	} else if (PERMFAIL(code)) {
-	    txn->rcpt[j].r = IMAP_PROTOCOL_ERROR;
-	    txn->rcpt[j].result = RCPT_PERMFAIL;
-	} else {
-	    /* code should have been a valid number */
-	    abort();
+    for (i = 0; i < n; i++) {
+	/* all recipients failed! */
+	if (!onegood[i]) going[i] = 0;
+    }
+
+    /* data */
+    for (i = 0; i < n; i++) {
+	if (going[i]) prot_printf(conns[i]->out, "DATA\r\n");
+    }
+    flushall(conns, going, n);
+    for (i = 0; i < n; i++) {
+	if (!going[i]) continue;
+	rr = getlastresp(buf, sizeof(buf)-1, &code, conns[i]->in);
+	if (!rr && code != 354) {
+	    /* erg? */
+	    if (ISGOOD(code)) code = 400;
+	    rr = IMAP_PROTOCOL_ERROR;
+	}
+	if (rr) {
+	    failall(txns[i], code);
+	    if (!r) r = rr;
+	    going[i] = 0;
 	}
     }
 
-    /* return overall error code already set */
+    /* send the data, dot-stuffing as needed; the servers start
+       delivering as soon as they have it all */
+    for (i = 0; i < n; i++) {
+	if (!going[i]) continue;
+	if (n > 1) prot_rewind(txns[i]->data);
+	pushmsg(txns[i]->data, conns[i]->out, txns[i]->isdotstuffed);
+	prot_flush(conns[i]->out);
+    }
+
+    /* read the response codes, one for each accepted RCPT TO */
+    for (i = 0; i < n; i++) {
+	struct lmtp_txn *txn = txns[i];
+
+	if (!going[i]) continue;
+
+	for (j = 0; j < txn->rcpt_num; j++) {
+	    if (txn->rcpt[j].result == RCPT_GOOD) {
+		/* expecting a status code for this recipient */
+		rr = getlastresp(buf, sizeof(buf)-1, &code, conns[i]->in);
+		if (rr) {
+		    /* technically, some recipients might've succeeded here, 
+		       but we'll be paranoid */
+		    failall(txn, code);
+		    if (!r) r = rr;
+		    break;
+		}
+		txn->rcpt[j].r = revconvert_lmtp(buf);
+		if (ISGOOD(code)) {
+		    txn->rcpt[j].result = RCPT_GOOD;
+		} else if (TEMPFAIL(code)) {
+		    txn->rcpt[j].result = RCPT_TEMPFAIL;
+		} else if (PERMFAIL(code)) {
+		    txn->rcpt[j].result = RCPT_PERMFAIL;
+		} else {
+		    /* yikes?!? */
+		    txn->rcpt[j].result = RCPT_TEMPFAIL;
+		}
+	    }
+	}
+    }
+
+    free(going);
+    free(onegood);
+
+    /* return the first error code, if any */
     return r;
 }
@@ -169,4 +169,9 @@ struct lmtp_txn {
 
 int lmtp_runtxn(struct backend *conn, struct lmtp_txn *txn);
 
+/* run 'n' transactions at once, each on a different connection; if
+   there's more than one, their data is rewound before it's sent, so
+   they may all share the same spooled message */
+int lmtp_runtxns(struct backend **conns, struct lmtp_txn **txns, int n);
+
 #endif /* LMTPENGINE_H */
@@ -1461,6 +1461,26 @@ int mailbox_read_index_record(struct mailbox *mailbox,
     return r;
 }
 
+/*
+ * Just the modseq of index record 'recno', without decoding (or
+ * checking) the rest of it, for callers looking for what's changed.
+ * A record past the end of the file always looks changed.
+ */
+modseq_t mailbox_read_index_modseq(struct mailbox *mailbox, uint32_t recno)
+{
+    const char *buf;
+    unsigned offset;
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+
+    if (offset + mailbox->i.record_size > mailbox->index_size)
+	return ~((modseq_t) 0);
+
+    buf = mailbox->index_base + offset;
+
+    return ntohll(*((bit64 *)(buf+OFFSET_MODSEQ)));
+}
+
 /*
  * bsearch() function to compare two index record buffers by UID
  */
@@ -3065,6 +3085,7 @@ static struct meta_file meta_files[] = {
     { META_INDEX,  0, 1 },
     { META_CACHE,  0, 1 },
     { META_SQUAT,  1, 0 },
+    { META_POPVIEW, 1, 0 },
     { 0, 0, 0 }
 };
 
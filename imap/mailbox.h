@@ -76,13 +76,15 @@
 #define FNAME_CACHE "/cyrus.cache"
 #define FNAME_SQUAT "/cyrus.squat"
 #define FNAME_EXPUNGE "/cyrus.expunge"
+#define FNAME_POPVIEW "/cyrus.popview"
 
 enum meta_filename {
   META_HEADER = 1,
   META_INDEX,
   META_CACHE,
   META_SQUAT,
-  META_EXPUNGE
+  META_EXPUNGE,
+  META_POPVIEW
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -450,6 +452,8 @@ extern void mailbox_modseq_dirty(struct mailbox *mailbox);
 extern int mailbox_read_index_record(struct mailbox *mailbox,
 				     uint32_t recno,
 				     struct index_record *record);
+extern modseq_t mailbox_read_index_modseq(struct mailbox *mailbox,
+					  uint32_t recno);
 extern int mailbox_rewrite_index_record(struct mailbox *mailbox,
 				        struct index_record *record);
 extern int mailbox_append_index_record(struct mailbox *mailbox,
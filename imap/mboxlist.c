@@ -68,6 +68,7 @@
 #include "assert.h"
 #include "global.h"
 #include "cyrusdb.h"
+#include "hash.h"
 #include "util.h"
 #include "mailbox.h"
 #include "exitcodes.h"
@@ -93,6 +94,24 @@ struct db *mbdb;
 
 static int mboxlist_dbopen = 0;
 
+/*
+ * Process-local cache of lookup results.  The whole cache belongs to
+ * one generation of the mailboxes file (see cyrusdb.h) and is thrown
+ * away as soon as that changes, so a hit costs a stat() rather than a
+ * locked walk of the database and a parse of the entry.
+ */
+struct mbcache_rec {
+    int r;				/* result of the lookup */
+    struct mboxlist_entry *mbentry;	/* only if r == 0 */
+    size_t alloclen;			/* size of mbentry->_alloc */
+};
+
+static hash_table mbcache;
+static char *mbcache_fname = NULL;	/* the mailboxes file */
+static struct cyrusdb_generation mbcache_gen;
+static int mbcache_size = 0;
+static int mbcache_count = 0;
+
 static int mboxlist_opensubs(const char *userid, struct db **ret);
 static void mboxlist_closesubs(struct db *sub);
 
@@ -289,18 +308,132 @@ static int mboxlist_parse_entry(struct mboxlist_entry **mbentryptr,
     return 0;
 }
 
+static void mbcache_freerec(void *data)
+{
+    struct mbcache_rec *rec = (struct mbcache_rec *) data;
+
+    mboxlist_entry_free(&rec->mbentry);
+    free(rec);
+}
+
+static void mbcache_flush(void)
+{
+    if (!mbcache_size) return;
+
+    free_hash_table(&mbcache, mbcache_freerec);
+    construct_hash_table(&mbcache, mbcache_size, 0);
+    mbcache_count = 0;
+}
+
+/* copy an entry whose buffer is 'alloclen' bytes long, pointing the
+ * fields into the new buffer */
+static struct mboxlist_entry *mbcache_copy(struct mboxlist_entry *src,
+					   size_t alloclen)
+{
+    struct mboxlist_entry *dst = mboxlist_entry_create();
+
+#define MBCACHE_REBASE(field) \
+    if (src->field) dst->field = dst->_alloc + (src->field - src->_alloc)
+
+    dst->_alloc = xmalloc(alloclen);
+    memcpy(dst->_alloc, src->_alloc, alloclen);
+    dst->mbtype = src->mbtype;
+    MBCACHE_REBASE(name);
+    MBCACHE_REBASE(partition);
+    MBCACHE_REBASE(server);
+    MBCACHE_REBASE(acl);
+    MBCACHE_REBASE(specialuse);
+    MBCACHE_REBASE(uniqueid);
+
+#undef MBCACHE_REBASE
+
+    return dst;
+}
+
+/* get the current generation of the mailboxes file, discarding the
+ * cache if it belongs to an older one.  Returns 0 if the cache can't
+ * be used. */
+static int mbcache_getgen(struct cyrusdb_generation *gen)
+{
+    if (!mbcache_size || !DB->generation) return 0;
+
+    if (DB->generation(mbcache_fname, gen)) return 0;
+
+    if (!CYRUSDB_GENERATION_EQUAL(gen, &mbcache_gen)) {
+	mbcache_flush();
+	mbcache_gen = *gen;
+    }
+
+    return 1;
+}
+
+static void mbcache_store(const char *name, struct cyrusdb_generation *gen,
+			  int r, struct mboxlist_entry *mbentry,
+			  size_t alloclen)
+{
+    struct cyrusdb_generation now;
+    struct mbcache_rec *rec;
+
+    /* only keep the result if nothing changed while we were reading */
+    if (DB->generation(mbcache_fname, &now) ||
+	!CYRUSDB_GENERATION_EQUAL(gen, &now))
+	return;
+
+    if (mbcache_count >= mbcache_size) mbcache_flush();
+
+    rec = xzmalloc(sizeof(struct mbcache_rec));
+    rec->r = r;
+    rec->alloclen = alloclen;
+    if (mbentry) rec->mbentry = mbcache_copy(mbentry, alloclen);
+
+    hash_insert(name, rec, &mbcache);
+    mbcache_count++;
+}
+
 static int mboxlist_mylookup(const char *name,
 			     struct mboxlist_entry **mbentryptr,
 			     struct txn **tid, int wrlock)
 {
     int r;
-    const char *data;
-    int datalen;
+    const char *data = NULL;
+    int datalen = 0;
+    struct cyrusdb_generation gen;
+    struct mboxlist_entry *mbentry = NULL;
+    int usecache;
+
+    /* transactions and write locks always go to the database */
+    usecache = !tid && !wrlock && mbcache_getgen(&gen);
+
+    if (usecache) {
+	struct mbcache_rec *rec = hash_lookup(name, &mbcache);
+
+	if (rec) {
+	    if (!rec->r && mbentryptr)
+		*mbentryptr = mbcache_copy(rec->mbentry, rec->alloclen);
+	    return rec->r;
+	}
+    }
 
     r = mboxlist_read(name, &data, &datalen, tid, wrlock);
-    if (r) return r;
+    if (!usecache) {
+	if (r) return r;
+	return mboxlist_parse_entry(mbentryptr, name, data, datalen);
+    }
+
+    if (!r) r = mboxlist_parse_entry(&mbentry, name, data, datalen);
+
+    switch (r) {
+    case 0:
+    case IMAP_MAILBOX_NONEXISTENT:
+    case IMAP_MAILBOX_RESERVED:
+	mbcache_store(name, &gen, r, mbentry, strlen(name) + datalen + 2);
+	break;
+    }
+
+    if (mbentryptr) *mbentryptr = mbentry;
+    else mboxlist_entry_free(&mbentry);
 
-    return mboxlist_parse_entry(mbentryptr, name, data, datalen);
+    return r;
 }
 
 /*
@@ -1049,7 +1182,11 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
     }
     if (r && !force) goto done;
 
-    /* delete entry */
+    /* delete entry.  this is deliberately one key, not a
+     * cyrusdb_delete_range() of the hierarchy: callers delete each
+     * child through here so that its ACL is checked, its mupdate entry
+     * and mailbox files go with it, and one failure doesn't lose the
+     * others' entries. */
     r = DB->delete(mbdb, name, strlen(name), NULL, 0);
     if (r) {
 	syslog(LOG_ERR, "DBERROR: error deleting %s: %s",
@@ -2714,9 +2851,18 @@ void mboxlist_open(const char *fname)
 	fatal("can't read mailboxes file", EC_TEMPFAIL);
     }    
 
-    free(tofree);
-
     mboxlist_dbopen = 1;
+
+    mbcache_size = config_getint(IMAPOPT_MBOXLIST_CACHE_SIZE);
+    if (mbcache_size < 0) mbcache_size = 0;
+    if (mbcache_size) {
+	construct_hash_table(&mbcache, mbcache_size, 0);
+	mbcache_fname = xstrdup(fname);
+	mbcache_count = 0;
+	memset(&mbcache_gen, 0, sizeof(mbcache_gen));
+    }
+
+    free(tofree);
 }
 
 void mboxlist_close(void)
@@ -2730,6 +2876,13 @@ void mboxlist_close(void)
 		   cyrusdb_strerror(r));
 	}
 	mboxlist_dbopen = 0;
+
+	if (mbcache_size) {
+	    free_hash_table(&mbcache, mbcache_freerec);
+	    free(mbcache_fname);
+	    mbcache_fname = NULL;
+	    mbcache_size = 0;
+	}
     }
 }
 
@@ -1308,6 +1308,11 @@ char *mboxname_metapath(const char *partition, const char *mboxname,
 	metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
 	filename = FNAME_SQUAT;
 	break;
+    case META_POPVIEW:
+	snprintf(confkey, 256, "metadir-popview-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_POPVIEW;
+	filename = FNAME_POPVIEW;
+	break;
     case 0:
 	break;
     default:
@@ -134,6 +134,7 @@ struct conn {
     int compress_done;  /* have we done a successful compress? */
 
     int idle;
+    int watched; /* pin is in idle_group */
     
     char clienthost[NI_MAXHOST*2+1];
 
@@ -188,6 +189,10 @@ static int listener_lock = 0;
  * idle_connlist_mutex locked to remove anything from the idle_connlist */
 static pthread_mutex_t idle_connlist_mutex = PTHREAD_MUTEX_INITIALIZER;
 struct conn *idle_connlist = NULL; /* protected by listener_mutex */
+/* the pin of each idle connection the listener has seen, kept from one
+ * prot_select() to the next so they don't have to be registered again;
+ * only used by the thread holding listener_lock */
+static struct protgroup *idle_group = NULL;
 static pthread_mutex_t connection_count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int connection_count = 0;
 static pthread_mutex_t idle_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -1105,7 +1110,6 @@ static void *thread_main(void *rock __attribute__((unused)))
 {
     struct conn *C; /* used for loops */
     struct conn *currConn = NULL; /* the connection we care about currently */
-    struct protgroup *protin = protgroup_new(PROTGROUP_SIZE_DEFAULT);
     struct protgroup *protout = NULL;
     struct timeval now;
     struct timespec timeout;
@@ -1191,24 +1195,26 @@ static void *thread_main(void *rock __attribute__((unused)))
 
 	connflag = 0;
 
-	/* Reset protin to all zeros (to preserve memory allocation) */
-	protgroup_reset(protin);
-
 	/* Clear protout if needed */
 	protgroup_free(protout);
 	protout = NULL;
 	
-	/* Build list of idle protstreams */
+	/* Add connections which have gone idle since we last looked to
+	 * the idle protstreams.  They're added to the front of
+	 * idle_connlist, so the ones we've already seen are all at
+	 * the end of it */
+	if (!idle_group) idle_group = protgroup_new_watched(0);
 	pthread_mutex_lock(&idle_connlist_mutex); /* LOCK */
-	for (C=idle_connlist; C; C=C->next_idle) {
+	for (C=idle_connlist; C && !C->watched; C=C->next_idle) {
 	    assert(C->idle);
 
-	    protgroup_insert(protin, C->pin);
+	    protgroup_insert(idle_group, C->pin);
+	    C->watched = 1;
 	}
 	pthread_mutex_unlock(&idle_connlist_mutex); /* UNLOCK */
 	
 	/* Select on Idle Conns + conn_pipe */
-	if (prot_select(protin, conn_pipe[0],
+	if (prot_select(idle_group, conn_pipe[0],
 		       &protout, &connflag, NULL) == -1) {
 	    syslog(LOG_ERR, "prot_select() failed in thread_main: %m");
 	    fatal("prot_select() failed in thread_main", EC_TEMPFAIL);
@@ -1229,6 +1235,7 @@ static void *thread_main(void *rock __attribute__((unused)))
 	     * instead be freed when they drop out of their docmd() below */
 
 	    pthread_mutex_lock(&idle_connlist_mutex); /* LOCK */
+	    protgroup_reset(idle_group);
 	    for (C=idle_connlist; C; C = ni) {
 		ni = C->next_idle;
 
@@ -1236,6 +1243,7 @@ static void *thread_main(void *rock __attribute__((unused)))
 			    "* BYE \"no longer ready for connections\"\r\n");
 
 		C->idle = 0;
+		C->watched = 0;
 		conn_free(C);
 	    }
 	    idle_connlist = NULL;
@@ -1287,6 +1295,9 @@ static void *thread_main(void *rock __attribute__((unused)))
 	    }
 	    pthread_mutex_unlock(&idle_connlist_mutex); /* UNLOCK */
 
+	    protgroup_delete(idle_group, currConn->pin);
+	    currConn->watched = 0;
+
 	    do_a_command = 1;	    
 	}
 
@@ -1393,7 +1404,6 @@ static void *thread_main(void *rock __attribute__((unused)))
     pthread_mutex_unlock(&idle_worker_mutex); /* UNLOCK */
     pthread_mutex_unlock(&worker_count_mutex); /* UNLOCK */
 
-    protgroup_free(protin);
     protgroup_free(protout);
 
     return NULL;
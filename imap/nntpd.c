@@ -101,6 +101,7 @@
 #include "prot.h"
 #include "proxy.h"
 #include "retry.h"
+#include "scoreboard.h"
 #include "times.h"
 #include "smtpclient.h"
 #include "spool.h"
@@ -879,6 +880,8 @@ static void cmdloop(void)
 	for (p = &cmd.s[1]; *p; p++) {
 	    if (Uisupper(*p)) *p = tolower((unsigned char) *p);
 	}
+	scoreboard_command(cmd.s, prot_bytes_in(nntp_in),
+			   prot_bytes_out(nntp_out));
 
 	/* Ihave/Takethis only allowed for feeders */
 	if (!(nntp_capa & MODE_FEED) &&
@@ -55,6 +55,8 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -88,6 +90,8 @@
 #include "backend.h"
 #include "proc.h"
 #include "proxy.h"
+#include "retry.h"
+#include "scoreboard.h"
 #include "seen.h"
 #include "userdeny.h"
 
@@ -141,6 +145,31 @@ struct msg {
     int seen;
 } *popd_msg = NULL;
 
+/*
+ * The maildrop as POP3 sees it (the records we show, in order) is
+ * kept in cyrus.popview, with enough of the index header to tell what
+ * has changed since it was written.  A login then only has to read the
+ * records that were changed or added, not the whole index.
+ */
+#define POPVIEW_MAGIC 0x43505631 /* "CPV1" */
+
+struct popview_header {
+    uint32_t magic;
+    uint32_t uidvalidity;
+    uint32_t generation_no;
+    uint32_t num_records;
+    modseq_t highestmodseq;
+    time_t show_after;
+    uint32_t useimapflags;
+    uint32_t count;
+};
+
+struct popview_entry {
+    uint32_t recno;
+    uint32_t uid;
+    uint32_t size;
+};
+
 static sasl_ssf_t extprops_ssf = 0;
 static int pop3s = 0;
 int popd_starttls_done = 0;
@@ -187,6 +216,7 @@ static void cmd_pass(char *pass);
 static void cmd_user(char *user);
 static void cmd_starttls(int pop3s);
 static int blat(int msg, int lines);
+static uint32_t popview_build(void);
 static int openinbox(void);
 static void cmdloop(void);
 static void kpop(void);
@@ -930,6 +960,8 @@ static void cmdloop(void)
 	    arg = 0;
 	}
 	lcase(inputbuf);
+	scoreboard_command(inputbuf, prot_bytes_in(popd_in),
+			   prot_bytes_out(popd_out));
 
 	if (!strcmp(inputbuf, "quit")) {
 	    if (!arg) {
@@ -1041,8 +1073,12 @@ done:
 	    else {
 		prot_printf(popd_out, "+OK scan listing follows\r\n");
 		for (msgno = 1; msgno <= popd_exists; msgno++) {
-		    if (!popd_msg[msgno].deleted)
-			prot_printf(popd_out, "%u %u\r\n", msgno, popd_msg[msgno].size);
+		    if (!popd_msg[msgno].deleted) {
+			prot_printnum(popd_out, msgno);
+			(void)prot_putc(' ', popd_out);
+			prot_printnum(popd_out, popd_msg[msgno].size);
+			prot_write(popd_out, "\r\n", 2);
+		    }
 		}
 		prot_printf(popd_out, ".\r\n");
 	    }
@@ -1187,14 +1223,14 @@ int msg_exists_or_err(uint32_t msgno)
 
 void uidl_msg(uint32_t msgno)
 {
+    prot_printnum(popd_out, msgno);
+    (void)prot_putc(' ', popd_out);
     if (popd_mailbox->i.options & OPT_POP3_NEW_UIDL) {
-	prot_printf(popd_out, "%u %u.%u\r\n", msgno, 
-		    popd_mailbox->i.uidvalidity,
-		    popd_msg[msgno].uid);
-    } else {
-	prot_printf(popd_out, "%u %u\r\n", msgno,
-		    popd_msg[msgno].uid);
+	prot_printnum(popd_out, popd_mailbox->i.uidvalidity);
+	(void)prot_putc('.', popd_out);
     }
+    prot_printnum(popd_out, popd_msg[msgno].uid);
+    prot_write(popd_out, "\r\n", 2);
 }
 
 #ifdef HAVE_SSL
@@ -1790,8 +1826,6 @@ int openinbox(void)
     }
     else {
 	/* local mailbox */
-	uint32_t recno, msgno;
-	struct index_record record;
 	int minpoll;
 
 	popd_login_time = time(0);
@@ -1832,40 +1866,8 @@ int openinbox(void)
 	    goto fail;
 	}
 
-	popd_msg = (struct msg *) xrealloc(popd_msg, (popd_mailbox->i.exists+1) *
-					   sizeof(struct msg));
 	config_popuseimapflags = config_getswitch(IMAPOPT_POPUSEIMAPFLAGS);
-	msgno = 0;
-	for (recno = 1; recno <= popd_mailbox->i.num_records; recno++) {
-	    if (mailbox_read_index_record(popd_mailbox, recno, &record))
-		break;
-
-	    if (record.system_flags & FLAG_EXPUNGED)
-		continue;
-
-	    if (config_popuseimapflags &&
-		(record.system_flags & FLAG_DELETED)) {
-		/* Ignore \Deleted messages */
-		continue;
-	    }
-
-	    if (popd_mailbox->i.pop3_show_after &&
-		record.internaldate <= popd_mailbox->i.pop3_show_after) {
-		/* Ignore messages older than the "show after" date */
-		continue;
-	    }
-
-	    msgno++;
-	    popd_msg[msgno].recno = recno;
-	    popd_msg[msgno].uid = record.uid;
-	    popd_msg[msgno].size = record.size;
-	    popd_msg[msgno].deleted = 0;
-	    popd_msg[msgno].seen = 0;
-
-	    if (msgno >= popd_mailbox->i.exists)
-		break; /* we're full! */
-	}
-	popd_exists = msgno;
+	popd_exists = popview_build();
 
 	/* finished our initial read */
 	mailbox_unlock_index(popd_mailbox, NULL);
@@ -1934,42 +1936,292 @@ int openinbox(void)
     return 1;
 }
 
+/* does POP3 show this record? */
+static int popview_wants(struct index_record *record)
+{
+    if (record->system_flags & FLAG_EXPUNGED)
+	return 0;
+
+    if (config_popuseimapflags &&
+	(record->system_flags & FLAG_DELETED)) {
+	/* Ignore \Deleted messages */
+	return 0;
+    }
+
+    if (popd_mailbox->i.pop3_show_after &&
+	record->internaldate <= popd_mailbox->i.pop3_show_after) {
+	/* Ignore messages older than the "show after" date */
+	return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Read the cached view of the maildrop, if there is one and it was
+ * made from this index and with these settings.
+ */
+static int popview_read(struct popview_header *h,
+			struct popview_entry **entries)
+{
+    const char *fname = mailbox_meta_fname(popd_mailbox, META_POPVIEW);
+    struct stat sbuf;
+    size_t len;
+    int fd;
+
+    *entries = NULL;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return IMAP_IOERROR;
+
+    if (fstat(fd, &sbuf) == -1 ||
+	retry_read(fd, (char *) h, sizeof(*h)) != sizeof(*h) ||
+	h->magic != POPVIEW_MAGIC ||
+	h->uidvalidity != popd_mailbox->i.uidvalidity ||
+	h->generation_no != popd_mailbox->i.generation_no ||
+	h->num_records > popd_mailbox->i.num_records ||
+	h->highestmodseq > popd_mailbox->i.highestmodseq ||
+	h->show_after != popd_mailbox->i.pop3_show_after ||
+	h->useimapflags != (uint32_t) config_popuseimapflags ||
+	h->count > h->num_records ||
+	(size_t) sbuf.st_size !=
+	    sizeof(*h) + h->count * sizeof(struct popview_entry)) {
+	close(fd);
+	return IMAP_IOERROR;
+    }
+
+    len = h->count * sizeof(struct popview_entry);
+    *entries = xmalloc(len + 1);
+    if ((size_t) retry_read(fd, (char *) *entries, len) != len) {
+	free(*entries);
+	*entries = NULL;
+	close(fd);
+	return IMAP_IOERROR;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* replace the cached view; if we can't, the next login rebuilds it */
+static void popview_write(struct popview_header *h,
+			  struct popview_entry *entries)
+{
+    const char *fname = mailbox_meta_newfname(popd_mailbox, META_POPVIEW);
+    struct iovec iov[2];
+    size_t len = sizeof(*h) + h->count * sizeof(struct popview_entry);
+    int fd;
+
+    fd = open(fname, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+	return;
+    }
+
+    iov[0].iov_base = (char *) h;
+    iov[0].iov_len = sizeof(*h);
+    iov[1].iov_base = (char *) entries;
+    iov[1].iov_len = h->count * sizeof(struct popview_entry);
+
+    if ((size_t) retry_writev(fd, iov, 2) != len) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+	close(fd);
+	unlink(fname);
+	return;
+    }
+    close(fd);
+
+    if (mailbox_meta_rename(popd_mailbox, META_POPVIEW)) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", fname);
+	unlink(fname);
+    }
+}
+
+/*
+ * Fill in popd_msg[] from the (locked) maildrop and return how many
+ * messages there are.  Records that haven't changed since the cached
+ * view was made are taken from it; only new and changed records are
+ * read from the index.
+ */
+static uint32_t popview_build(void)
+{
+    struct popview_header h;
+    struct popview_entry *old = NULL, *new;
+    struct index_record record;
+    uint32_t recno, i = 0, n = 0;
+    uint32_t exists = popd_mailbox->i.exists;
+    int changed = 0, r = 0;
+
+    if (popview_read(&h, &old)) {
+	/* nothing we can use; every record is new */
+	h.num_records = 0;
+	h.highestmodseq = 0;
+	h.count = 0;
+	changed = 1;
+    }
+
+    if (!changed && h.num_records == popd_mailbox->i.num_records &&
+	h.highestmodseq == popd_mailbox->i.highestmodseq) {
+	/* nothing has happened since */
+	new = old;
+	n = h.count;
+    }
+    else {
+	new = xmalloc((exists + 1) * sizeof(struct popview_entry));
+
+	for (recno = 1; recno <= popd_mailbox->i.num_records; recno++) {
+	    int had = (i < h.count && old[i].recno == recno);
+
+	    if (had) i++;
+
+	    if (recno <= h.num_records &&
+		mailbox_read_index_modseq(popd_mailbox, recno) <=
+		h.highestmodseq) {
+		/* unchanged; it's in the view or it isn't */
+		if (had) new[n++] = old[i-1];
+	    }
+	    else {
+		changed = 1;
+
+		r = mailbox_read_index_record(popd_mailbox, recno, &record);
+		if (r) break;
+
+		if (!popview_wants(&record))
+		    continue;
+
+		new[n].recno = recno;
+		new[n].uid = record.uid;
+		new[n].size = record.size;
+		n++;
+	    }
+
+	    if (n >= exists)
+		break; /* we're full! */
+	}
+	free(old);
+    }
+
+    if (changed && !r) {
+	h.magic = POPVIEW_MAGIC;
+	h.uidvalidity = popd_mailbox->i.uidvalidity;
+	h.generation_no = popd_mailbox->i.generation_no;
+	h.num_records = popd_mailbox->i.num_records;
+	h.highestmodseq = popd_mailbox->i.highestmodseq;
+	h.show_after = popd_mailbox->i.pop3_show_after;
+	h.useimapflags = config_popuseimapflags;
+	h.count = n;
+	popview_write(&h, new);
+    }
+
+    popd_msg = (struct msg *) xrealloc(popd_msg, (n + 1) * sizeof(struct msg));
+    for (i = 0; i < n; i++) {
+	popd_msg[i+1].recno = new[i].recno;
+	popd_msg[i+1].uid = new[i].uid;
+	popd_msg[i+1].size = new[i].size;
+	popd_msg[i+1].deleted = 0;
+	popd_msg[i+1].seen = 0;
+    }
+    free(new);
+
+    return n;
+}
+
+/*
+ * Find where to stop sending the message at 'base' for a TOP of
+ * 'lines' lines: the end of the header, the blank line after it and
+ * then 'lines' lines of the body.  A negative 'lines' is the whole
+ * message.
+ */
+static unsigned long blat_end(const char *base, unsigned long len, int lines)
+{
+    const char *p = base, *end = base + len;
+
+    if (lines < 0) return len;
+
+    /* find the blank line ending the header */
+    while (p < end && !(p[0] == '\r' && p + 1 < end && p[1] == '\n')) {
+	p = memchr(p, '\n', end - p);
+	if (!p) return len;
+	p++;
+    }
+    if (p == end) return len;
+    p += 2;
+
+    /* then count off the body lines */
+    while (lines-- > 0 && p < end) {
+	p = memchr(p, '\n', end - p);
+	if (!p) return len;
+	p++;
+    }
+
+    return p - base;
+}
+
+/*
+ * Send the message (or the first 'lines' lines of it) from the mapped
+ * message file.  We only look for the dots that start a line, which is
+ * what needs stuffing; everything between them goes out as one write,
+ * or straight from the file if the connection allows it.
+ */
 static int blat(int msgno, int lines)
 {
-    FILE *msgfile;
-    char buf[4096];
-    char *fname;
-    int thisline = -2;
+    const char *msg_base = NULL, *p, *start, *end;
+    unsigned long msg_size = 0, len;
+    int fd = -1;
 
-    fname = mailbox_message_fname(popd_mailbox, popd_msg[msgno].uid);
-    msgfile = fopen(fname, "r");
-    if (!msgfile) {
+    if (mailbox_map_message(popd_mailbox, popd_msg[msgno].uid,
+			    &msg_base, &msg_size)) {
 	prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
 	return IMAP_IOERROR;
     }
-    prot_printf(popd_out, "+OK Message follows\r\n");
-    while (lines != thisline) {
-	if (!fgets(buf, sizeof(buf), msgfile)) break;
 
-	if (thisline < 0) {
-	    if (buf[0] == '\r' && buf[1] == '\n') thisline = 0;
-	}
-	else thisline++;
+    len = blat_end(msg_base, msg_size, lines);
 
-	if (buf[0] == '.') 
+    /* large messages can go from the file straight to the socket */
+    if (len >= PROT_SENDFILE_MIN && prot_cansendfile(popd_out)) {
+	fd = open(mailbox_message_fname(popd_mailbox, popd_msg[msgno].uid),
+		  O_RDONLY);
+    }
+
+    prot_printf(popd_out, "+OK Message follows\r\n");
+
+    start = p = msg_base;
+    end = msg_base + len;
+    while (p < end && (p = memchr(p, '.', end - p))) {
+	if (p == msg_base || p[-1] == '\n') {
+	    /* line starts with a dot; send up to it and stuff another */
+	    if (p > start) {
+		if (fd != -1) {
+		    prot_sendfile(popd_out, fd, start, start - msg_base,
+				  p - start);
+		}
+		else {
+		    prot_write(popd_out, start, p - start);
+		}
+	    }
 	    (void)prot_putc('.', popd_out);
-	do {
-	    prot_printf(popd_out, "%s", buf);
+	    start = p;
+	}
+	p++;
+    }
+    if (end > start) {
+	if (fd != -1) {
+	    prot_sendfile(popd_out, fd, start, start - msg_base, end - start);
+	}
+	else {
+	    prot_write(popd_out, start, end - start);
 	}
-	while (buf[strlen(buf)-1] != '\n' && fgets(buf, sizeof(buf), msgfile));
     }
-    fclose(msgfile);
 
     /* Protect against messages not ending in CRLF */
-    if (buf[strlen(buf)-1] != '\n') prot_printf(popd_out, "\r\n");
+    if (len && end[-1] != '\n') prot_printf(popd_out, "\r\n");
 
     prot_printf(popd_out, ".\r\n");
 
+    if (fd != -1) close(fd);
+    mailbox_unmap_message(popd_mailbox, popd_msg[msgno].uid,
+			  &msg_base, &msg_size);
+
     /* Reset inactivity timer in case we spend a long time
        pushing data to the client over a slow link. */
     prot_resettimeout(popd_in);
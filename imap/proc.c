@@ -57,6 +57,7 @@
 #include "global.h"
 #include "proc.h"
 #include "retry.h"
+#include "scoreboard.h"
 #include "xmalloc.h"
 
 #ifdef HAVE_DIRENT_H
@@ -139,6 +140,8 @@ int proc_register(const char *progname, const char *clienthost,
 		 userid ? userid : "",
 		 mailbox ? mailbox : "");
 
+    scoreboard_session(clienthost, userid, mailbox);
+
     return 0;
 }
 
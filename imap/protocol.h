@@ -109,6 +109,8 @@ struct protocol_t {
     struct simple_cmd_t compress_cmd;
     struct simple_cmd_t ping_cmd;
     struct simple_cmd_t logout_cmd;
+    struct simple_cmd_t reset_cmd;	/* [OPTIONAL] return to the
+					   authenticated state */
 };
 
 #endif /* _INCLUDED_PROTOCOL_H */
@@ -141,6 +141,137 @@ backend_timeout(struct protstream *s __attribute__((unused)),
     }
 }
 
+/*
+ * Authenticated backend connections kept from earlier client sessions
+ * of this process.  The authorization identity can't change once a
+ * connection is authenticated, so each is only any use to a later
+ * session proxying for the same user.
+ */
+struct pooled_backend {
+    struct backend *be;
+    char *userid;
+    time_t expire;
+};
+
+static struct pooled_backend *backend_pool = NULL;
+static int backend_pool_count = 0;
+
+static struct backend *proxy_unpool(int i)
+{
+    struct backend *be = backend_pool[i].be;
+
+    free(backend_pool[i].userid);
+    backend_pool[i] = backend_pool[--backend_pool_count];
+
+    return be;
+}
+
+static void proxy_freepooled(struct backend *be)
+{
+    backend_disconnect(be);
+    free(be);
+}
+
+int proxy_releaseserver(struct backend *s, const char *userid)
+{
+    int max = config_getint(IMAPOPT_PROXY_POOL_SIZE);
+    char buf[1024];
+
+    if (max <= 0 || !s || s->sock == -1 || !s->prot->reset_cmd.cmd ||
+	prot_error(s->in) || s->context || s->enabled || s->incomplete) {
+	return 0;
+    }
+
+    /* the client session is going away */
+    if (s->inbox && (s == *(s->inbox))) *(s->inbox) = NULL;
+    if (s->current && (s == *(s->current))) *(s->current) = NULL;
+    s->inbox = s->current = NULL;
+    if (s->timeout) prot_removewaitevent(s->clientin, s->timeout);
+    s->timeout = NULL;
+    s->clientin = NULL;
+
+    /* leave the server as if we'd just authenticated; if it doesn't
+     * answer promptly, we don't know what state it's in */
+    prot_settimeout(s->in, 5);
+    prot_printf(s->out, "%s\r\n", s->prot->reset_cmd.cmd);
+    prot_flush(s->out);
+    for (;;) {
+	if (!prot_fgets(buf, sizeof(buf), s->in)) {
+	    prot_settimeout(s->in, 0);
+	    return 0;
+	}
+	if (!strncmp(s->prot->reset_cmd.ok, buf,
+		     strlen(s->prot->reset_cmd.ok))) {
+	    break;
+	}
+	/* anything else is unsolicited */
+    }
+    prot_settimeout(s->in, 0);
+
+    if (backend_pool_count == max) {
+	/* make room by dropping the one that expires soonest */
+	int i, oldest = 0;
+
+	for (i = 1; i < backend_pool_count; i++) {
+	    if (backend_pool[i].expire < backend_pool[oldest].expire)
+		oldest = i;
+	}
+	proxy_freepooled(proxy_unpool(oldest));
+    }
+    if (!backend_pool) {
+	backend_pool = xmalloc(max * sizeof(struct pooled_backend));
+    }
+
+    backend_pool[backend_pool_count].be = s;
+    backend_pool[backend_pool_count].userid = xstrdup(userid ? userid : "");
+    backend_pool[backend_pool_count].expire =
+	time(NULL) + config_getint(IMAPOPT_PROXY_POOL_TIMEOUT);
+    backend_pool_count++;
+
+    return 1;
+}
+
+/* find a kept connection to 'server' for 'userid' which still works */
+static struct backend *proxy_leaseserver(const char *server,
+					 struct protocol_t *prot,
+					 const char *userid)
+{
+    time_t now = time(NULL);
+    int i = 0;
+
+    if (!userid) userid = "";
+
+    while (i < backend_pool_count) {
+	struct pooled_backend *p = &backend_pool[i];
+
+	if (p->expire < now) {
+	    proxy_freepooled(proxy_unpool(i));
+	}
+	else if (p->be->prot == prot && !strcmp(p->be->hostname, server) &&
+		 !strcmp(p->userid, userid)) {
+	    struct backend *be = proxy_unpool(i);
+
+	    if (backend_ping(be)) {
+		proxy_freepooled(be);
+		continue;
+	    }
+	    return be;
+	}
+	else i++;
+    }
+
+    return NULL;
+}
+
+void proxy_emptypool(void)
+{
+    while (backend_pool_count) {
+	proxy_freepooled(proxy_unpool(backend_pool_count - 1));
+    }
+    free(backend_pool);
+    backend_pool = NULL;
+}
+
 /* return the connection to the server */
 struct backend *
 proxy_findserver(const char *server,		/* hostname of backend */
@@ -175,9 +306,23 @@ proxy_findserver(const char *server,		/* hostname of backend */
     }
 
     if (!ret || (ret->sock == -1)) {
-	/* need to (re)establish connection to server or create one */
-	ret = backend_connect(ret, server, prot, userid, NULL, NULL);
-	if (!ret) return NULL;
+	struct backend *pooled = proxy_leaseserver(server, prot, userid);
+
+	if (pooled && ret) {
+	    /* reuse the kept connection in the cached slot; the copy
+	     * takes over pooled's buffer, so let go of the slot's own */
+	    buf_free(&ret->last_result);
+	    *ret = *pooled;
+	    free(pooled);
+	}
+	else if (pooled) {
+	    ret = pooled;
+	}
+	else {
+	    /* need to (re)establish connection to server or create one */
+	    ret = backend_connect(ret, server, prot, userid, NULL, NULL);
+	    if (!ret) return NULL;
+	}
 
 	if (clientin) {
 	    /* add the timeout */
@@ -77,6 +77,13 @@ proxy_findserver(const char *server, struct protocol_t *prot,
 
 void proxy_downserver(struct backend *s);
 
+/* Keep a connection for a later session proxying as 'userid';
+ * returns 1 if it was kept (and is no longer the caller's) */
+int proxy_releaseserver(struct backend *s, const char *userid);
+
+/* Log out of every kept connection */
+void proxy_emptypool(void);
+
 int proxy_check_input(struct protgroup *protin,
 		      struct protstream *clientin,
 		      struct protstream *clientout,
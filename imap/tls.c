@@ -105,6 +105,9 @@
 /* System library. */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -115,12 +118,16 @@
 #include <openssl/lhash.h>
 #include <openssl/bn.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
 
 /* Application-specific. */
 #include "assert.h"
+#include "cyr_lock.h"
 #include "nonblock.h"
 #include "xmalloc.h"
 #include "xstrlcat.h"
@@ -136,6 +143,44 @@
 static struct db *sessdb = NULL;
 static int sess_dbopen = 0;
 
+/*
+ * The shared memory session cache is a file mapped by every process,
+ * locked with the usual file locks.  After a header holding the session
+ * ticket keys come the slots, in sets of TLS_SHM_WAYS: a session can
+ * only go in the set its id hashes to, replacing the one that expires
+ * soonest when the set is full.
+ */
+#define TLS_SHM_MAGIC "Cyrus TLS cache"
+#define TLS_SHM_WAYS 4
+#define TLS_SHM_DATALEN 1024	/* bigger sessions only go in the db */
+
+struct tls_shm_key {
+    unsigned char name[16];
+    unsigned char hmac[16];
+    unsigned char aes[16];
+    time_t created;
+};
+
+struct tls_shm_header {
+    char magic[16];
+    unsigned nslots;
+    unsigned slotsize;
+    struct tls_shm_key keys[2];	/* current and previous ticket keys */
+};
+
+struct tls_shm_slot {
+    time_t expire;
+    unsigned idlen;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned len;
+    unsigned char data[TLS_SHM_DATALEN];
+};
+
+static int sess_shmfd = -1;
+static char *sess_shm = NULL;
+static size_t sess_shmsize = 0;
+static int sess_timeout = 0;	/* in seconds */
+
 enum {
     var_imapd_tls_loglevel = 0,
     var_proxy_tls_loglevel = 0,
@@ -429,6 +474,329 @@ static int set_cert_stuff(SSL_CTX * ctx,
     return (1);
 }
 
+#define SHM_HEADER ((struct tls_shm_header *) sess_shm)
+#define SHM_SLOT(n) ((struct tls_shm_slot *) \
+		     (sess_shm + sizeof(struct tls_shm_header) + \
+		      (n) * sizeof(struct tls_shm_slot)))
+
+static int tls_shm_newkey(struct tls_shm_key *key)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) <= 0 ||
+	RAND_bytes(key->hmac, sizeof(key->hmac)) <= 0 ||
+	RAND_bytes(key->aes, sizeof(key->aes)) <= 0) {
+	syslog(LOG_ERR, "TLS session cache: can't generate ticket key");
+	return -1;
+    }
+    key->created = time(0);
+    return 0;
+}
+
+/* Map 'fd', the session cache file, if it's a complete cache of 'nslots' */
+static int tls_shm_map(int fd, unsigned nslots)
+{
+    struct stat sbuf;
+    struct tls_shm_header *hdr;
+
+    if (fstat(fd, &sbuf) == -1 || (size_t) sbuf.st_size != sess_shmsize)
+	return -1;
+
+    sess_shm = mmap(NULL, sess_shmsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+    if (sess_shm == MAP_FAILED) {
+	sess_shm = NULL;
+	return -1;
+    }
+
+    hdr = SHM_HEADER;
+    if (memcmp(hdr->magic, TLS_SHM_MAGIC, sizeof(TLS_SHM_MAGIC)) ||
+	hdr->nslots != nslots ||
+	hdr->slotsize != sizeof(struct tls_shm_slot)) {
+	munmap(sess_shm, sess_shmsize);
+	sess_shm = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Open and map the session cache at 'fname', if it's one of 'nslots' */
+static int tls_shm_attach(const char *fname, unsigned nslots)
+{
+    int fd;
+
+    fd = open(fname, O_RDWR, 0);
+    if (fd == -1) {
+	if (errno != ENOENT) syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return -1;
+    }
+    if (tls_shm_map(fd, nslots)) {
+	close(fd);
+	return -1;
+    }
+
+    sess_shmfd = fd;
+    return 0;
+}
+
+/*
+ * Map the shared memory session cache of 'nslots' sessions at 'fname'.
+ * If there isn't one of the right size, a new one is set up under
+ * another name and renamed into place, so a process still using the
+ * old file never sees it change size underneath it.  Setting up is
+ * done holding a lock on 'fname'.lock, so processes starting together
+ * all end up with the same cache and ticket keys.
+ */
+static int tls_shm_open(const char *fname, unsigned nslots)
+{
+    struct tls_shm_header *hdr;
+    char lockfname[1024], newfname[1024];
+    int fd = -1, lockfd, r = -1;
+
+    nslots = (nslots + TLS_SHM_WAYS - 1) / TLS_SHM_WAYS * TLS_SHM_WAYS;
+    sess_shmsize = sizeof(struct tls_shm_header) +
+	nslots * sizeof(struct tls_shm_slot);
+
+    if (!tls_shm_attach(fname, nslots)) return 0;
+
+    snprintf(lockfname, sizeof(lockfname), "%s.lock", fname);
+    lockfd = open(lockfname, O_RDWR | O_CREAT, 0600);
+    if (lockfd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", lockfname);
+	return -1;
+    }
+    if (lock_blocking(lockfd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", lockfname);
+	close(lockfd);
+	return -1;
+    }
+
+    /* somebody else may have set it up while we waited */
+    if (!tls_shm_attach(fname, nslots)) {
+	r = 0;
+	goto done;
+    }
+
+    /* start again from an empty cache of the right size */
+    snprintf(newfname, sizeof(newfname), "%s.NEW", fname);
+    fd = open(newfname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	goto done;
+    }
+    if (ftruncate(fd, sess_shmsize) == -1) {
+	syslog(LOG_ERR, "IOERROR: sizing %s: %m", newfname);
+	goto done;
+    }
+
+    sess_shm = mmap(NULL, sess_shmsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+    if (sess_shm == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", newfname);
+	sess_shm = NULL;
+	goto done;
+    }
+
+    hdr = SHM_HEADER;
+    if (tls_shm_newkey(&hdr->keys[0]) ||
+	tls_shm_newkey(&hdr->keys[1])) {
+	goto done;
+    }
+    hdr->nslots = nslots;
+    hdr->slotsize = sizeof(struct tls_shm_slot);
+    memcpy(hdr->magic, TLS_SHM_MAGIC, sizeof(TLS_SHM_MAGIC));
+
+    if (rename(newfname, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	goto done;
+    }
+
+    sess_shmfd = fd;
+    fd = -1;
+    r = 0;
+
+ done:
+    if (fd != -1) {
+	if (sess_shm) munmap(sess_shm, sess_shmsize);
+	sess_shm = NULL;
+	close(fd);
+	unlink(newfname);
+    }
+    lock_unlock(lockfd);
+    close(lockfd);
+    return r;
+}
+
+static void tls_shm_close(void)
+{
+    if (!sess_shm) return;
+
+    munmap(sess_shm, sess_shmsize);
+    close(sess_shmfd);
+    sess_shm = NULL;
+    sess_shmfd = -1;
+}
+
+/* The first slot of the set that session 'id' goes in */
+static unsigned tls_shm_set(const unsigned char *id, int idlen)
+{
+    unsigned hash = 0;
+    int i;
+
+    /* session ids are random, so any few bytes will do */
+    for (i = 0; i < idlen && i < 4; i++) hash = (hash << 8) | id[i];
+
+    return hash % (SHM_HEADER->nslots / TLS_SHM_WAYS) * TLS_SHM_WAYS;
+}
+
+static struct tls_shm_slot *tls_shm_find(const unsigned char *id, int idlen)
+{
+    unsigned first = tls_shm_set(id, idlen), n;
+
+    for (n = first; n < first + TLS_SHM_WAYS; n++) {
+	struct tls_shm_slot *slot = SHM_SLOT(n);
+
+	if (slot->idlen == (unsigned) idlen && !memcmp(slot->id, id, idlen))
+	    return slot;
+    }
+
+    return NULL;
+}
+
+/*
+ * Put a session in the shared cache; returns 0 on success.
+ */
+static int tls_shm_store(const unsigned char *id, int idlen, time_t expire,
+			 const unsigned char *data, int len)
+{
+    struct tls_shm_slot *slot;
+    unsigned first, n;
+
+    if (len > TLS_SHM_DATALEN) return -1;
+
+    lock_blocking(sess_shmfd);
+
+    if (!(slot = tls_shm_find(id, idlen))) {
+	/* use the slot that's free or expires soonest */
+	first = tls_shm_set(id, idlen);
+	slot = SHM_SLOT(first);
+	for (n = first + 1; n < first + TLS_SHM_WAYS; n++) {
+	    if (SHM_SLOT(n)->expire < slot->expire) slot = SHM_SLOT(n);
+	}
+    }
+
+    slot->expire = expire;
+    slot->idlen = idlen;
+    memcpy(slot->id, id, idlen);
+    slot->len = len;
+    memcpy(slot->data, data, len);
+
+    lock_unlock(sess_shmfd);
+
+    return 0;
+}
+
+/*
+ * Look up a session in the shared cache.
+ */
+static SSL_SESSION *tls_shm_fetch(const unsigned char *id, int idlen)
+{
+    struct tls_shm_slot *slot;
+    SSL_SESSION *sess = NULL;
+
+    lock_shared(sess_shmfd);
+
+    slot = tls_shm_find(id, idlen);
+    if (slot && slot->expire >= time(0)) {
+	const unsigned char *asn = slot->data;
+	sess = d2i_SSL_SESSION(NULL, &asn, slot->len);
+	if (!sess) syslog(LOG_ERR, "d2i_SSL_SESSION failed: %m");
+    }
+
+    lock_unlock(sess_shmfd);
+
+    return sess;
+}
+
+static void tls_shm_remove(const unsigned char *id, int idlen)
+{
+    struct tls_shm_slot *slot;
+
+    lock_blocking(sess_shmfd);
+
+    slot = tls_shm_find(id, idlen);
+    if (slot) memset(slot, 0, sizeof(*slot));
+
+    lock_unlock(sess_shmfd);
+}
+
+#ifdef SSL_CTX_set_tlsext_ticket_key_cb
+/*
+ * Find the session ticket key called 'name', or the current key if
+ * 'name' is NULL, starting a new current key if it's time to.
+ * Returns 1 for the current key, 2 for the previous one, 0 for none.
+ */
+static int tls_shm_ticketkey(const unsigned char *name,
+			     struct tls_shm_key *key)
+{
+    struct tls_shm_key *keys = SHM_HEADER->keys;
+    int r = 0;
+
+    lock_blocking(sess_shmfd);
+
+    if (keys[0].created + sess_timeout < time(0)) {
+	struct tls_shm_key newkey;
+
+	if (!tls_shm_newkey(&newkey)) {
+	    keys[1] = keys[0];
+	    keys[0] = newkey;
+	}
+    }
+
+    if (!name || !memcmp(name, keys[0].name, sizeof(keys[0].name))) {
+	*key = keys[0];
+	r = 1;
+    }
+    else if (!memcmp(name, keys[1].name, sizeof(keys[1].name))) {
+	*key = keys[1];
+	r = 2;
+    }
+
+    lock_unlock(sess_shmfd);
+
+    return r;
+}
+
+/*
+ * Encrypt new session tickets with the current shared key, so any
+ * process can decrypt them, and accept tickets encrypted with the
+ * previous key too, asking for them to be renewed.
+ */
+static int ticket_key_cb(SSL *ssl __attribute__((unused)),
+			 unsigned char *key_name, unsigned char *iv,
+			 EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    struct tls_shm_key key;
+    int r;
+
+    if (enc) {
+	if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0) return -1;
+	if (!tls_shm_ticketkey(NULL, &key)) return -1;
+
+	memcpy(key_name, key.name, sizeof(key.name));
+	EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes, iv);
+	HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL);
+	return 1;
+    }
+
+    r = tls_shm_ticketkey(key_name, &key);
+    if (!r) return 0;	/* unknown key: do a full handshake */
+
+    HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL);
+    EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes, iv);
+    return r;
+}
+#endif /* SSL_CTX_set_tlsext_ticket_key_cb */
+
 /*
  * The new_session_cb() is called, whenever a new session has been
  * negotiated and session caching is enabled.  We save the session in
@@ -445,7 +813,7 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
 
     assert(sess);
 
-    if (!sess_dbopen) return 0;
+    if (!sess_dbopen && !sess_shm) return 0;
 
     /* find the size of the ASN1 representation of the session */
     len = i2d_SSL_SESSION(sess, NULL);
@@ -465,8 +833,13 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
     expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
     memcpy(data, &expire, sizeof(time_t));
 
-    if (len) {
-	/* store the session in our database */
+    if (len && sess_shm &&
+	!tls_shm_store(sess->session_id, sess->session_id_length,
+		       expire, data + sizeof(time_t), len)) {
+	ret = 0;
+    }
+    else if (len && sess_dbopen) {
+	/* no room in the shared cache; store the session in our database */
 	do {
 	    ret = DB->store(sessdb, (const char *) sess->session_id,
 			    sess->session_id_length,
@@ -500,6 +873,8 @@ static void remove_session(unsigned char *id, int idlen)
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
     
+    if (sess_shm) tls_shm_remove(id, idlen);
+
     if (!sess_dbopen) return;
 
     do {
@@ -547,6 +922,10 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
 
+    *copy = 0;
+
+    if (sess_shm && (sess = tls_shm_fetch(id, idlen))) return sess;
+
     if (!sess_dbopen) return NULL;
 
     do {
@@ -690,23 +1069,40 @@ int     tls_init_serverengine(const char *ident,
 	SSL_CTX_sess_set_remove_cb(s_ctx, remove_session_cb);
 	SSL_CTX_sess_set_get_cb(s_ctx, get_session_cb);
 
-	fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
-
-	/* create the name of the db file */
-	if (!fname) {
-	    tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
-	    fname = tofree;
+	/* Map the shared memory cache, if we have one */
+	sess_timeout = timeout*60;
+	r = config_getint(IMAPOPT_TLS_SESSION_CACHE_SIZE);
+	fname = config_getstring(IMAPOPT_TLS_SESSION_CACHE_PATH);
+	if (r > 0 && !fname) {
+	    syslog(LOG_WARNING, "tls_session_cache_size is set but "
+		   "tls_session_cache_path isn't; not using a shared cache");
 	}
-
-	r = (DB->open)(fname, CYRUSDB_CREATE, &sessdb);
-	if (r != 0) {
-	    syslog(LOG_ERR, "DBERROR: opening %s: %s",
-		   fname, cyrusdb_strerror(ret));
+	else if (r > 0 && !tls_shm_open(fname, r)) {
+#ifdef SSL_CTX_set_tlsext_ticket_key_cb
+	    /* Session tickets any process can decrypt */
+	    SSL_CTX_set_tlsext_ticket_key_cb(s_ctx, ticket_key_cb);
+#endif
 	}
-	else
-	    sess_dbopen = 1;
 
-	free(tofree);
+	if (config_getswitch(IMAPOPT_TLS_SESSION_DB)) {
+	    fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
+
+	    /* create the name of the db file */
+	    if (!fname) {
+		tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
+		fname = tofree;
+	    }
+
+	    r = (DB->open)(fname, CYRUSDB_CREATE, &sessdb);
+	    if (r != 0) {
+		syslog(LOG_ERR, "DBERROR: opening %s: %s",
+		       fname, cyrusdb_strerror(ret));
+	    }
+	    else
+		sess_dbopen = 1;
+
+	    free(tofree);
+	}
     }
 
     cipher_list = config_getstring(IMAPOPT_TLS_CIPHER_LIST);
@@ -1046,6 +1442,8 @@ int tls_shutdown_serverengine(void)
 {
     int r;
 
+    if (tls_serverengine) tls_shm_close();
+
     if (tls_serverengine && sess_dbopen) {
 	r = (DB->close)(sessdb);
 	if (r) {
@@ -1121,6 +1519,9 @@ int tls_prune_sessions(void)
     int ret;
     struct prunerock prock;
 
+    /* the shared memory cache reuses expired slots by itself */
+    if (!config_getswitch(IMAPOPT_TLS_SESSION_DB)) return 0;
+
     fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
 
    /* create the name of the db file */
@@ -424,33 +424,6 @@ int user_copyquotaroot(char *oldname, char *newname)
     return r;
 }
 
-static int find_p(void *rockp,
-		  const char *key, int keylen,
-		  const char *data __attribute__((unused)),
-		  int datalen __attribute__((unused)))
-{
-    char *inboxname = (char *)rockp;
-    int inboxlen = strlen(inboxname);
-
-    return (!strncmp(key, inboxname, inboxlen) &&
-	    (keylen == inboxlen || key[inboxlen] == '.'));
-}
-
-static int find_cb(void *rockp __attribute__((unused)),
-		   const char *key, int keylen,
-		   const char *data __attribute__((unused)),
-		   int datalen __attribute__((unused)))
-{
-    char *root;
-    int r;
-
-    root = xstrndup(key, keylen);
-    r = quota_deleteroot(root);
-    free(root); 
-
-    return r;
-}
-
 int user_deletequotaroots(const char *user)
 {
     struct namespace namespace;
@@ -467,8 +440,21 @@ int user_deletequotaroots(const char *user)
     }
 
     if (!r) {
-	r = config_quota_db->foreach(qdb, inboxname, strlen(inboxname),
-				     &find_p, &find_cb, inboxname, NULL);
+	struct txn *tid = NULL;
+	size_t len = strlen(inboxname);
+
+	/* the INBOX quotaroot itself, and any below it */
+	r = config_quota_db->delete(qdb, inboxname, len, &tid, 1);
+	if (!r) {
+	    inboxname[len] = '.';
+	    r = cyrusdb_delete_range(config_quota_db, qdb,
+				     inboxname, len + 1, &tid);
+	    inboxname[len] = '\0';
+	}
+	if (tid) {
+	    if (r) config_quota_db->abort(qdb, tid);
+	    else r = config_quota_db->commit(qdb, tid);
+	}
     }
 
     return r;
@@ -333,10 +333,10 @@ static struct cyrusdb_backend *the_ptscache_db = NULL;
 /* Returns 0 on success */
 static int ptload(const char *identifier, struct auth_state **state) 
 {
-    struct auth_state *fetched = NULL;
+    struct auth_state *fetched = NULL, *stale = NULL;
     size_t id_len;
     const char *data = NULL;
-    int dsize;
+    int dsize, stalesize = 0;
     const char *fname = NULL;
     char *tofree = NULL;
     struct db *ptdb;
@@ -412,6 +412,14 @@ static int ptload(const char *identifier, struct auth_state **state)
 	    /* not expired; let's return it */
 	    goto done;
 	}
+
+	/* keep the expired record in case the reload fails; the
+	   fetch below may overwrite the data we were handed */
+	stale = (struct auth_state *) xmalloc(dsize);
+	memcpy(stale, fetched, dsize);
+	stalesize = dsize;
+	fetched = stale;
+	data = NULL;
     }
     
     syslog(LOG_DEBUG, "ptload(): pinging ptloader");
@@ -499,6 +507,9 @@ static int ptload(const char *identifier, struct auth_state **state)
     if (data != NULL) {
       fetched = (struct auth_state *) data;
     }
+    else if (stale) {
+      dsize = stalesize;
+    }
 
     if (fetched == NULL) {
       *state = NULL;
@@ -509,6 +520,7 @@ static int ptload(const char *identifier, struct auth_state **state)
       memcpy(*state, fetched, dsize);
       syslog(LOG_DEBUG, "ptload returning data");
     }
+    free(stale);
 
     /* close and unlock the database */
     (the_ptscache_db->close)(ptdb);
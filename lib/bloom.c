@@ -0,0 +1,117 @@
+/* bloom.c -- a simple fixed-size bloom filter
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bloom.h"
+#include <memory.h>
+#include "xmalloc.h"
+
+/* ~10 bits per entry with 7 hashes gives about a 1% false positive rate */
+#define BLOOM_BITS_PER_ENTRY	10
+#define BLOOM_NHASHES		7
+
+void bloom_init(struct bloom *b, unsigned int entries)
+{
+    if (entries < 64) entries = 64;
+
+    b->nbits = entries * BLOOM_BITS_PER_ENTRY;
+    b->nhashes = BLOOM_NHASHES;
+    b->bits = xzmalloc((b->nbits + 7) / 8);
+}
+
+void bloom_fini(struct bloom *b)
+{
+    if (!b)
+	return;
+    free(b->bits);
+    b->bits = NULL;
+    b->nbits = 0;
+    b->nhashes = 0;
+}
+
+/*
+ * 64-bit FNV-1a.  The two halves of the result are combined to give
+ * the k bit positions (Kirsch & Mitzenmacher double hashing).
+ */
+static void bloom_hash(const char *key, size_t keylen,
+		       unsigned int *h1, unsigned int *h2)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+	h ^= (unsigned char) key[i];
+	h *= 1099511628211ULL;
+    }
+
+    *h1 = (unsigned int) h;
+    *h2 = (unsigned int) (h >> 32) | 1;
+}
+
+void bloom_add(struct bloom *b, const char *key, size_t keylen)
+{
+    unsigned int h1, h2, i, bit;
+
+    if (!b->bits) return;
+
+    bloom_hash(key, keylen, &h1, &h2);
+    for (i = 0; i < b->nhashes; i++) {
+	bit = (h1 + i * h2) % b->nbits;
+	b->bits[bit >> 3] |= (1 << (bit & 7));
+    }
+}
+
+int bloom_check(const struct bloom *b, const char *key, size_t keylen)
+{
+    unsigned int h1, h2, i, bit;
+
+    /* an unallocated filter can't rule anything out */
+    if (!b->bits) return 1;
+
+    bloom_hash(key, keylen, &h1, &h2);
+    for (i = 0; i < b->nhashes; i++) {
+	bit = (h1 + i * h2) % b->nbits;
+	if (!(b->bits[bit >> 3] & (1 << (bit & 7))))
+	    return 0;
+    }
+
+    return 1;
+}
@@ -78,6 +78,9 @@ struct cyrusdb_backend *cyrusdb_backends[] = {
 #endif
     NULL };
 
+/* set between cyrusdb_init() and cyrusdb_done() */
+static int cyrusdb_active = 0;
+
 void cyrusdb_init(void)
 {
     int i, r;
@@ -95,17 +98,46 @@ void cyrusdb_init(void)
 		   cyrusdb_backends[i]->name);
 	}
     }
+    cyrusdb_active = 1;
 }
 
 void cyrusdb_done(void)
 {
     int i;
+
+    /* a process may get here twice on its way out (a master zygote
+     * closes its databases and may then exit via service_abort()) */
+    if (!cyrusdb_active) return;
+    cyrusdb_active = 0;
     
     for(i=0; cyrusdb_backends[i]; i++) {
 	(cyrusdb_backends[i])->done();
     }
 }
 
+int cyrusdb_statgeneration(const char *fname, struct cyrusdb_generation *gen)
+{
+    struct stat sbuf;
+
+    if (stat(fname, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: stat %s: %m", fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    /* the inode and size alone miss a file rewritten in place to the
+       same length, or replaced by one which got the old one's inode */
+    gen->ino = sbuf.st_ino;
+    gen->size = sbuf.st_size;
+    gen->mtime = sbuf.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    gen->mtime_nsec = sbuf.st_mtim.tv_nsec;
+#else
+    gen->mtime_nsec = 0;
+#endif
+
+    return 0;
+}
+
 int cyrusdb_copyfile(const char *srcname, const char *dstname)
 {
     int srcfd, dstfd;
@@ -212,16 +244,158 @@ int cyrusdb_truncate(struct cyrusdb_backend *backend,
     return (backend->foreach)(db, "", 0, NULL, delete_cb, &tr, tid);
 }
 
+int cyrusdb_delete_range(struct cyrusdb_backend *backend,
+			 struct db *db,
+			 const char *prefix, int prefixlen,
+			 struct txn **tid)
+{
+    struct db_rock tr;
+    struct txn *localtid = NULL;
+    int r;
+
+    if (backend->delete_range)
+	return (backend->delete_range)(db, prefix, prefixlen, tid);
+
+    tr.backend = backend;
+    tr.db = db;
+    tr.tid = tid ? tid : &localtid;
+
+    r = (backend->foreach)(db, prefix, prefixlen, NULL, delete_cb, &tr,
+			   tr.tid);
+
+    if (localtid) {
+	if (r) (backend->abort)(db, localtid);
+	else r = (backend->commit)(db, localtid);
+    }
+
+    return r;
+}
+
+/* records per transaction when falling back to store() */
+#define LOAD_PER_COMMIT 1000
+
+struct cyrusdb_load {
+    struct cyrusdb_backend *backend;
+    struct db *db;
+    struct cyrusdb_bulk *bulk;	/* while the keys are in order */
+    struct txn *tid;		/* after that */
+    int uncommitted;
+};
+
+int cyrusdb_load_start(struct cyrusdb_backend *backend, struct db *db,
+		       struct cyrusdb_load **ret)
+{
+    struct cyrusdb_load *load;
+    int r = 0;
+
+    load = xzmalloc(sizeof(struct cyrusdb_load));
+    load->backend = backend;
+    load->db = db;
+
+    if (backend->bulk_start) {
+	r = (backend->bulk_start)(db, &load->bulk);
+	if (r) {
+	    free(load);
+	    return r;
+	}
+    }
+
+    *ret = load;
+    return 0;
+}
+
+static int load_store(struct cyrusdb_load *load,
+		      const char *key, int keylen,
+		      const char *data, int datalen)
+{
+    struct cyrusdb_backend *backend = load->backend;
+    int tries = 0;
+    int r;
+
+    do {
+	if (data)
+	    r = (backend->store)(load->db, key, keylen, data, datalen,
+				 &load->tid);
+	else
+	    r = (backend->delete)(load->db, key, keylen, &load->tid, 1);
+    } while (r == CYRUSDB_AGAIN && tries++ < 5);
+    if (r) return r;
+
+    if (++load->uncommitted >= LOAD_PER_COMMIT) {
+	r = (backend->commit)(load->db, load->tid);
+	load->tid = NULL;
+	load->uncommitted = 0;
+    }
+
+    return r;
+}
+
+int cyrusdb_load_add(struct cyrusdb_load *load,
+		     const char *key, int keylen,
+		     const char *data, int datalen)
+{
+    struct cyrusdb_backend *backend = load->backend;
+    int r;
+
+    if (load->bulk) {
+	r = (backend->bulk_add)(load->bulk, key, keylen, data, datalen);
+	if (r != CYRUSDB_EXISTS) return r;
+
+	/* out of order: keep what we have and carry on the slow way */
+	syslog(LOG_NOTICE,
+	       "cyrusdb: bulk load input not sorted at '%.*s', "
+	       "continuing one record at a time", keylen, key);
+	r = (backend->bulk_commit)(load->bulk);
+	load->bulk = NULL;
+	if (r) return r;
+    }
+
+    return load_store(load, key, keylen, data, datalen);
+}
+
+int cyrusdb_load_commit(struct cyrusdb_load *load)
+{
+    int r = 0;
+
+    if (load->bulk)
+	r = (load->backend->bulk_commit)(load->bulk);
+    else if (load->tid)
+	r = (load->backend->commit)(load->db, load->tid);
+
+    free(load);
+    return r;
+}
+
+int cyrusdb_load_abort(struct cyrusdb_load *load)
+{
+    int r = 0;
+
+    if (load->bulk)
+	r = (load->backend->bulk_abort)(load->bulk);
+    else if (load->tid)
+	r = (load->backend->abort)(load->db, load->tid);
+
+    free(load);
+    return r;
+}
+
 int cyrusdb_undump(struct cyrusdb_backend *backend,
 		   struct db *db,
 		   FILE *f,
 		   struct txn **tid)
 {
     struct buf line = BUF_INITIALIZER;
+    struct cyrusdb_load *load = NULL;
     const char *tab;
     const char *str;
     int r = 0;
 
+    /* outside a transaction we can load in bulk */
+    if (!tid || !*tid) {
+	r = cyrusdb_load_start(backend, db, &load);
+	if (r) return r;
+    }
+
     while (buf_getline(&line, f)) {
 	/* skip blank lines */
 	if (!line.len) continue;
@@ -233,7 +407,10 @@ int cyrusdb_undump(struct cyrusdb_backend *backend,
 
 	/* deletion (no value) */
 	if (!tab) {
-	    r = (backend->delete)(db, str, line.len, tid, 1);
+	    if (load)
+		r = cyrusdb_load_add(load, str, line.len, NULL, 0);
+	    else
+		r = (backend->delete)(db, str, line.len, tid, 1);
 	    if (r) goto out;
 	}
 
@@ -241,12 +418,19 @@ int cyrusdb_undump(struct cyrusdb_backend *backend,
 	else {
 	    unsigned klen = (tab - str);
 	    unsigned vlen = line.len - klen - 1; /* TAB */
-	    r = (backend->store)(db, str, klen, tab + 1, vlen, tid);
+	    if (load)
+		r = cyrusdb_load_add(load, str, klen, tab + 1, vlen);
+	    else
+		r = (backend->store)(db, str, klen, tab + 1, vlen, tid);
 	    if (r) goto out;
 	}
     }
 
   out:
+    if (load) {
+	if (r) cyrusdb_load_abort(load);
+	else r = cyrusdb_load_commit(load);
+    }
     buf_free(&line);
     return r;
 }
@@ -255,8 +439,8 @@ static int converter_cb(void *rock,
 			const char *key, int keylen,
 			const char *data, int datalen) 
 {
-    struct db_rock *cr = (struct db_rock *)rock;
-    return (cr->backend->store)(cr->db, key, keylen, data, datalen, cr->tid);
+    struct cyrusdb_load *load = (struct cyrusdb_load *)rock;
+    return cyrusdb_load_add(load, key, keylen, data, datalen);
 }
 
 /* convert (just copy every record) from one database to another in possibly
@@ -267,9 +451,8 @@ void cyrusdb_convert(const char *fromfname, const char *tofname,
 		     struct cyrusdb_backend *tobackend)
 {
     struct db *fromdb, *todb;
-    struct db_rock cr;
+    struct cyrusdb_load *load = NULL;
     struct txn *fromtid = NULL;
-    struct txn *totid = NULL;
     int r;
 
     /* open both databases (create todb) */
@@ -280,17 +463,24 @@ void cyrusdb_convert(const char *fromfname, const char *tofname,
     if (r != CYRUSDB_OK)
 	fatal("can't open new database", EC_TEMPFAIL);
 
-    /* set up the copy rock */
-    cr.backend = tobackend;
-    cr.db = todb;
-    cr.tid = &totid;
+    r = cyrusdb_load_start(tobackend, todb, &load);
+    if (r != CYRUSDB_OK)
+	fatal("can't load new database", EC_TEMPFAIL);
 
-    /* copy each record to the destination DB (transactional for speed) */
-    (frombackend->foreach)(fromdb, "", 0, NULL, converter_cb, &cr, &fromtid);
+    /* copy each record to the destination DB (in bulk for speed) */
+    r = (frombackend->foreach)(fromdb, "", 0, NULL, converter_cb, load,
+			       &fromtid);
 
     /* commit both transactions */
     if (fromtid) (frombackend->commit)(fromdb, fromtid);
-    if (totid) (tobackend->commit)(todb, totid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: converting %s: %s", fromfname,
+	       cyrusdb_strerror(r));
+	cyrusdb_load_abort(load);
+    }
+    else {
+	cyrusdb_load_commit(load);
+    }
 
     /* and close the DBs */
     (frombackend->close)(fromdb);
@@ -45,9 +45,12 @@
 #define INCLUDED_CYRUSDB_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 struct db;
 struct txn;
+struct cyrusdb_bulk;
+struct cyrusdb_load;
 
 enum cyrusdb_ret {
     CYRUSDB_OK = 0,
@@ -74,6 +77,19 @@ enum cyrusdb_openflags {
     CYRUSDB_MBOXSORT = 0x02	/* Use mailbox sort order ('.' sorts 1st) */
 };
 
+/* a cheap token identifying one state of a database file; see
+ * cyrusdb_backend.generation below */
+struct cyrusdb_generation {
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;		/* 0 if the system doesn't keep it */
+};
+
+#define CYRUSDB_GENERATION_EQUAL(a, b) \
+    ((a)->ino == (b)->ino && (a)->size == (b)->size && \
+     (a)->mtime == (b)->mtime && (a)->mtime_nsec == (b)->mtime_nsec)
+
 typedef int foreach_p(void *rock,
 		      const char *key, int keylen,
 		      const char *data, int datalen);
@@ -121,6 +137,10 @@ struct cyrusdb_backend {
 		transactions may lock the entire database on some backends.
 		beware
 		
+       'data' belongs to the database and is only good until the next
+       call on 'mydb' (some backends hand back a buffer that the next
+       fetch overwrites); copy anything that must live longer.
+
        fetchlock() is identical to fetch() except gives a hint to the
        underlying database that the key/data being fetched will be modified
        soon. it is useless to use fetchlock() without a non-NULL mytid
@@ -179,6 +199,40 @@ struct cyrusdb_backend {
 
     int (*dump)(struct db *db, int detail);
     int (*consistent)(struct db *db);
+
+    /* the following are optional; backends which don't support them
+       leave them NULL */
+
+    /* fill in 'gen' with a token for the current state of the
+       database file 'fname', which needn't be open, without taking
+       any locks.  any committed change results in a different token,
+       so a caller may keep data it fetched for as long as the token
+       stays the same.  (a change that's still in progress may also
+       show up as a new token.) */
+    int (*generation)(const char *fname, struct cyrusdb_generation *gen);
+
+    /* bulk load: build the database directly from records handed to
+       bulk_add() in increasing key order (the order foreach() returns
+       them in), merged with whatever is already there.  'data' of NULL
+       deletes the key.  bulk_add() returns CYRUSDB_EXISTS, without
+       writing anything, for a key which doesn't sort after the previous
+       one.  nothing is visible to other users of the database until
+       bulk_commit(); bulk_commit() and bulk_abort() free 'bulk'.  the
+       caller must not have a transaction open on 'db' meanwhile.
+       use cyrusdb_load_*() below rather than calling these directly. */
+    int (*bulk_start)(struct db *db, struct cyrusdb_bulk **ret);
+    int (*bulk_add)(struct cyrusdb_bulk *bulk,
+		    const char *key, int keylen,
+		    const char *data, int datalen);
+    int (*bulk_commit)(struct cyrusdb_bulk *bulk);
+    int (*bulk_abort)(struct cyrusdb_bulk *bulk);
+
+    /* delete every record whose key starts with 'prefix' (which must
+       not be empty) as a single change.  use cyrusdb_delete_range()
+       rather than calling this directly. */
+    int (*delete_range)(struct db *db,
+			const char *prefix, int prefixlen,
+			struct txn **tid);
 };
 
 extern struct cyrusdb_backend *cyrusdb_backends[];
@@ -196,6 +250,11 @@ extern struct cyrusdb_backend cyrusdb_sql;
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
 
+/* generation token for a database that lives in the single file
+ * 'fname', for backends whose generation() can just stat() it */
+extern int cyrusdb_statgeneration(const char *fname,
+				  struct cyrusdb_generation *gen);
+
 extern void cyrusdb_convert(const char *fromfname, const char *tofname,
 			    struct cyrusdb_backend *frombackend,
 			    struct cyrusdb_backend *tobackend);
@@ -212,11 +271,32 @@ int cyrusdb_undump(struct cyrusdb_backend *backend,
 		   struct db *db,
 		   FILE *f,
 		   struct txn **tid);
+/* delete every record whose key starts with 'prefix', with the
+ * backend's delete_range() if it has one, else one at a time in
+ * a single transaction */
+int cyrusdb_delete_range(struct cyrusdb_backend *backend,
+			 struct db *db,
+			 const char *prefix, int prefixlen,
+			 struct txn **tid);
+
+/* load many records into 'db', using the backend's bulk loader while
+ * the keys arrive in order and store()/delete() otherwise.  'data' of
+ * NULL deletes the key.  commit() and abort() free 'load'; abort() only
+ * undoes records which haven't been committed yet, which is all of them
+ * if the input was sorted. */
+int cyrusdb_load_start(struct cyrusdb_backend *backend, struct db *db,
+		       struct cyrusdb_load **ret);
+int cyrusdb_load_add(struct cyrusdb_load *load,
+		     const char *key, int keylen,
+		     const char *data, int datalen);
+int cyrusdb_load_commit(struct cyrusdb_load *load);
+int cyrusdb_load_abort(struct cyrusdb_load *load);
 
 
 extern const char *cyrusdb_detect(const char *fname);
 
-/* Start/Stop the backends */
+/* Start/Stop the backends; cyrusdb_done() does nothing unless
+ * cyrusdb_init() has been called since the last one */
 void cyrusdb_init(void);
 void cyrusdb_done(void);
 
@@ -99,6 +99,7 @@ static DB_ENV *dbenv;
 /* other routines call this one when they fail */
 static int commit_txn(struct db *db, struct txn *tid);
 static int abort_txn(struct db *db, struct txn *tid);
+static int mycommit(struct db *db, struct txn *tid, int txnflags);
 
 static void db_panic(DB_ENV *dbenv __attribute__((unused)),
 		     int errno __attribute__((unused)))
@@ -931,6 +932,95 @@ static int delete_nosync(struct db *db,
     return mydelete(db, key, keylen, tid, DB_TXN_NOSYNC, force);
 }
 
+/* walk a cursor over the keys starting with 'prefix', deleting as
+ * we go, all in one txn */
+static int mydelete_range(struct db *mydb,
+			  const char *prefix, int prefixlen,
+			  struct txn **mytid, int txnflags)
+{
+    int r = 0, r2;
+    DBT k, d;
+    DBC *cursor = NULL;
+    DB *db = (DB *) mydb;
+    DB_TXN *tid = NULL;
+    struct txn *localtid = NULL;
+
+    assert(dbinit && db);
+    assert(prefix && prefixlen);
+
+    if (!mytid) mytid = &localtid;
+
+  restart:
+    r = gettid(mytid, &tid, "delete_range");
+    if (r) return r;
+
+    memset(&k, 0, sizeof(k));
+    memset(&d, 0, sizeof(d));
+
+    r = db->cursor(db, tid, &cursor, 0);
+    if (r != 0) {
+	syslog(LOG_ERR, "DBERROR: unable to create cursor: %s",
+	       db_strerror(r));
+	cursor = NULL;
+    }
+    else {
+	k.data = (char *) prefix;
+	k.size = prefixlen;
+	r = cursor->c_get(cursor, &k, &d, DB_SET_RANGE);
+    }
+
+    while (!r) {
+	if (k.size < (unsigned) prefixlen || memcmp(k.data, prefix, prefixlen))
+	    break;
+
+	r = cursor->c_del(cursor, 0);
+	if (!r) r = cursor->c_get(cursor, &k, &d, DB_NEXT);
+    }
+    if (r == DB_NOTFOUND) r = 0;
+
+    if (cursor) {
+	r2 = cursor->c_close(cursor);
+	if (r2) {
+	    syslog(LOG_ERR, "DBERROR: error closing cursor: %s",
+		   db_strerror(r2));
+	    if (!r) r = r2;
+	}
+    }
+
+    if (r != 0) {
+	abort_txn(mydb, *mytid);
+	*mytid = NULL;
+	if (r == DB_LOCK_DEADLOCK) {
+	    /* only retry if the txn was ours */
+	    if (mytid == &localtid) goto restart;
+	    return CYRUSDB_AGAIN;
+	}
+	syslog(LOG_ERR, "DBERROR: mydelete_range: error deleting %.*s: %s",
+	       prefixlen, prefix, db_strerror(r));
+	return CYRUSDB_IOERROR;
+    }
+
+    if (localtid) {
+	r = mycommit(mydb, localtid, txnflags);
+    }
+
+    return r;
+}
+
+static int delete_range(struct db *db,
+			const char *prefix, int prefixlen,
+			struct txn **tid)
+{
+    return mydelete_range(db, prefix, prefixlen, tid, 0);
+}
+
+static int delete_range_nosync(struct db *db,
+			       const char *prefix, int prefixlen,
+			       struct txn **tid)
+{
+    return mydelete_range(db, prefix, prefixlen, tid, DB_TXN_NOSYNC);
+}
+
 static int mycommit(struct db *db __attribute__((unused)),
 		    struct txn *tid, int txnflags)
 {
@@ -1014,7 +1104,15 @@ struct cyrusdb_backend cyrusdb_berkeley =
     &abort_txn,
     
     NULL,
-    NULL
+    NULL,
+
+    NULL,			/* generation */
+    NULL,			/* bulk load */
+    NULL,
+    NULL,
+    NULL,
+
+    &delete_range
 };
 
 struct cyrusdb_backend cyrusdb_berkeley_nosync = 
@@ -1040,7 +1138,15 @@ struct cyrusdb_backend cyrusdb_berkeley_nosync =
     &abort_txn,
 
     NULL,
-    NULL
+    NULL,
+
+    NULL,			/* generation */
+    NULL,			/* bulk load */
+    NULL,
+    NULL,
+    NULL,
+
+    &delete_range_nosync
 };
 
 struct cyrusdb_backend cyrusdb_berkeley_hash = 
@@ -510,23 +510,14 @@ static int foreach(struct db *db,
 
 #undef GETENTRY
 
-static int mystore(struct db *db, 
-		   const char *key, int keylen,
-		   const char *data, int datalen,
-		   struct txn **mytid, int overwrite)
+/* lock the file for writing, and start a transaction if the caller
+ * wants one, unless we're already in one */
+static int lock_for_write(struct db *db, struct txn **mytid)
 {
-    int r = 0;
-    char fnamebuf[1024];
-    int offset;
-    unsigned long len;
+    int r;
     const char *lockfailaction;
-    int writefd;
-    struct iovec iov[10];
-    int niov;
     struct stat sbuf;
-    char *tmpkey = NULL;
 
-    /* lock file, if needed */
     if (!mytid || !*mytid) {
 	r = lock_reopen(db->fd, db->fname, &sbuf, &lockfailaction);
 	if (r < 0) {
@@ -547,23 +538,24 @@ static int mystore(struct db *db,
 	}
     }
 
-    /* if we need to truncate the key, do so */
-    if(key[keylen] != '\0') {
-	tmpkey = xmalloc(keylen + 1);
-	memcpy(tmpkey, key, keylen);
-	tmpkey[keylen] = '\0';
-	key = tmpkey;
-    }
-
-    /* find entry, if it exists */
-    offset = bsearch_mem(key, 1, db->base, db->size, 0, &len);
+    return 0;
+}
 
-    /* overwrite? */
-    if (len && !overwrite) {
-	if (mytid) abort_txn(db, *mytid);
-	if (tmpkey) free(tmpkey);
-	return CYRUSDB_EXISTS;
-    }
+/* write a new copy of the file with the 'len' bytes at 'offset'
+ * replaced by the record for 'key' (or by nothing, if 'data' is NULL).
+ * without a transaction, the new copy replaces the file and the lock
+ * is released. */
+static int rewrite(struct db *db, struct txn **mytid,
+		   unsigned long offset, unsigned long len,
+		   const char *key, int keylen,
+		   const char *data, int datalen)
+{
+    int r = 0;
+    char fnamebuf[1024];
+    int writefd;
+    struct iovec iov[10];
+    int niov;
+    struct stat sbuf;
 
     /* write new file */
     if (mytid && (*mytid)->fnamenew) {
@@ -578,7 +570,6 @@ static int mystore(struct db *db,
     if (r < 0) {
         syslog(LOG_ERR, "opening %s for writing failed: %m", fnamebuf);
 	if (mytid) abort_txn(db, *mytid);
-	if (tmpkey) free(tmpkey);
 	return CYRUSDB_IOERROR;
     }
 
@@ -630,7 +621,6 @@ static int mystore(struct db *db,
 	    rename(fnamebuf, db->fname) == -1) {
 	    syslog(LOG_ERR, "IOERROR: writing %s: %m", fnamebuf);
 	    close(writefd);
-	    if (tmpkey) free(tmpkey);
 	    return CYRUSDB_IOERROR;
 	}
 
@@ -651,6 +641,43 @@ static int mystore(struct db *db,
 	db->size = sbuf.st_size;
     }
 
+    return r;
+}
+
+static int mystore(struct db *db, 
+		   const char *key, int keylen,
+		   const char *data, int datalen,
+		   struct txn **mytid, int overwrite)
+{
+    int r = 0;
+    int offset;
+    unsigned long len;
+    char *tmpkey = NULL;
+
+    /* lock file, if needed */
+    r = lock_for_write(db, mytid);
+    if (r) return r;
+
+    /* if we need to truncate the key, do so */
+    if(key[keylen] != '\0') {
+	tmpkey = xmalloc(keylen + 1);
+	memcpy(tmpkey, key, keylen);
+	tmpkey[keylen] = '\0';
+	key = tmpkey;
+    }
+
+    /* find entry, if it exists */
+    offset = bsearch_mem(key, 1, db->base, db->size, 0, &len);
+
+    /* overwrite? */
+    if (len && !overwrite) {
+	if (mytid) abort_txn(db, *mytid);
+	if (tmpkey) free(tmpkey);
+	return CYRUSDB_EXISTS;
+    }
+
+    r = rewrite(db, mytid, offset, len, key, keylen, data, datalen);
+
     if(tmpkey) free(tmpkey);
     
     return r;
@@ -679,6 +706,51 @@ static int delete(struct db *db,
     return mystore(db, key, keylen, NULL, 0, mytid, 1);
 }
 
+/* every key starting with 'prefix' is on consecutive lines, so the
+ * whole lot goes in one rewrite of the file */
+static int delete_range(struct db *db,
+			const char *prefix, int prefixlen,
+			struct txn **mytid)
+{
+    char *tmpkey;
+    unsigned long offset, end, len;
+    const char *p;
+    int r;
+
+    assert(prefix && prefixlen);
+
+    /* lock file, if needed */
+    r = lock_for_write(db, mytid);
+    if (r) return r;
+
+    /* find the first line at or after 'prefix'... */
+    tmpkey = xstrndup(prefix, prefixlen);
+    offset = bsearch_mem(tmpkey, 1, db->base, db->size, 0, &len);
+    free(tmpkey);
+
+    /* ...and the end of the run of lines starting with it */
+    for (end = offset; end < db->size; end = p - db->base + 1) {
+	if (db->size - end < (unsigned long) prefixlen ||
+	    memcmp(db->base + end, prefix, prefixlen)) break;
+	p = memchr(db->base + end, '\n', db->size - end);
+	if (!p) {
+	    end = db->size;
+	    break;
+	}
+    }
+
+    if (end == offset) {
+	/* nothing to do */
+	if (!mytid && lock_unlock(db->fd) == -1) {
+	    syslog(LOG_ERR, "IOERROR: unlocking db %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+	return 0;
+    }
+
+    return rewrite(db, mytid, offset, end - offset, NULL, 0, NULL, 0);
+}
+
 static int commit_txn(struct db *db, struct txn *tid)
 {
     int writefd;
@@ -719,6 +791,12 @@ static int commit_txn(struct db *db, struct txn *tid)
     return r;
 }
 
+static int mygeneration(const char *fname, struct cyrusdb_generation *gen)
+{
+    /* every committed change renames a new file into place */
+    return cyrusdb_statgeneration(fname, gen);
+}
+
 struct cyrusdb_backend cyrusdb_flat = 
 {
     "flat",			/* name */
@@ -742,5 +820,14 @@ struct cyrusdb_backend cyrusdb_flat =
     &abort_txn,
 
     NULL,
-    NULL
+    NULL,
+
+    &mygeneration,
+
+    NULL,			/* bulk load */
+    NULL,
+    NULL,
+    NULL,
+
+    &delete_range
 };
@@ -60,6 +60,9 @@
 #include <unistd.h>
 #endif
 #include <netinet/in.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "assert.h"
 #include "bsearch.h"
@@ -154,6 +157,35 @@ struct txn {
     unsigned logend;			/* where to write to continue this txn */
 };
 
+/* Optional in-memory index: every node of at least INDEX_LEVEL levels
+ * in the checkpointed (INORDER) part of the file, sorted by key, which
+ * is also file order, with copies of their keys packed together.
+ * find_node() binary searches it and walks the list from there, so a
+ * lookup only touches records close to its key.  Log records after the
+ * checkpoint don't move those nodes; a DELETE of one just marks its
+ * entry dead. */
+#define INDEX_LEVEL 7		/* samples about one node in 64 */
+#define INDEX_MINSIZE 4096	/* smaller lists aren't worth it */
+#define INDEX_DEAD 1		/* or'ed into offset */
+
+struct skipidx_ent {
+    uint32_t offset;
+    uint32_t keyoff;		/* in keys */
+    uint32_t keylen;
+};
+
+struct skipidx {
+    int built;
+    ino_t ino;			/* what the index was built from */
+    uint32_t logstart;
+    time_t last_recovery;
+    unsigned long scanned;	/* checked for DELETE records up to here */
+    unsigned lookups;		/* since the index went stale */
+    unsigned n, ndead, alloc;
+    struct skipidx_ent *ent;
+    struct buf keys;
+};
+
 struct db {
     /* file data */
     char *fname;
@@ -180,6 +212,10 @@ struct db {
 
     /* comparator function to use for sorting */
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    struct skipidx idx;
+
+    struct buf fetchbuf;	/* inflated value returned by fetch() */
 };
 
 struct db_list {
@@ -373,7 +409,13 @@ enum {
 #define KEY(ptr) ((ptr) + 8)
 #define KEYLEN(ptr) (ntohl(*((uint32_t *)((ptr) + 4))))
 #define DATA(ptr) ((ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4)
-#define DATALEN(ptr) (ntohl(*((uint32_t *)((ptr) + 8 + ROUNDUP(KEYLEN(ptr))))))
+#define RAWDATALEN(ptr) (ntohl(*((uint32_t *)((ptr) + 8 + ROUNDUP(KEYLEN(ptr))))))
+#define DATALEN(ptr) (RAWDATALEN(ptr) & ~DATA_COMPRESSED)
+
+/* a value stored deflated has this bit set in its length, and its
+ * data starts with the inflated length; see putdata() */
+#define DATA_COMPRESSED (0x80000000)
+#define COMPRESSED(ptr) (RAWDATALEN(ptr) & DATA_COMPRESSED)
 #define FIRSTPTR(ptr) ((ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4 + ROUNDUP(DATALEN(ptr)))
 
 /* return a pointer to the pointer */
@@ -757,6 +799,11 @@ static int dispose_db(struct db *db)
     if (db->fd != -1) {
 	close(db->fd);
     }
+    if (db->idx.ent) {
+	free(db->idx.ent);
+    }
+    buf_free(&db->idx.keys);
+    buf_free(&db->fetchbuf);
 
     free(db);
 
@@ -945,6 +992,139 @@ static int compare(const char *s1, int l1, const char *s2, int l2)
     }
 }
 
+static void idx_build(struct db *db)
+{
+    struct skipidx *idx = &db->idx;
+    const char *ptr = db->map_base + DUMMY_OFFSET(db);
+    unsigned offset;
+
+    idx->n = idx->ndead = 0;
+    buf_reset(&idx->keys);
+    idx->scanned = db->map_size;
+    idx->built = 1;
+
+    if (db->curlevel < INDEX_LEVEL) return;
+
+    while ((offset = FORWARD(ptr, INDEX_LEVEL - 1)) && offset < db->logstart) {
+	struct skipidx_ent *e;
+
+	ptr = db->map_base + offset;
+
+	if (idx->n == idx->alloc) {
+	    idx->alloc = idx->alloc ? 2 * idx->alloc : 1024;
+	    idx->ent = xrealloc(idx->ent, idx->alloc * sizeof(*idx->ent));
+	}
+	e = &idx->ent[idx->n++];
+	e->offset = offset;
+	e->keyoff = idx->keys.len;
+	e->keylen = KEYLEN(ptr);
+	buf_appendmap(&idx->keys, KEY(ptr), KEYLEN(ptr));
+    }
+}
+
+/* mark the entry for the node at 'offset' dead, if there is one */
+static void idx_kill(struct skipidx *idx, uint32_t offset)
+{
+    unsigned lo = 0, hi = idx->n;
+
+    while (lo < hi) {
+	unsigned mid = (lo + hi) / 2;
+	uint32_t o = idx->ent[mid].offset & ~INDEX_DEAD;
+
+	if (o == offset) {
+	    if (!(idx->ent[mid].offset & INDEX_DEAD)) {
+		idx->ent[mid].offset |= INDEX_DEAD;
+		idx->ndead++;
+	    }
+	    return;
+	}
+	if (o < offset) lo = mid + 1;
+	else hi = mid;
+    }
+}
+
+/* catch up with the DELETE records appended since we last looked */
+static int idx_scan(struct db *db)
+{
+    struct skipidx *idx = &db->idx;
+    unsigned long offset = idx->scanned;
+
+    while (offset < db->map_size) {
+	const char *ptr = db->map_base + offset;
+
+	switch (TYPE(ptr)) {
+	case DELETE:
+	    idx_kill(idx, ntohl(*((uint32_t *)(ptr + 4))));
+	    break;
+	case ADD:
+	case COMMIT:
+	    break;
+	default:
+	    /* not a log we understand; don't trust the index */
+	    return -1;
+	}
+
+	offset += RECSIZE(ptr);
+    }
+
+    idx->scanned = offset;
+
+    return 0;
+}
+
+/* returns the offset of the last live sampled node < key, or 0 */
+static unsigned idx_lookup(struct db *db, const char *key, int keylen)
+{
+    struct skipidx *idx = &db->idx;
+    unsigned lo, hi;
+
+    if (idx->ino != db->map_ino || idx->logstart != db->logstart ||
+	idx->last_recovery != db->last_recovery ||
+	idx->scanned > db->map_size) {
+	/* checkpointed, recovered or replaced: start over */
+	idx->built = 0;
+	idx->ino = db->map_ino;
+	idx->logstart = db->logstart;
+	idx->last_recovery = db->last_recovery;
+	idx->lookups = 0;
+    }
+
+    if (!idx->built) {
+	/* wait until the lookups pay for the walk which builds it */
+	if (db->listsize < INDEX_MINSIZE ||
+	    ++idx->lookups < (db->listsize >> 10)) {
+	    return 0;
+	}
+	idx_build(db);
+    }
+    else if (idx->scanned < db->map_size && idx_scan(db)) {
+	idx->built = 0;
+	idx->lookups = 0;
+	return 0;
+    }
+
+    if (idx->ndead > idx->n / 4) {
+	/* too many holes */
+	idx_build(db);
+    }
+
+    /* find the first entry >= key, then the live one before it */
+    lo = 0;
+    hi = idx->n;
+    while (lo < hi) {
+	unsigned mid = (lo + hi) / 2;
+
+	if (db->compar(idx->keys.s + idx->ent[mid].keyoff,
+		       idx->ent[mid].keylen, key, keylen) < 0) {
+	    lo = mid + 1;
+	}
+	else hi = mid;
+    }
+    while (lo && (idx->ent[lo - 1].offset & INDEX_DEAD)) lo--;
+
+    return lo ? idx->ent[lo - 1].offset : 0;
+}
+
 /* returns the offset to the node asked for, or the node after it
    if it doesn't exist.
    if previous is set, finds the last node < key */
@@ -953,16 +1133,24 @@ static const char *find_node(struct db *db,
 			     unsigned *updateoffsets)
 {
     const char *ptr = db->map_base + DUMMY_OFFSET(db);
-    int i;
+    int i = db->curlevel - 1;
     unsigned offset;
 
     if (updateoffsets) {
 	for (i = 0; (unsigned) i < db->maxlevel; i++) {
 	    updateoffsets[i] = DUMMY_OFFSET(db);
 	}
+	i = db->curlevel - 1;
+    }
+    else if (libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_INDEX) &&
+	     (offset = idx_lookup(db, key, keylen))) {
+	/* start from the sampled node, which has at least INDEX_LEVEL
+	   levels, instead of the top of the list */
+	ptr = db->map_base + offset;
+	i = INDEX_LEVEL - 1;
     }
 
-    for (i = db->curlevel - 1; i >= 0; i--) {
+    for (; i >= 0; i--) {
 	while ((offset = FORWARD(ptr, i)) && 
 	       db->compar(KEY(db->map_base + offset), KEYLEN(db->map_base + offset), 
 		       key, keylen) < 0) {
@@ -977,6 +1165,75 @@ static const char *find_node(struct db *db,
     return ptr;
 }
 
+/* point 'data' and 'datalen' at the value of the record at 'ptr',
+ * inflating it into 'buf' if it was stored compressed */
+static int getdata(struct db *db, const char *ptr, struct buf *buf,
+		   const char **data, int *datalen)
+{
+#ifdef HAVE_ZLIB
+    uLongf len, stored;
+#endif
+
+    if (!COMPRESSED(ptr)) {
+	*data = DATA(ptr);
+	*datalen = DATALEN(ptr);
+	return 0;
+    }
+
+#ifdef HAVE_ZLIB
+    if (DATALEN(ptr) >= 4) {
+	len = stored = ntohl(*((uint32_t *)DATA(ptr)));
+	buf_reset(buf);
+	buf_ensure(buf, len + 1);
+	if (uncompress((Bytef *) buf->s, &len,
+		       (const Bytef *) DATA(ptr) + 4, DATALEN(ptr) - 4) == Z_OK &&
+	    len == stored) {
+	    buf->len = len;
+	    *data = buf->s;
+	    *datalen = len;
+	    return 0;
+	}
+    }
+
+    syslog(LOG_ERR, "DBERROR: %s: bad compressed record at offset %04X",
+	   db->fname, (unsigned) (ptr - db->map_base));
+#else
+    syslog(LOG_ERR, "DBERROR: %s: compressed record at offset %04X, "
+	   "but compression is not supported", db->fname,
+	   (unsigned) (ptr - db->map_base));
+#endif
+
+    return CYRUSDB_IOERROR;
+}
+
+/* deflate 'data' into 'buf' if it's at least skiplist_compress bytes
+ * and that makes it smaller.  returns the length to store, with
+ * DATA_COMPRESSED set if 'buf' now holds the value to store */
+static uint32_t putdata(const char *data, int datalen, struct buf *buf)
+{
+#ifdef HAVE_ZLIB
+    int min = libcyrus_config_getint(CYRUSOPT_SKIPLIST_COMPRESS);
+    uLongf len;
+
+    if (min <= 0 || datalen < min) return datalen;
+
+    len = compressBound(datalen);
+    buf_reset(buf);
+    buf_ensure(buf, 4 + len);
+    *((uint32_t *)buf->s) = htonl(datalen);
+    if (compress2((Bytef *) buf->s + 4, &len, (const Bytef *) data, datalen,
+		  Z_DEFAULT_COMPRESSION) != Z_OK ||
+	4 + len >= (uLongf) datalen) {
+	return datalen;
+    }
+    buf->len = 4 + len;
+
+    return buf->len | DATA_COMPRESSED;
+#else
+    return datalen;
+#endif
+}
+
 int myfetch(struct db *db,
 	    const char *key, int keylen,
 	    const char **data, int *datalen,
@@ -1017,8 +1274,14 @@ int myfetch(struct db *db,
 	/* failed to find key/keylen */
 	r = CYRUSDB_NOTFOUND;
     } else {
-	if (datalen) *datalen = DATALEN(ptr);
-	if (data) *data = DATA(ptr);
+	const char *d;
+	int dl;
+
+	r = getdata(db, ptr, &db->fetchbuf, &d, &dl);
+	if (!r) {
+	    if (datalen) *datalen = dl;
+	    if (data) *data = d;
+	}
     }
 
     if (!tidptr) {
@@ -1060,6 +1323,9 @@ int myforeach(struct db *db,
     char *savebuf = NULL;
     size_t savebuflen = 0;
     size_t savebufsize;
+    struct buf databuf = BUF_INITIALIZER;
+    const char *data;
+    int datalen;
     int r = 0, cb_r = 0;
     int need_unlock = 0;
 
@@ -1095,14 +1361,17 @@ int myforeach(struct db *db,
 	if (KEYLEN(ptr) < (uint32_t) prefixlen) break;
 	if (prefixlen && db->compar(KEY(ptr), prefixlen, prefix, prefixlen)) break;
 
+	if ((cb_r = getdata(db, ptr, &databuf, &data, &datalen))) break;
+
 	if (!goodp ||
-	    goodp(rock, KEY(ptr), KEYLEN(ptr), DATA(ptr), DATALEN(ptr))) {
+	    goodp(rock, KEY(ptr), KEYLEN(ptr), data, datalen)) {
 	    ino_t ino = db->map_ino;
 	    unsigned long sz = db->map_size;
 
 	    if (!tidptr) {
 		/* release read lock */
 		if ((r = unlock(db)) < 0) {
+		    buf_free(&databuf);
 		    return r;
 		}
 		need_unlock = 0;
@@ -1117,13 +1386,14 @@ int myforeach(struct db *db,
 	    savebufsize = KEYLEN(ptr);
 
 	    /* make callback */
-	    cb_r = cb(rock, KEY(ptr), KEYLEN(ptr), DATA(ptr), DATALEN(ptr));
+	    cb_r = cb(rock, KEY(ptr), KEYLEN(ptr), data, datalen);
 	    if (cb_r) break;
 
 	    if (!tidptr) {
 		/* grab a r lock */
 		if ((r = read_lock(db)) < 0) {
 		    free(savebuf);
+		    buf_free(&databuf);
 		    return r;
 		}
 		need_unlock = 1;
@@ -1158,6 +1428,7 @@ int myforeach(struct db *db,
     }
 
     free(savebuf);
+    buf_free(&databuf);
 
     if (need_unlock) {
 	/* release read lock */
@@ -1205,6 +1476,8 @@ int mystore(struct db *db,
     uint32_t todelete;
     unsigned newoffset;
     uint32_t netnewoffset;
+    struct buf zdata = BUF_INITIALIZER;
+    uint32_t rawdatalen;
     int r;
 
     assert(db != NULL);
@@ -1278,8 +1551,14 @@ int mystore(struct db *db,
 	}
     }
 
+    rawdatalen = putdata(data, datalen, &zdata);
+    if (rawdatalen & DATA_COMPRESSED) {
+	data = zdata.s;
+	datalen = zdata.len;
+    }
+
     klen = htonl(keylen);
-    dlen = htonl(datalen);
+    dlen = htonl(rawdatalen);
     
     netnewoffset = htonl(newoffset);
 
@@ -1302,6 +1581,7 @@ int mystore(struct db *db,
     getsyncfd(db, tid);
     lseek(tid->syncfd, tid->logend, SEEK_SET);
     r = retry_writev(tid->syncfd, iov, num_iov);
+    buf_free(&zdata);
     if (r < 0) {
 	syslog(LOG_ERR, "DBERROR: retry_writev(): %m");
 	myabort(db, tid);
@@ -1428,6 +1708,103 @@ int mydelete(struct db *db,
     return 0;
 }
 
+/* delete every node whose key starts with 'prefix'.  they're all next
+ * to each other, so rather than unlinking them one at a time we log
+ * all the deletions in one write and then splice the whole run out
+ * with a single pointer update per level. */
+static int mydelete_range(struct db *db,
+			  const char *prefix, int prefixlen,
+			  struct txn **tidptr)
+{
+    const char *ptr;
+    unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
+    unsigned newoffsets[SKIPLIST_MAXLEVEL+1];
+    struct buf log = BUF_INITIALIZER;
+    struct txn *tid, *localtid = NULL;
+    unsigned i, lvl;
+    int r;
+
+    assert(prefix && prefixlen);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) {
+	tidptr = &localtid;
+    }
+
+    /* make sure we're write locked and up to date */
+    if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	return r;
+    }
+
+    tid = *tidptr; /* consistent naming is nice */
+
+    ptr = find_node(db, prefix, prefixlen, updateoffsets);
+
+    /* where each level points once the run is gone */
+    for (i = 0; i < db->curlevel; i++) {
+	newoffsets[i] = FORWARD(db->map_base + updateoffsets[i], i);
+    }
+
+    while (ptr != db->map_base) {
+	if (KEYLEN(ptr) < (uint32_t) prefixlen) break;
+	if (db->compar(KEY(ptr), prefixlen, prefix, prefixlen)) break;
+
+	buf_appendbit32(&log, DELETE);
+	buf_appendbit32(&log, ptr - db->map_base);
+
+	lvl = LEVEL(ptr);
+	for (i = 0; i < lvl; i++) {
+	    newoffsets[i] = FORWARD(ptr, i);
+	}
+
+	ptr = db->map_base + FORWARD(ptr, 0);
+    }
+
+    if (log.len) {
+	/* log the deletions */
+	getsyncfd(db, tid);
+	lseek(tid->syncfd, tid->logend, SEEK_SET);
+	r = retry_write(tid->syncfd, log.s, log.len);
+	if (r < 0) {
+	    syslog(LOG_ERR, "DBERROR: retry_write(): %m");
+	    buf_free(&log);
+	    myabort(db, tid);
+	    return CYRUSDB_IOERROR;
+	}
+	tid->logend += r;
+
+	/* update pointers after writing the log so abort is guaranteed
+	 * to see which records need reverting */
+	for (i = 0; i < db->curlevel; i++) {
+	    uint32_t netnewoffset;
+
+	    if (FORWARD(db->map_base + updateoffsets[i], i) ==
+		newoffsets[i]) {
+		break;
+	    }
+	    netnewoffset = htonl(newoffsets[i]);
+	    lseek(db->fd,
+		  PTR(db->map_base + updateoffsets[i], i) - db->map_base,
+		  SEEK_SET);
+	    retry_write(db->fd, (char *) &netnewoffset, 4);
+	}
+    }
+    buf_free(&log);
+
+    if (be_paranoid) {
+	assert(myconsistent(db, tid, 1) == 0);
+    }
+
+    if (localtid) {
+	/* commit the delete, which releases the write lock */
+	r = mycommit(db, tid);
+	if (r) return r;
+    }
+
+    return 0;
+}
+
 int mycommit(struct db *db, struct txn *tid)
 {
     uint32_t commitrectype = htonl(COMMIT);
@@ -1599,6 +1976,9 @@ int myabort(struct db *db, struct txn *tid)
 
     db->map_size = tid->logstart;
 
+    /* the next records go where the removed ones were */
+    if (db->idx.scanned > tid->logstart) db->idx.scanned = tid->logstart;
+
     /* release the write lock */
     if ((r = unlock(db)) < 0) {
 	return r;
@@ -1847,6 +2227,332 @@ static int mycheckpoint(struct db *db, int locked)
     return r;
 }
 
+/*
+ * bulk loading
+ *
+ * like a checkpoint, we write fname.NEW in order from scratch and then
+ * rename it into place, merging in the existing records as we go.
+ * since all the keys come in order, node N (counting from 1) can simply
+ * be given 1 + (trailing zero bits of N) levels, which is the ideal
+ * shape for a PROB of 0.5.  the file is written sequentially through a
+ * buffer, and we only need to seek back to set pointers in nodes that
+ * have already been flushed.
+ */
+
+#define BULK_BUFSIZE (1024 * 1024)
+
+struct cyrusdb_bulk {
+    struct db *db;
+    char fname[1024];
+    int fd;
+
+    unsigned oldoffset;		/* next existing record to merge */
+    unsigned listsize;
+    unsigned curlevel;
+    unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
+
+    struct buf out;		/* unwritten tail of the new file */
+    unsigned outoffset;		/* file offset of out.s[0] */
+
+    struct buf lastkey;
+    int havelast;
+
+    struct buf zdata;		/* compressed value being added */
+};
+
+static int bulk_flush(struct cyrusdb_bulk *bulk)
+{
+    if (!bulk->out.len) return 0;
+
+    lseek(bulk->fd, bulk->outoffset, SEEK_SET);
+    if (retry_write(bulk->fd, bulk->out.s, bulk->out.len) !=
+	(int) bulk->out.len) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: writing %s: %m",
+	       bulk->fname);
+	return CYRUSDB_IOERROR;
+    }
+    bulk->outoffset += bulk->out.len;
+    bulk->out.len = 0;
+
+    return 0;
+}
+
+/* set the 4 bytes at 'offset' in the new file to 'val' */
+static int bulk_setptr(struct cyrusdb_bulk *bulk, unsigned offset,
+		       unsigned val)
+{
+    uint32_t netval = htonl(val);
+
+    if (offset >= bulk->outoffset) {
+	memcpy(bulk->out.s + (offset - bulk->outoffset), &netval, 4);
+	return 0;
+    }
+
+    lseek(bulk->fd, offset, SEEK_SET);
+    if (retry_write(bulk->fd, (char *) &netval, 4) != 4) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: writing %s: %m",
+	       bulk->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* 'rawdatalen' is the length as stored, including DATA_COMPRESSED */
+static int bulk_write(struct cyrusdb_bulk *bulk,
+		      const char *key, unsigned keylen,
+		      const char *data, uint32_t rawdatalen)
+{
+    uint32_t zeropadding[4] = { 0, 0, 0, 0 };
+    unsigned datalen = rawdatalen & ~DATA_COMPRESSED;
+    unsigned offset, ptroffset, lvl, n, i;
+    int r;
+
+    /* ideal level for this node */
+    bulk->listsize++;
+    for (lvl = 1, n = bulk->listsize; !(n & 1); n >>= 1) lvl++;
+    if (lvl > bulk->db->maxlevel) lvl = bulk->db->maxlevel;
+    if (lvl > bulk->curlevel) bulk->curlevel = lvl;
+
+    if (bulk->out.len >= BULK_BUFSIZE) {
+	r = bulk_flush(bulk);
+	if (r) return r;
+    }
+
+    offset = bulk->outoffset + bulk->out.len;
+    ptroffset = offset + 12 + ROUNDUP(keylen) + ROUNDUP(datalen);
+
+    buf_appendbit32(&bulk->out, INORDER);
+    buf_appendbit32(&bulk->out, keylen);
+    buf_appendmap(&bulk->out, key, keylen);
+    buf_appendmap(&bulk->out, (char *) zeropadding, ROUNDUP(keylen) - keylen);
+    buf_appendbit32(&bulk->out, rawdatalen);
+    buf_appendmap(&bulk->out, data, datalen);
+    buf_appendmap(&bulk->out, (char *) zeropadding,
+		  ROUNDUP(datalen) - datalen);
+    /* forward pointers get filled in by later nodes */
+    for (i = 0; i < lvl; i++) buf_appendbit32(&bulk->out, 0);
+    buf_appendbit32(&bulk->out, -1);
+
+    for (i = 0; i < lvl; i++) {
+	r = bulk_setptr(bulk, bulk->updateoffsets[i], offset);
+	if (r) return r;
+	bulk->updateoffsets[i] = ptroffset + 4 * i;
+    }
+
+    return 0;
+}
+
+/* copy existing records that sort before 'key' (or all of them, if
+ * 'key' is NULL), and skip one that's equal to it */
+static int bulk_merge(struct cyrusdb_bulk *bulk, const char *key, int keylen)
+{
+    struct db *db = bulk->db;
+    const char *ptr;
+    int cmp, r;
+
+    while (bulk->oldoffset) {
+	ptr = db->map_base + bulk->oldoffset;
+	cmp = key ? db->compar(KEY(ptr), KEYLEN(ptr), key, keylen) : -1;
+	if (cmp > 0) break;
+
+	bulk->oldoffset = FORWARD(ptr, 0);
+	if (!cmp) break;
+
+	r = bulk_write(bulk, KEY(ptr), KEYLEN(ptr), DATA(ptr), RAWDATALEN(ptr));
+	if (r) return r;
+    }
+
+    return 0;
+}
+
+static int mybulk_start(struct db *db, struct cyrusdb_bulk **ret)
+{
+    struct cyrusdb_bulk *bulk;
+    unsigned i;
+    int r;
+
+    assert(db->current_txn == NULL);
+
+    r = write_lock(db, NULL);
+    if (r < 0) return r;
+
+    /* merge from a clean copy of what's there now */
+    if (SAFE_TO_APPEND(db)) {
+	r = recovery(db, RECOVERY_FORCE | RECOVERY_CALLER_LOCKED);
+	if (r) {
+	    /* recovery() normally lets go of the lock when it fails */
+	    if (db->lock_status != UNLOCKED) unlock(db);
+	    return r;
+	}
+    }
+
+    bulk = xzmalloc(sizeof(struct cyrusdb_bulk));
+    bulk->db = db;
+    snprintf(bulk->fname, sizeof(bulk->fname), "%s.NEW", db->fname);
+    bulk->fd = open(bulk->fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (bulk->fd < 0) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: open(%s): %m",
+	       bulk->fname);
+	unlock(db);
+	free(bulk);
+	return CYRUSDB_IOERROR;
+    }
+
+    bulk->oldoffset = FORWARD(DUMMY_PTR(db), 0);
+    bulk->curlevel = 1;
+
+    /* the header is written last; start with an empty dummy node */
+    buf_ensure(&bulk->out, BULK_BUFSIZE + DUMMY_SIZE(db));
+    buf_appendmap(&bulk->out, (char *) HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    while (bulk->out.len < DUMMY_OFFSET(db)) buf_appendbit32(&bulk->out, 0);
+    buf_appendbit32(&bulk->out, DUMMY);
+    buf_appendbit32(&bulk->out, 0);
+    buf_appendbit32(&bulk->out, 0);
+    for (i = 0; i < db->maxlevel; i++) {
+	bulk->updateoffsets[i] = bulk->out.len;
+	buf_appendbit32(&bulk->out, 0);
+    }
+    buf_appendbit32(&bulk->out, -1);
+
+    *ret = bulk;
+    return 0;
+}
+
+static int mybulk_add(struct cyrusdb_bulk *bulk,
+		      const char *key, int keylen,
+		      const char *data, int datalen)
+{
+    struct db *db = bulk->db;
+    uint32_t rawdatalen;
+    int r;
+
+    assert(key && keylen);
+
+    if (bulk->havelast &&
+	db->compar(bulk->lastkey.s, bulk->lastkey.len, key, keylen) >= 0) {
+	return CYRUSDB_EXISTS;
+    }
+    buf_setmap(&bulk->lastkey, key, keylen);
+    bulk->havelast = 1;
+
+    r = bulk_merge(bulk, key, keylen);
+    if (!r && data) {
+	rawdatalen = putdata(data, datalen, &bulk->zdata);
+	if (rawdatalen & DATA_COMPRESSED) data = bulk->zdata.s;
+	r = bulk_write(bulk, key, keylen, data, rawdatalen);
+    }
+
+    return r;
+}
+
+static void bulk_free(struct cyrusdb_bulk *bulk)
+{
+    if (bulk->fd != -1) close(bulk->fd);
+    buf_free(&bulk->out);
+    buf_free(&bulk->lastkey);
+    buf_free(&bulk->zdata);
+    free(bulk);
+}
+
+static int mybulk_abort(struct cyrusdb_bulk *bulk)
+{
+    struct db *db = bulk->db;
+
+    unlink(bulk->fname);
+    bulk_free(bulk);
+
+    return unlock(db);
+}
+
+static int mybulk_commit(struct cyrusdb_bulk *bulk)
+{
+    struct db *db = bulk->db;
+    struct stat sbuf;
+    int oldfd;
+    int r;
+
+    r = bulk_merge(bulk, NULL, 0);
+    if (!r) r = bulk_flush(bulk);
+    if (r) {
+	mybulk_abort(bulk);
+	return r;
+    }
+
+    /* from here on, as for a checkpoint */
+    oldfd = db->fd;
+    db->fd = bulk->fd;
+    bulk->fd = -1;
+    db->curlevel = bulk->curlevel;
+    db->listsize = bulk->listsize;
+    db->logstart = bulk->outoffset;
+    db->last_recovery = time(NULL);
+    r = write_header(db);
+
+    if (!r && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: fdatasync(%s): %m",
+	       bulk->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (!r) {
+	db->lock_status = UNLOCKED; /* well, the new file is... */
+	r = write_lock(db, bulk->fname);
+    }
+
+    if (!r && (rename(bulk->fname, db->fname) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: rename(%s, %s): %m",
+	       bulk->fname, db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (!r && DO_FSYNC && (fsync(db->fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist bulk load: fsync(%s): %m",
+	       db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (r) {
+	/* put the old file back */
+	close(db->fd);
+	db->fd = oldfd;
+	unlink(bulk->fname);
+	db->lock_status = WRITELOCKED;
+	map_free(&db->map_base, &db->map_len);
+	db->map_ino = 0;
+	bulk_free(bulk);
+	unlock(db);
+	return r;
+    }
+
+    close(oldfd);
+
+    map_free(&db->map_base, &db->map_len);
+    if (fstat(db->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+    else {
+	db->map_size = sbuf.st_size;
+	db->map_ino = sbuf.st_ino;
+	map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
+		    db->fname, 0);
+    }
+
+    if (!r && (r = myconsistent(db, NULL, 1)) < 0) {
+	syslog(LOG_ERR, "db %s, inconsistent after bulk load", db->fname);
+    }
+
+    syslog(LOG_INFO, "skiplist: bulk loaded %s (%u record%s, %u bytes)",
+	   db->fname, db->listsize, db->listsize == 1 ? "" : "s",
+	   db->logstart);
+
+    bulk_free(bulk);
+    unlock(db);
+
+    return r;
+}
+
 /* dump the database.
    if detail == 1, dump all records.
    if detail == 2, also dump pointers for active records.
@@ -1885,8 +2591,9 @@ static int dump(struct db *db, int detail __attribute__((unused)))
 	case DUMMY:
 	case INORDER:
 	case ADD:
-	    printf("kl=%d dl=%d lvl=%d\n",
-		   KEYLEN(ptr), DATALEN(ptr), LEVEL(ptr));
+	    printf("kl=%d dl=%d%s lvl=%d\n",
+		   KEYLEN(ptr), DATALEN(ptr), COMPRESSED(ptr) ? "z" : "",
+		   LEVEL(ptr));
 	    printf("\t");
 	    for (i = 0; i < LEVEL(ptr); i++) {
 		printf("%04X ", FORWARD(ptr, i));
@@ -1915,6 +2622,13 @@ static int consistent(struct db *db)
     return myconsistent(db, NULL, 0);
 }
 
+static int mygeneration(const char *fname, struct cyrusdb_generation *gen)
+{
+    /* every committed transaction writes to the file and every
+       checkpoint replaces it */
+    return cyrusdb_statgeneration(fname, gen);
+}
+
 /* perform some basic consistency checks */
 static int myconsistent(struct db *db, struct txn *tid, int locked)
 {
@@ -2406,5 +3120,14 @@ struct cyrusdb_backend cyrusdb_skiplist =
     &myabort,
 
     &dump,
-    &consistent
+    &consistent,
+
+    &mygeneration,
+
+    &mybulk_start,
+    &mybulk_add,
+    &mybulk_commit,
+    &mybulk_abort,
+
+    &mydelete_range
 };
@@ -49,6 +49,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "cyrusdb.h"
 #include "exitcodes.h"
@@ -65,6 +66,7 @@ typedef int exec_cb(void *rock,
 typedef struct sql_engine {
     const char *name;
     const char *binary_type;
+    const char *index_cmd;	/* CREATE INDEX on dbkey, or NULL */
     void *(*sql_open)(char *host, char *port, int usessl,
 		      const char *user, const char *password,
 		      const char *database);
@@ -75,14 +77,84 @@ typedef struct sql_engine {
     int (*sql_rollback_txn)(void *conn);
     int (*sql_exec)(void *conn, const char *cmd, exec_cb *cb, void *rock);
     void (*sql_close)(void *conn);
+
+    /* optional: check that an idle connection is still usable */
+    int (*sql_ping)(void *conn);
+
+    /* optional: prepared statements with $1, $2 parameters; engines
+     * without them get the parameters escaped into the SQL text */
+    void *(*sql_prepare)(void *conn, const char *name, const char *cmd);
+    int (*sql_exec_prepared)(void *conn, void *stmt, int nparams,
+			     const char **params, const int *paramlens,
+			     exec_cb *cb, void *rock);
+    void (*sql_finalize)(void *conn, void *stmt);
 } sql_engine_t;
 
+/* the statements we run, prepared once per table */
+enum {
+    STMT_FETCH = 0,
+    STMT_FOREACH,
+    STMT_FOREACHRANGE,
+    STMT_INSERT,
+    STMT_UPDATE,
+    STMT_DELETE,
+    STMT_DELRANGE,
+    STMT_DELTAIL,
+    NUM_STMTS
+};
+
+static const struct {
+    const char *name;
+    const char *prepared;	/* %s is the table */
+    const char *text;		/* %s are the table and escaped params */
+} stmt_sql[NUM_STMTS] = {
+    { "fetch",
+      "SELECT dbkey, data FROM %s WHERE dbkey = $1;",
+      "SELECT dbkey, data FROM %s WHERE dbkey = '%s';" },
+    /* foreach stops at the first key past the prefix; the unbounded
+       form is only for prefixes nothing sorts after but their own keys */
+    { "foreach",
+      "SELECT dbkey, data FROM %s WHERE dbkey >= $1 ORDER BY dbkey;",
+      "SELECT dbkey, data FROM %s WHERE dbkey >= '%s' ORDER BY dbkey;" },
+    { "foreachrange",
+      "SELECT dbkey, data FROM %s WHERE dbkey >= $1 AND dbkey < $2"
+      " ORDER BY dbkey;",
+      "SELECT dbkey, data FROM %s WHERE dbkey >= '%s' AND dbkey < '%s'"
+      " ORDER BY dbkey;" },
+    { "insert",
+      "INSERT INTO %s VALUES ($1, $2);",
+      "INSERT INTO %s VALUES ('%s', '%s');" },
+    { "update",
+      "UPDATE %s SET data = $1 WHERE dbkey = $2;",
+      "UPDATE %s SET data = '%s' WHERE dbkey = '%s';" },
+    { "delete",
+      "DELETE FROM %s WHERE dbkey = $1;",
+      "DELETE FROM %s WHERE dbkey = '%s';" },
+    { "delrange",
+      "DELETE FROM %s WHERE dbkey >= $1 AND dbkey < $2;",
+      "DELETE FROM %s WHERE dbkey >= '%s' AND dbkey < '%s';" },
+    { "deltail",
+      "DELETE FROM %s WHERE dbkey >= $1;",
+      "DELETE FROM %s WHERE dbkey >= '%s';" }
+};
+
+struct sql_stmt {
+    void *stmt;     /* engine's prepared statement */
+    int busy;       /* being stepped through by a foreach */
+};
+
 struct db {
     void *conn;     /* connection to database */
     char *table;    /* table that we are operating on */
     char *esc_key;  /* allocated buffer for escaped key */
     char *esc_data; /* allocated buffer for escaped data */
     char *data;     /* allocated buffer for fetched data */
+
+    int refcount;   /* open handles; idle handles keep their connection */
+    struct sql_stmt stmt[NUM_STMTS];
+
+    pid_t pid;      /* process which opened the connection */
+    struct db *next;
 };
 
 struct txn {
@@ -92,6 +164,9 @@ struct txn {
 
 static int dbinit = 0;
 static const sql_engine_t *dbengine = NULL;
+static struct db *open_dbs = NULL;
+/* wait this long (ms) for another process' lock on an SQLite database */
+#define SQL_LOCK_TIMEOUT 10000
 
 
 #ifdef HAVE_MYSQL
@@ -191,6 +266,11 @@ static void _mysql_close(void *conn)
 {
     mysql_close(conn);
 }
+
+static int _mysql_ping(void *conn)
+{
+    return mysql_ping(conn);
+}
 #endif /* HAVE_MYSQL */
 
 
@@ -310,6 +390,77 @@ static void _pgsql_close(void *conn)
 {
     PQfinish(conn);
 }
+
+static int _pgsql_ping(void *conn)
+{
+    if (PQstatus(conn) == CONNECTION_OK) return 0;
+
+    PQreset(conn);
+    return (PQstatus(conn) == CONNECTION_OK) ? 0 : -1;
+}
+
+static void *_pgsql_prepare(void *conn, const char *name, const char *cmd)
+{
+    PGresult *result;
+
+    syslog(LOG_DEBUG, "preparing SQL cmd: %s", cmd);
+
+    result = PQprepare(conn, name, cmd, 0, NULL);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+	syslog(LOG_ERR, "DBERROR: SQL backend: %s", PQerrorMessage(conn));
+	PQclear(result);
+	return NULL;
+    }
+    PQclear(result);
+
+    return xstrdup(name);
+}
+
+static int _pgsql_exec_prepared(void *conn, void *stmt, int nparams,
+				const char **params, const int *paramlens,
+				exec_cb *cb, void *rock)
+{
+    static const int formats[] = { 1, 1 };  /* binary */
+    PGresult *result;
+    int row_count, i, r = 0;
+    ExecStatusType status;
+
+    assert(nparams <= 2);
+
+    result = PQexecPrepared(conn, (const char *) stmt, nparams,
+			    params, paramlens, formats, 1);
+
+    status = PQresultStatus(result);
+    if (status == PGRES_COMMAND_OK) {
+	PQclear(result);
+	return 0;
+    }
+    else if (status != PGRES_TUPLES_OK) {
+	syslog(LOG_ERR, "DBERROR: SQL backend: %s", PQerrorMessage(conn));
+	PQclear(result);
+	return CYRUSDB_INTERNAL;
+    }
+
+    /* binary results need no unescaping */
+    row_count = PQntuples(result);
+    for (i = 0; !r && i < row_count; i++) {
+	r = cb(rock, PQgetvalue(result, i, 0), PQgetlength(result, i, 0),
+	       PQgetvalue(result, i, 1), PQgetlength(result, i, 1));
+    }
+
+    PQclear(result);
+
+    return r;
+}
+
+static void _pgsql_finalize(void *conn, void *stmt)
+{
+    char cmd[1024];
+
+    snprintf(cmd, sizeof(cmd), "DEALLOCATE %s;", (char *) stmt);
+    _pgsql_exec(conn, cmd, NULL, NULL);
+    free(stmt);
+}
 #endif /* HAVE_PGSQL */
 
 
@@ -330,8 +481,12 @@ static void *_sqlite_open(char *host __attribute__((unused)),
     if (rc != SQLITE_OK) {
 	syslog(LOG_ERR, "DBERROR: SQL backend: %s", sqlite3_errmsg(db));
 	sqlite3_close(db);
+	return NULL;
     }
 
+    /* wait for other processes rather than failing with SQLITE_BUSY */
+    sqlite3_busy_timeout(db, SQL_LOCK_TIMEOUT);
+
     return db;
 }
 
@@ -390,7 +545,10 @@ static int _sqlite_exec(void *conn, const char *cmd, exec_cb *cb, void *rock)
 
 static int _sqlite_begin_txn(void *conn)
 {
-    return _sqlite_exec(conn, "BEGIN TRANSACTION", NULL, NULL);
+    /* take the write lock now: a deferred transaction which later
+       needs it can deadlock with another writer, and SQLite then
+       fails without calling the busy handler */
+    return _sqlite_exec(conn, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL);
 }
 
 static int _sqlite_commit_txn(void *conn)
@@ -407,29 +565,158 @@ static void _sqlite_close(void *conn)
 {
     sqlite3_close(conn);
 }
+
+static void *_sqlite_prepare(void *conn,
+			     const char *name __attribute__((unused)),
+			     const char *cmd)
+{
+    sqlite3_stmt *stmt = NULL;
+
+    syslog(LOG_DEBUG, "preparing SQL cmd: %s", cmd);
+
+    if (sqlite3_prepare_v2(conn, cmd, -1, &stmt, NULL) != SQLITE_OK) {
+	syslog(LOG_ERR, "DBERROR: SQL backend: %s", sqlite3_errmsg(conn));
+	return NULL;
+    }
+
+    return stmt;
+}
+
+static int _sqlite_exec_prepared(void *conn, void *stmt, int nparams,
+				 const char **params, const int *paramlens,
+				 exec_cb *cb, void *rock)
+{
+    int i, rc, r = 0;
+
+    /* bind as text, like the rows stored by the plain SQL path */
+    for (i = 0; i < nparams; i++) {
+	sqlite3_bind_text(stmt, i + 1, params[i], paramlens[i], SQLITE_STATIC);
+    }
+
+    /* step through the results as the callback asks for them */
+    while (!r && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	const unsigned char *key = sqlite3_column_text(stmt, 0);
+	int keylen = sqlite3_column_bytes(stmt, 0);
+	const unsigned char *data = sqlite3_column_text(stmt, 1);
+	int datalen = sqlite3_column_bytes(stmt, 1);
+
+	r = cb(rock, (char *) key, keylen, (char *) data, datalen);
+    }
+
+    if (!r && rc != SQLITE_DONE) {
+	syslog(LOG_ERR, "DBERROR: SQL backend: %s", sqlite3_errmsg(conn));
+	r = CYRUSDB_INTERNAL;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return r;
+}
+
+static void _sqlite_finalize(void *conn __attribute__((unused)), void *stmt)
+{
+    sqlite3_finalize(stmt);
+}
 #endif /* HAVE_SQLITE */
 
 
 static const sql_engine_t sql_engines[] = {
 #ifdef HAVE_MYSQL
-    { "mysql", "BLOB", &_mysql_open, &_mysql_escape,
+    { "mysql", "BLOB", NULL, &_mysql_open, &_mysql_escape,
       &_mysql_begin_txn, &_mysql_commit_txn, &_mysql_rollback_txn,
-      &_mysql_exec, &_mysql_close },
+      &_mysql_exec, &_mysql_close, &_mysql_ping,
+      NULL, NULL, NULL },
 #endif /* HAVE_MYSQL */
 #ifdef HAVE_PGSQL
-    { "pgsql", "BYTEA", &_pgsql_open, &_pgsql_escape,
+    { "pgsql", "BYTEA",
+      "CREATE UNIQUE INDEX IF NOT EXISTS %s_dbkey ON %s (dbkey);",
+      &_pgsql_open, &_pgsql_escape,
       &_pgsql_begin_txn, &_pgsql_commit_txn, &_pgsql_rollback_txn,
-      &_pgsql_exec, &_pgsql_close },
+      &_pgsql_exec, &_pgsql_close, &_pgsql_ping,
+      &_pgsql_prepare, &_pgsql_exec_prepared, &_pgsql_finalize },
 #endif
 #ifdef HAVE_SQLITE
-    { "sqlite", "BLOB", &_sqlite_open, &_sqlite_escape,
+    { "sqlite", "BLOB",
+      "CREATE UNIQUE INDEX IF NOT EXISTS %s_dbkey ON %s (dbkey);",
+      &_sqlite_open, &_sqlite_escape,
       &_sqlite_begin_txn, &_sqlite_commit_txn, &_sqlite_rollback_txn,
-      &_sqlite_exec, &_sqlite_close },
+      &_sqlite_exec, &_sqlite_close, NULL,
+      &_sqlite_prepare, &_sqlite_exec_prepared, &_sqlite_finalize },
 #endif
-    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL, NULL, NULL }
 };
 
 
+static struct txn *begin_txn(struct db *db)
+{
+    /* start a transaction */
+    if (dbengine->sql_begin_txn(db->conn)) {
+	syslog(LOG_ERR, "DBERROR: failed to start txn on %s",
+	       db->table);
+	return NULL;
+    }
+    return xzmalloc(sizeof(struct txn));
+}
+
+static int finish_txn(struct db *db, struct txn *tid, int commit)
+{
+    if (tid) {
+	int rc = commit ? dbengine->sql_commit_txn(db->conn) :
+	    dbengine->sql_rollback_txn(db->conn);
+
+	if (tid->lastkey) free(tid->lastkey);
+	free(tid);
+
+	if (rc) {
+	    syslog(LOG_ERR, "DBERROR: failed to %s txn on %s",
+		   commit ? "commit" : "abort", db->table);
+	    return CYRUSDB_INTERNAL;
+	}
+    }
+
+    return 0;
+}
+
+/* point *tid at the caller's transaction for a write, starting it
+ * if need be; writes made without one are committed on their own */
+static int write_txn(struct db *db, struct txn ***tid)
+{
+    if (*tid && !**tid && !(**tid = begin_txn(db))) return CYRUSDB_INTERNAL;
+
+    return 0;
+}
+
+/* finish a write made in the transaction from write_txn() */
+static int write_done(struct db *db, struct txn **tid, int r)
+{
+    if (r && tid) dbengine->sql_rollback_txn(db->conn);
+
+    return r;
+}
+
+/* free a handle, closing its connection unless it was inherited
+ * from the process which opened it */
+static void dispose(struct db *db)
+{
+    int i;
+
+    if (db->pid == getpid()) {
+	for (i = 0; i < NUM_STMTS; i++) {
+	    if (db->stmt[i].stmt)
+		dbengine->sql_finalize(db->conn, db->stmt[i].stmt);
+	}
+	dbengine->sql_close(db->conn);
+    }
+
+    free(db->table);
+    if (db->esc_key) free(db->esc_key);
+    if (db->esc_data) free(db->esc_data);
+    if (db->data) free(db->data);
+    free(db);
+}
+
 static int init(const char *dbdir __attribute__((unused)),
 		int flags __attribute__((unused)))
 {
@@ -466,7 +753,16 @@ static int init(const char *dbdir __attribute__((unused)),
 
 static int done(void)
 {
-    --dbinit;
+    if (!--dbinit) {
+	/* close the connections kept for reuse */
+	while (open_dbs) {
+	    struct db *db = open_dbs;
+
+	    open_dbs = db->next;
+	    dispose(db);
+	}
+    }
+
     return 0;
 }
 
@@ -485,10 +781,38 @@ static int myopen(const char *fname, int flags, struct db **ret)
 {
     const char *database, *hostnames, *user, *passwd;
     char *host_ptr, *host, *cur_host, *cur_port;
-    int usessl;
+    int usessl, exists;
     void *conn = NULL;
+    struct db *db, **prev;
     char *p, *table, cmd[1024];
 
+    /* get the name of the table */
+
+    /* strip any path from the fname */
+    p = strrchr(fname, '/');
+    table = xstrdup(p ? ++p : fname);
+
+    /* convert '.' to '_' */
+    if ((p = strrchr(table, '.'))) *p = '_';
+
+    /* reuse the connection of an open or idle handle on this table */
+    for (prev = &open_dbs; (db = *prev); prev = &db->next) {
+	if (db->pid == getpid() && !strcmp(db->table, table)) break;
+    }
+    if (db && !db->refcount &&
+	dbengine->sql_ping && dbengine->sql_ping(db->conn)) {
+	syslog(LOG_NOTICE, "SQL backend: lost idle connection for %s", table);
+	*prev = db->next;
+	dispose(db);
+	db = NULL;
+    }
+    if (db) {
+	db->refcount++;
+	free(table);
+	*ret = db;
+	return 0;
+    }
+
     /* make a connection to the database */
     database = libcyrus_config_getstring(CYRUSOPT_SQL_DATABASE);
     hostnames = libcyrus_config_getstring(CYRUSOPT_SQL_HOSTNAMES);
@@ -533,23 +857,15 @@ static int myopen(const char *fname, int flags, struct db **ret)
 
     if (!conn) {
 	syslog(LOG_ERR, "DBERROR: could not open SQL database '%s'", database);
+	free(table);
 	return CYRUSDB_IOERROR;
     }
 
-    /* get the name of the table and CREATE it if necessary */
-
-    /* strip any path from the fname */
-    p = strrchr(fname, '/');
-    table = xstrdup(p ? ++p : fname);
-
-    /* convert '.' to '_' */
-    if ((p = strrchr(table, '.'))) *p = '_';
-
-    /* check if the table exists */
+    /* check if the table exists and CREATE it if necessary */
     /* XXX is this the best way to do this? */
     snprintf(cmd, sizeof(cmd), "SELECT * FROM %s LIMIT 0;", table);
-    if (dbengine->sql_exec(conn, cmd, NULL, NULL) &&
-	(flags & CYRUSDB_CREATE)) {
+    exists = !dbengine->sql_exec(conn, cmd, NULL, NULL);
+    if (!exists && (flags & CYRUSDB_CREATE)) {
 	/* create the table */
 	snprintf(cmd, sizeof(cmd),
 		 "CREATE TABLE %s (dbkey %s NOT NULL, data %s);",
@@ -557,47 +873,121 @@ static int myopen(const char *fname, int flags, struct db **ret)
 	if (dbengine->sql_exec(conn, cmd, NULL, NULL)) {
 	    syslog(LOG_ERR, "DBERROR: SQL failed: %s", cmd);
 	    dbengine->sql_close(conn);
+	    free(table);
 	    return CYRUSDB_INTERNAL;
 	}
+	exists = 1;
     }
 
-    *ret = (struct db *) xzmalloc(sizeof(struct db));
-    (*ret)->conn = conn;
-    (*ret)->table = table;
+    /* index the keys, for tables created before we did */
+    if (exists && dbengine->index_cmd) {
+	snprintf(cmd, sizeof(cmd), dbengine->index_cmd, table, table);
+	if (dbengine->sql_exec(conn, cmd, NULL, NULL)) {
+	    syslog(LOG_WARNING, "DBERROR: SQL failed: %s", cmd);
+	}
+    }
+
+    db = (struct db *) xzmalloc(sizeof(struct db));
+    db->conn = conn;
+    db->table = table;
+    db->refcount = 1;
+    db->pid = getpid();
+
+    db->next = open_dbs;
+    open_dbs = db;
+
+    *ret = db;
 
     return 0;
 }
+
 static int myclose(struct db *db)
 {
-    assert(db);
+    assert(db && db->refcount);
 
-    dbengine->sql_close(db->conn);
-    free(db->table);
-    if (db->esc_key) free(db->esc_key);
-    if (db->esc_data) free(db->esc_data);
-    if (db->data) free(db->data);
-    free(db);
+    /* keep the connection and statements for the next open */
+    db->refcount--;
 
     return 0;
 }
 
-static struct txn *start_txn(struct db *db)
+/* run one of our statements, with its parameters either bound to the
+ * statement prepared for this table or escaped into SQL text */
+static int sql_run(struct db *db, int op, int nparams,
+		   const char **params, const int *paramlens,
+		   exec_cb *cb, void *rock)
 {
-    /* start a transaction */
-    if (dbengine->sql_begin_txn(db->conn)) {
-	syslog(LOG_ERR, "DBERROR: failed to start txn on %s",
-	       db->table);
-	return NULL;
+    struct sql_stmt *s = &db->stmt[op];
+    struct buf cmd = BUF_INITIALIZER;
+    static int ntemp = 0;
+    char name[64];
+    void *stmt;
+    int r;
+
+    if (!dbengine->sql_prepare) {
+	char **to[2] = { &db->esc_key, &db->esc_data };
+	char *esc[2] = { NULL, NULL };
+	int i;
+
+	for (i = 0; i < nparams; i++) {
+	    esc[i] = dbengine->sql_escape(db->conn, to[i],
+					  params[i], paramlens[i]);
+	}
+
+	buf_printf(&cmd, stmt_sql[op].text, db->table, esc[0], esc[1]);
+	r = dbengine->sql_exec(db->conn, buf_cstring(&cmd), cb, rock);
+	buf_free(&cmd);
+
+	for (i = 0; i < nparams; i++) {
+	    if (esc[i] != *to[i]) free(esc[i]);
+	}
+
+	return r;
     }
-    return xzmalloc(sizeof(struct txn));
+
+    if (s->stmt && !s->busy) {
+	s->busy = 1;
+	r = dbengine->sql_exec_prepared(db->conn, s->stmt, nparams,
+					params, paramlens, cb, rock);
+	s->busy = 0;
+
+	return r;
+    }
+
+    buf_printf(&cmd, stmt_sql[op].prepared, db->table);
+
+    if (!s->stmt) {
+	s->stmt = dbengine->sql_prepare(db->conn, stmt_sql[op].name,
+					buf_cstring(&cmd));
+	buf_free(&cmd);
+	if (!s->stmt) return CYRUSDB_INTERNAL;
+
+	return sql_run(db, op, nparams, params, paramlens, cb, rock);
+    }
+
+    /* a callback wants the statement it is being called from:
+       use a throwaway copy */
+    snprintf(name, sizeof(name), "%s_%d", stmt_sql[op].name, ++ntemp);
+    stmt = dbengine->sql_prepare(db->conn, name, buf_cstring(&cmd));
+    buf_free(&cmd);
+    if (!stmt) return CYRUSDB_INTERNAL;
+
+    r = dbengine->sql_exec_prepared(db->conn, stmt, nparams,
+				    params, paramlens, cb, rock);
+    dbengine->sql_finalize(db->conn, stmt);
+
+    return r;
 }
 
 struct select_rock {
     int found;
     struct txn *tid;
-    foreach_cb *goodp;
+    const char *prefix;
+    int prefixlen;
+    foreach_p *goodp;
     foreach_cb *cb;
     void *rock;
+    int r;          /* what cb returned */
 };
 
 static int select_cb(void *rock,
@@ -607,6 +997,12 @@ static int select_cb(void *rock,
     struct select_rock *srock = (struct select_rock *) rock;
     int r = CYRUSDB_OK;
 
+    /* past the prefix, so past everything we want */
+    if (srock->prefixlen && (keylen < srock->prefixlen ||
+			     memcmp(key, srock->prefix, srock->prefixlen))) {
+	return CYRUSDB_DONE;
+    }
+
     /* if we're in a transaction, save this key */
     if (srock->tid) {
 	srock->tid->lastkey = xrealloc(srock->tid->lastkey, keylen);
@@ -624,6 +1020,8 @@ static int select_cb(void *rock,
 	if (srock->cb) r = srock->cb(srock->rock, key, keylen, data, datalen);
     }
 
+    srock->r = r;
+
     return r;
 }
 
@@ -648,34 +1046,49 @@ static int fetch_cb(void *rock,
     return 0;
 }
 
+/*
+ * Make the first key past all of those starting with 'prefix': the
+ * prefix with its last byte that can be incremented, incremented (not
+ * LIKE, which would need escaping of '_' and '%' and can't use the
+ * index everywhere).  Returns NULL if there's no such key, when the
+ * range runs to the end of the table.
+ */
+static char *prefix_end(const char *prefix, int prefixlen, int *endlen)
+{
+    char *end;
+
+    *endlen = prefixlen;
+    while (*endlen && (unsigned char) prefix[*endlen-1] == 0xff)
+	(*endlen)--;
+    if (!*endlen) return NULL;
+
+    end = xmalloc(*endlen);
+    memcpy(end, prefix, *endlen);
+    end[*endlen-1]++;
+    return end;
+}
+
 static int fetch(struct db *db, 
 		 const char *key, int keylen,
 		 const char **data, int *datalen,
 		 struct txn **tid)
 {
-    char cmd[1024], *esc_key;
     struct fetch_rock frock = { &db->data, datalen };
-    struct select_rock srock = { 0, NULL, NULL, &fetch_cb, &frock };
+    struct select_rock srock = { 0, NULL, NULL, 0, NULL, &fetch_cb, &frock, 0 };
     int r;
 
     if (data) *data = NULL;
     if (datalen) *datalen = 0;
 
     if (tid) {
-	if (!*tid && !(*tid = start_txn(db))) return CYRUSDB_INTERNAL;
+	if (!*tid && !(*tid = begin_txn(db))) return CYRUSDB_INTERNAL;
 	srock.tid = *tid;
     }
 
     /* fetch the data */
-    esc_key = dbengine->sql_escape(db->conn, &db->esc_key, key, keylen);
-    snprintf(cmd, sizeof(cmd),
-	     "SELECT * FROM %s WHERE dbkey = '%s';", db->table, esc_key);
-    r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
-
-    if (esc_key != db->esc_key) free(esc_key);
-
+    r = sql_run(db, STMT_FETCH, 1, &key, &keylen, &select_cb, &srock);
     if (r) {
-	syslog(LOG_ERR, "DBERROR: SQL failed %s", cmd);
+	syslog(LOG_ERR, "DBERROR: SQL fetch failed on %s", db->table);
 	if (tid) dbengine->sql_rollback_txn(db->conn);
 	return CYRUSDB_INTERNAL;
     }
@@ -693,28 +1106,38 @@ static int foreach(struct db *db,
 		   foreach_cb *cb, void *rock, 
 		   struct txn **tid)
 {
-    char cmd[1024], *esc_key = NULL;
-    struct select_rock srock = { 0, NULL, goodp, cb, rock };
+    struct select_rock srock = { 0, NULL, prefix, prefixlen,
+				 goodp, cb, rock, 0 };
+    const char *params[2];
+    int paramlens[2];
+    char *end;
     int r;
 
     if (tid) {
-	if (!*tid && !(*tid = start_txn(db))) return CYRUSDB_INTERNAL;
+	if (!*tid && !(*tid = begin_txn(db))) return CYRUSDB_INTERNAL;
 	srock.tid = *tid;
     }
 
-    /* fetch the data */
-    if (prefixlen) /* XXX hack for SQLite */
-	esc_key = dbengine->sql_escape(db->conn, &db->esc_key,
-				       prefix, prefixlen);
-    snprintf(cmd, sizeof(cmd),
-	     "SELECT * FROM %s WHERE dbkey LIKE '%s%%' ORDER BY dbkey;",
-	     db->table, esc_key ? esc_key : "");
-    r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
-
-    if (esc_key && esc_key != db->esc_key) free(esc_key);
+    /* walk the keys from the prefix on, until select_cb says we're
+       past it or the callback asks us to stop */
+    if (!prefix) prefix = "";
+    params[0] = prefix;
+    paramlens[0] = prefixlen;
+    if ((end = prefix_end(prefix, prefixlen, &paramlens[1]))) {
+	/* so the server only sends the keys we want */
+	params[1] = end;
+	r = sql_run(db, STMT_FOREACHRANGE, 2, params, paramlens,
+		    &select_cb, &srock);
+	free(end);
+    }
+    else {
+	r = sql_run(db, STMT_FOREACH, 1, params, paramlens,
+		    &select_cb, &srock);
+    }
+    if (srock.r) return srock.r;
 
-    if (r) {
-	syslog(LOG_ERR, "DBERROR: SQL failed %s", cmd);
+    if (r && r != CYRUSDB_DONE) {
+	syslog(LOG_ERR, "DBERROR: SQL foreach failed on %s", db->table);
 	if (tid) dbengine->sql_rollback_txn(db->conn);
 	return CYRUSDB_INTERNAL;
     }
@@ -727,37 +1150,31 @@ static int mystore(struct db *db,
 		   const char *data, int datalen,
 		   struct txn **tid, int overwrite)
 {
-    char cmd[1024], *esc_key;
-    int r = 0;
-
-    if (tid && !*tid && !(*tid = start_txn(db))) return CYRUSDB_INTERNAL;
+    const char *params[2];
+    int paramlens[2];
+    int r;
 
-    esc_key = dbengine->sql_escape(db->conn, &db->esc_key, key, keylen);
+    if ((r = write_txn(db, &tid))) return r;
 
     if (!data) {
 	/* DELETE the entry */
-	snprintf(cmd, sizeof(cmd), "DELETE FROM %s WHERE dbkey = '%s';",
-		 db->table, esc_key);
-	r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+	r = sql_run(db, STMT_DELETE, 1, &key, &keylen, NULL, NULL);
 
 	/* see if we just removed the previously SELECTed key */
 	if (!r && tid && *tid &&
-	    (*tid)->keylen == strlen(esc_key) &&
-	    !memcmp((*tid)->lastkey, esc_key, (*tid)->keylen)) {
+	    (*tid)->keylen == (size_t) keylen &&
+	    !memcmp((*tid)->lastkey, key, keylen)) {
 	    (*tid)->keylen = 0;
 	}
     }
     else {
 	/* INSERT/UPDATE the entry */
-	struct select_rock srock = { 0, NULL, NULL, NULL, NULL };
-
-	char *esc_data = dbengine->sql_escape(db->conn, &db->esc_data,
-					      data, datalen);
+	struct select_rock srock = { 0, NULL, NULL, 0, NULL, NULL, NULL, 0 };
 
 	/* see if we just SELECTed this key in this transaction */
 	if (tid && *tid) {
-	    if ((*tid)->keylen == strlen(esc_key) &&
-		!memcmp((*tid)->lastkey, esc_key, (*tid)->keylen)) {
+	    if ((*tid)->keylen == (size_t) keylen &&
+		!memcmp((*tid)->lastkey, key, keylen)) {
 		srock.found = 1;
 	    }
 	    srock.tid = *tid;
@@ -765,45 +1182,39 @@ static int mystore(struct db *db,
 
 	/* check if the entry exists */
 	if (!srock.found) {
-	    snprintf(cmd, sizeof(cmd),
-		     "SELECT * FROM %s WHERE dbkey = '%s';",
-		     db->table, esc_key);
-	    r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
+	    r = sql_run(db, STMT_FETCH, 1, &key, &keylen, &select_cb, &srock);
 	}
 
 	if (!r && srock.found) {
 	    if (overwrite) {
 		/* already have this entry, UPDATE it */
-		snprintf(cmd, sizeof(cmd),
-			 "UPDATE %s SET data = '%s' WHERE dbkey = '%s';",
-			 db->table, esc_data, esc_key);
-		r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+		params[0] = data;
+		paramlens[0] = datalen;
+		params[1] = key;
+		paramlens[1] = keylen;
+		r = sql_run(db, STMT_UPDATE, 2, params, paramlens, NULL, NULL);
 	    }
 	    else {
-		if (tid) dbengine->sql_rollback_txn(db->conn);
-		return CYRUSDB_EXISTS;
+		return write_done(db, tid, CYRUSDB_EXISTS);
 	    }
 	}
 	else if (!r && !srock.found) {
 	    /* INSERT the new entry */
-	    snprintf(cmd, sizeof(cmd),
-		     "INSERT INTO %s VALUES ('%s', '%s');",
-		     db->table, esc_key, esc_data);
-	    r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+	    params[0] = key;
+	    paramlens[0] = keylen;
+	    params[1] = data;
+	    paramlens[1] = datalen;
+	    r = sql_run(db, STMT_INSERT, 2, params, paramlens, NULL, NULL);
 	}
-
-	if (esc_data != db->esc_data) free(esc_data);
     }
 
-    if (esc_key != db->esc_key) free(esc_key);
-
     if (r) {
-	syslog(LOG_ERR, "DBERROR: SQL failed: %s", cmd);
-	if (tid) dbengine->sql_rollback_txn(db->conn);
-	return CYRUSDB_INTERNAL;
+	syslog(LOG_ERR, "DBERROR: SQL %s failed on %s",
+	       data ? "store" : "delete", db->table);
+	r = CYRUSDB_INTERNAL;
     }
 
-    return 0;
+    return write_done(db, tid, r);
 }
 
 static int create(struct db *db, 
@@ -830,23 +1241,38 @@ static int delete(struct db *db,
     return mystore(db, key, keylen, NULL, 0, tid, 1);
 }
 
-static int finish_txn(struct db *db, struct txn *tid, int commit)
+static int delete_range(struct db *db,
+			const char *prefix, int prefixlen,
+			struct txn **tid)
 {
-    if (tid) {
-	int rc = commit ? dbengine->sql_commit_txn(db->conn) :
-	    dbengine->sql_rollback_txn(db->conn);
+    const char *params[2];
+    int paramlens[2];
+    char *end;
+    int r;
 
-	if (tid->lastkey) free(tid->lastkey);
-	free(tid);
+    if ((r = write_txn(db, &tid))) return r;
 
-	if (rc) {
-	    syslog(LOG_ERR, "DBERROR: failed to %s txn on %s",
-		   commit ? "commit" : "abort", db->table);
-	    return CYRUSDB_INTERNAL;
-	}
+    params[0] = prefix;
+    paramlens[0] = prefixlen;
+    if ((end = prefix_end(prefix, prefixlen, &paramlens[1]))) {
+	params[1] = end;
+	r = sql_run(db, STMT_DELRANGE, 2, params, paramlens, NULL, NULL);
+	free(end);
+    }
+    else {
+	/* nothing sorts after the prefix but its own keys */
+	r = sql_run(db, STMT_DELTAIL, 1, params, paramlens, NULL, NULL);
     }
 
-    return 0;
+    /* the previously SELECTed key may be gone */
+    if (!r && tid && *tid) (*tid)->keylen = 0;
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: SQL delete_range failed on %s", db->table);
+	r = CYRUSDB_INTERNAL;
+    }
+
+    return write_done(db, tid, r);
 }
 
 static int commit_txn(struct db *db, struct txn *tid)
@@ -882,5 +1308,13 @@ struct cyrusdb_backend cyrusdb_sql =
     &abort_txn,
 
     NULL,
-    NULL
+    NULL,
+
+    NULL,			/* generation */
+    NULL,			/* bulk load */
+    NULL,
+    NULL,
+    NULL,
+
+    &delete_range
 };
@@ -158,6 +158,14 @@ struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_SKIPLIST_INDEX,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_SKIPLIST_COMPRESS,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
@@ -116,6 +116,10 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* in-memory index of sampled skiplist keys (OFF) */
+    CYRUSOPT_SKIPLIST_INDEX,
+    /* smallest skiplist value to store compressed (0) */
+    CYRUSOPT_SKIPLIST_COMPRESS,
 
     CYRUSOPT_LAST
     
@@ -42,6 +42,11 @@
  * $Id: prot.c,v 1.100 2010/06/28 12:06:43 brong Exp $
  */
 
+/* for splice() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <config.h>
 #include <stdio.h>
 #include <errno.h>
@@ -54,10 +59,19 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -76,6 +90,21 @@ struct protgroup
     size_t nalloced; /* Number of nodes in the group */
     size_t next_element; /* Node number of next group member */
     struct protstream **group;
+    int watched; /* made by protgroup_new_watched() */
+#ifdef HAVE_SYS_EPOLL_H
+    /* For a watched group, the first prot_select() registers the
+     * members with an epoll instance, and protgroup_insert() and
+     * protgroup_delete() keep that up to date */
+    int epfd;
+    int extra_fd; /* extra_read_fd registered with epfd */
+    struct epoll_event *events;
+    size_t nevents;
+    /* members whose buffer or timeouts may have changed */
+    struct protstream **check;
+    size_t ncheck;
+    size_t checkalloc;
+    time_t next_timeout; /* earliest timeout of any member, or 0 */
+#endif
 };
 
 /*
@@ -155,8 +184,8 @@ int prot_free(struct protstream *s)
 
 #ifdef HAVE_ZLIB
     if (s->zstrm) {
-	if (s->write) deflateEnd(s->zstrm);
-	else inflateEnd(s->zstrm);
+	if (!s->write) inflateEnd(s->zstrm);
+	else if (!s->zreleased) deflateEnd(s->zstrm);
 	free(s->zstrm);
     }
     if (s->zbuf) free(s->zbuf);
@@ -294,6 +323,15 @@ int prot_setsasl(struct protstream *s, sasl_conn_t *conn)
 
 #define ZLARGE_DIFF_CHUNK (5120) /* 5K */
 
+/* Every ZADAPT_WINDOW bytes of ordinary output, the compression level is
+ * reviewed: if it saved less than ZADAPT_MINSAVE percent we drop to the
+ * fastest level, if it cost more than ZADAPT_MAXCOST usec per KB we step
+ * down a level, and if it cost less than half that we step back up */
+#define ZADAPT_WINDOW (256 * 1024)
+#define ZADAPT_MINSAVE 10
+#define ZADAPT_MAXCOST 25
+#define ZADAPT_MAXLEVEL 6 /* what Z_DEFAULT_COMPRESSION means */
+
 /* Wrappers for our memory management functions */
 static voidpf zalloc(voidpf opaque __attribute__((unused)),
 		     uInt items, uInt size)
@@ -329,10 +367,11 @@ int prot_setcompress(struct protstream *s)
 	        goto error;
 	}
 
-	s->zlevel = Z_DEFAULT_COMPRESSION;
+	s->zlevel = s->zadaptlevel = ZADAPT_MAXLEVEL;
+	s->zstrategy = Z_DEFAULT_STRATEGY;
 	zr = deflateInit2(zstrm, s->zlevel, Z_DEFLATED,
 		          -MAX_WBITS,		/* raw deflate */
-			  MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+			  MAX_MEM_LEVEL, s->zstrategy);
     }
     else {
 	zstrm->next_in = Z_NULL;
@@ -373,6 +412,107 @@ error:
     return EOF;
 }
 
+/*
+ * Start a new compressor on an output stream whose last one was freed.
+ * The previous one always finished with a sync flush, so to the peer
+ * the new one's output is just more of the same raw deflate stream.
+ */
+static int prot_deflate_restart(struct protstream *s)
+{
+    int zr = deflateInit2(s->zstrm, s->zlevel, Z_DEFLATED,
+			  -MAX_WBITS, MAX_MEM_LEVEL, s->zstrategy);
+
+    if (zr != Z_OK) {
+	syslog(LOG_ERR, "zlib deflateInit error: %d", zr);
+	s->error = xstrdup("Error restarting compression");
+	return EOF;
+    }
+
+    s->zreleased = 0;
+    return 0;
+}
+
+/* Free the compressor of an output stream; all its output is flushed */
+static void prot_deflate_release(struct protstream *s)
+{
+    deflateEnd(s->zstrm);
+    s->zreleased = 1;
+}
+
+/* Set the compression level and strategy of an output stream */
+static int prot_deflate_params(struct protstream *s, int zlevel, int zstrategy)
+{
+    int zr;
+
+    if (zlevel == s->zlevel && zstrategy == s->zstrategy) return 0;
+
+    s->zlevel = zlevel;
+    s->zstrategy = zstrategy;
+
+    /* a new compressor will start with these anyway */
+    if (s->zreleased) return 0;
+
+    /* flush any pending data */
+    if (s->ptr != s->buf) {
+	if (prot_flush_internal(s, 1) == EOF) return EOF;
+	if (s->zreleased) return 0;
+    }
+
+    /* Set new compression level; with nothing pending, older zlibs
+     * report Z_BUF_ERROR from the flush they try first */
+    zr = deflateParams(s->zstrm, s->zlevel, s->zstrategy);
+    if (zr != Z_OK && zr != Z_BUF_ERROR) {
+	s->error = xstrdup("Error setting compression level");
+	return EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Account for 'in' bytes of ordinary data that compressed to 'out'
+ * bytes in 'usec', and review the level once we've seen enough.
+ * Called once a flush has been compressed, so nothing is pending.
+ */
+static int prot_deflate_adapt(struct protstream *s, unsigned in,
+			      unsigned out, unsigned long usec)
+{
+    unsigned long saved, cost;
+    int zlevel = s->zadaptlevel;
+    int zr;
+
+    s->zadapt_in += in;
+    s->zadapt_out += out;
+    s->zadapt_usec += usec;
+    if (s->zadapt_in < ZADAPT_WINDOW) return 0;
+
+    saved = s->zadapt_out < s->zadapt_in ?
+	100 - s->zadapt_out * 100 / s->zadapt_in : 0;
+    cost = s->zadapt_usec * 1024 / s->zadapt_in;
+
+    if (saved < ZADAPT_MINSAVE) zlevel = Z_BEST_SPEED;
+    else if (cost > ZADAPT_MAXCOST) {
+	if (zlevel > Z_BEST_SPEED) zlevel--;
+    }
+    else if (cost < ZADAPT_MAXCOST / 2 && zlevel < ZADAPT_MAXLEVEL) zlevel++;
+
+    s->zadapt_in = s->zadapt_out = s->zadapt_usec = 0;
+
+    if (zlevel == s->zadaptlevel) return 0;
+
+    syslog(LOG_DEBUG, "compression level %d -> %d (saved %lu%%, %lu usec/KB)",
+	   s->zadaptlevel, zlevel, saved, cost);
+    s->zadaptlevel = s->zlevel = zlevel;
+
+    zr = deflateParams(s->zstrm, s->zlevel, s->zstrategy);
+    if (zr != Z_OK && zr != Z_BUF_ERROR) {
+	s->error = xstrdup("Error setting compression level");
+	return EOF;
+    }
+
+    return 0;
+}
+
 /* Table of incompressible file type signatures */
 static struct file_sig {
     const char *type;
@@ -418,6 +558,37 @@ int prot_data_boundary(struct protstream *s)
     return 0;
 }
 
+/* Tell the protstream what the data is until further notice, which
+ * takes effect (like a boundary) at the next prot_write().
+ */
+int prot_data_hint(struct protstream *s, int hint)
+{
+    s->datahint = hint;
+    s->boundary = 1;
+    return 0;
+}
+
+/*
+ * While an output stream is idle, a compressor is freed after every
+ * flush and only started again when there's more to send.
+ */
+int prot_setidle(struct protstream *s, int idle)
+{
+    assert(s->write);
+
+#ifdef HAVE_ZLIB
+    s->zidle = idle;
+
+    if (idle && s->zstrm && !s->zreleased) {
+	if (s->ptr != s->buf && prot_flush_internal(s, 0) == EOF)
+	    return EOF;
+	if (!s->zreleased) prot_deflate_release(s);
+    }
+#endif /* HAVE_ZLIB */
+
+    return 0;
+}
+
 /*
  * Set the read timeout for the stream 's' to 'timeout' seconds.
  * 's' must have been created for reading.
@@ -842,6 +1013,12 @@ static int prot_flush_encode(struct protstream *s,
     if (s->zstrm) {
 	/* Compress the data */
 	int zr = Z_OK;
+	int adapt = (s->zlevel == s->zadaptlevel &&
+		     s->zstrategy == Z_DEFAULT_STRATEGY);
+	struct timeval start, end;
+
+	if (s->zreleased && prot_deflate_restart(s) == EOF) return EOF;
+	if (adapt) gettimeofday(&start, NULL);
 
 	s->zstrm->next_in = ptr;
 	s->zstrm->avail_in = left;
@@ -877,8 +1054,19 @@ static int prot_flush_encode(struct protstream *s,
 	     */
 	} while (!s->zstrm->avail_out);
 
+	if (adapt) {
+	    gettimeofday(&end, NULL);
+	    if (prot_deflate_adapt(s, left,
+				   s->zbuf_size - s->zstrm->avail_out,
+				   (end.tv_sec - start.tv_sec) * 1000000 +
+				   end.tv_usec - start.tv_usec) == EOF)
+		return EOF;
+	}
+
 	ptr = s->zbuf;
 	left = s->zbuf_size - s->zstrm->avail_out;
+
+	if (s->zidle) prot_deflate_release(s);
     }
 #endif /* HAVE_ZLIB */
 
@@ -1143,6 +1331,84 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+/*
+ * Does what's written to 's' go to its descriptor unchanged?
+ */
+static int prot_isplain(struct protstream *s)
+{
+    if (!s->write || s->writetobuf) return 0;
+    if (s->logfd != PROT_NO_FD) return 0;
+    if (s->saslssf) return 0;
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Write out what's buffered in 's' followed by the 'len' bytes at
+ * 'buf' with writev(), rather than copying 'buf' into the buffer and
+ * flushing it a piece at a time.  's' must be plain and blocking.
+ */
+static int prot_flush_writev(struct protstream *s, const char *buf,
+			     unsigned len)
+{
+    struct iovec iov[2], *v = iov;
+    int niov = 0;
+    int n;
+
+    /* anything left from nonblocking writes has to go first */
+    if (s->big_buffer != PROT_NO_FD && prot_flush_internal(s, 1) == EOF) {
+	return EOF;
+    }
+
+    if (s->dontblock_isset) {
+	nonblock(s->fd, 0);
+	s->dontblock_isset = 0;
+    }
+
+    if (s->ptr != s->buf) {
+	iov[niov].iov_base = s->buf;
+	iov[niov++].iov_len = s->ptr - s->buf;
+    }
+    iov[niov].iov_base = (char *) buf;
+    iov[niov++].iov_len = len;
+
+    while (niov) {
+	cmdtime_netstart();
+	n = writev(s->fd, v, niov);
+	cmdtime_netend();
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    s->error = xstrdup(strerror(errno));
+	    s->ptr = s->buf;
+	    s->cnt = s->maxplain;
+	    return EOF;
+	}
+
+	/* skip what was written */
+	while (niov && (unsigned) n >= v->iov_len) {
+	    n -= v->iov_len;
+	    v++;
+	    niov--;
+	}
+	if (niov) {
+	    v->iov_base = (char *) v->iov_base + n;
+	    v->iov_len -= n;
+	}
+    }
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+    s->bytes_out += len;
+
+    return 0;
+}
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -1156,33 +1422,40 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
     if (s->boundary) {
 #ifdef HAVE_ZLIB
 	if (s->zstrm) {
-	    int zr = Z_OK;
-	    int zlevel = Z_DEFAULT_COMPRESSION;
+	    int zlevel = s->zadaptlevel;
+	    int zstrategy = Z_DEFAULT_STRATEGY;
 
-	    if (is_incompressible(buf, len))
+	    switch (s->datahint) {
+	    case PROT_DATA_COMPRESSED:
+		/* send it as stored blocks */
 		zlevel = Z_NO_COMPRESSION;
+		break;
 
-	    if (zlevel != s->zlevel) {
-		s->zlevel = zlevel;
-
-		/* flush any pending data */
-		if (s->ptr != s->buf) {
-		    if (prot_flush_internal(s, 1) == EOF) return EOF;
-		}
+	    case PROT_DATA_ENCODED:
+		/* base64 has no repeats to find, but only 64 symbols */
+		zlevel = Z_BEST_SPEED;
+		zstrategy = Z_HUFFMAN_ONLY;
+		break;
 
-		/* Set new compression level */
-		zr = deflateParams(s->zstrm, s->zlevel, Z_DEFAULT_STRATEGY);
-		if (zr != Z_OK) {
-		    s->error = xstrdup("Error setting compression level");
-		    return EOF;
-		}
+	    default:
+		if (is_incompressible(buf, len))
+		    zlevel = Z_NO_COMPRESSION;
+		break;
 	    }
+
+	    if (prot_deflate_params(s, zlevel, zstrategy) == EOF) return EOF;
 	}
 #endif /* HAVE_ZLIB */
 
 	s->boundary = 0;
     }
 
+    /* big enough not to be worth copying: gather it with what's
+     * buffered and write them out together */
+    if (len >= PROT_BUFSIZE && !s->dontblock && prot_isplain(s)) {
+	return prot_flush_writev(s, buf, len);
+    }
+
     while (len >= s->cnt) {
 	/* XXX can we manage to write data from 'buf' without copying it
 	   to s->ptr ? */
@@ -1208,6 +1481,300 @@ int prot_putbuf(struct protstream *s, struct buf *buf)
     return prot_write(s, buf->s, buf->len);
 }
 
+/*
+ * Copy a short piece of a response into the output buffer, leaving
+ * anything that needs a flush or a change of layers to prot_write()
+ */
+static int prot_putmem(struct protstream *s, const char *buf, unsigned len)
+{
+    if (len >= s->cnt || s->boundary || s->error || s->eof)
+	return prot_write(s, buf, len);
+
+    memcpy(s->ptr, buf, len);
+    s->ptr += len;
+    s->cnt -= len;
+    s->bytes_out += len;
+    return 0;
+}
+
+/*
+ * Print the number 'n' in decimal
+ */
+int prot_printnum(struct protstream *s, unsigned long long n)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+
+    assert(s->write);
+
+    do {
+	*--p = '0' + (n % 10);
+	n /= 10;
+    } while (n);
+
+    return prot_putmem(s, p, buf + sizeof(buf) - p);
+}
+
+/*
+ * Print 'atom' exactly as given; the caller knows it needs no quoting
+ */
+int prot_printatom(struct protstream *s, const char *atom)
+{
+    assert(s->write);
+
+    return prot_putmem(s, atom, strlen(atom));
+}
+
+/*
+ * Can prot_sendfile() send data to 's' straight from a file?  Only when
+ * nothing needs to see or change the data on its way to the socket.
+ */
+int prot_cansendfile(struct protstream *s)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    return prot_isplain(s);
+#else
+    return 0;
+#endif /* HAVE_SENDFILE */
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes of 'fd' starting at
+ * 'offset', which are also mapped at 'base'.  If the stream allows it
+ * and it's worth it, anything buffered is flushed and the data goes
+ * from the file to the socket with sendfile(), else it's copied from
+ * 'base' like prot_write() does.
+ */
+int prot_sendfile(struct protstream *s, int fd, const char *base,
+		  off_t offset, unsigned len)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    unsigned left = len;
+    ssize_t n;
+
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+
+    if (len < PROT_SENDFILE_MIN || !prot_cansendfile(s)) {
+	return prot_write(s, base, len);
+    }
+
+    /* what's buffered goes first; this also leaves s->fd blocking */
+    if (prot_flush_internal(s, 1) == EOF) return EOF;
+    s->boundary = 0;
+
+    while (left) {
+	cmdtime_netstart();
+	n = sendfile(s->fd, fd, &offset, left);
+	cmdtime_netend();
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    if (left == len && (errno == EINVAL || errno == ENOSYS)) {
+		/* not supported for these descriptors */
+		return prot_write(s, base, len);
+	    }
+	    s->error = xstrdup(strerror(errno));
+	    return EOF;
+	}
+	if (n == 0) {
+	    /* file is shorter than the caller thought */
+	    s->error = xstrdup("short read from file");
+	    return EOF;
+	}
+
+	left -= n;
+    }
+
+    s->bytes_out += len;
+    return 0;
+#else
+    (void) fd;
+    (void) offset;
+
+    return prot_write(s, base, len);
+#endif /* HAVE_SENDFILE */
+}
+
+/*
+ * Can prot_splice() move data from 'in' to 'out' without it passing
+ * through user space?  Only when nothing on either side needs to see
+ * or change it.
+ */
+int prot_cansplice(struct protstream *in, struct protstream *out)
+{
+#ifdef HAVE_SPLICE
+    if (in->write || in->fd == PROT_NO_FD || in->fixedsize) return 0;
+    if (in->logfd != PROT_NO_FD || in->saslssf) return 0;
+#ifdef HAVE_SSL
+    if (in->tls_conn) return 0;
+#endif
+#ifdef HAVE_ZLIB
+    if (in->zstrm) return 0;
+#endif
+    return prot_isplain(out);
+#else
+    (void) in;
+    (void) out;
+
+    return 0;
+#endif /* HAVE_SPLICE */
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move 'len' bytes from the socket under 'in' to the one under 'out'
+ * through a pipe, waiting no longer than 'in' allows for each piece.
+ * Returns how much was moved before anything went wrong, or before
+ * either descriptor turned out not to support splice().
+ */
+static unsigned prot_splice_fd(struct protstream *in, struct protstream *out,
+			       unsigned len)
+{
+    int p[2];
+    unsigned moved = 0;
+    ssize_t n, w;
+    struct timeval timeout;
+    fd_set rfds;
+    int r, copy = 0;
+
+    if (pipe(p) == -1) return 0;
+
+    while (moved < len) {
+	if (in->read_timeout) {
+	    timeout.tv_sec = in->read_timeout;
+	    timeout.tv_usec = 0;
+	    FD_ZERO(&rfds);
+	    FD_SET(in->fd, &rfds);
+	    r = select(in->fd + 1, &rfds, (fd_set *)0, (fd_set *)0, &timeout);
+	    if (r == -1 && errno == EINTR && !signals_poll()) continue;
+	    if (r == 0) {
+		in->error = xstrdup("idle for too long");
+		break;
+	    }
+	    if (r == -1) {
+		in->error = xstrdup(strerror(errno));
+		break;
+	    }
+	}
+
+	n = splice(in->fd, NULL, p[1], NULL, len - moved,
+		   SPLICE_F_MOVE | SPLICE_F_MORE);
+	if (n == -1 && errno == EINTR && !signals_poll()) continue;
+	if (n == -1 && !moved && (errno == EINVAL || errno == ENOSYS)) {
+	    /* not supported for these descriptors */
+	    break;
+	}
+	if (n == 0) {
+	    in->eof = 1;
+	    break;
+	}
+	if (n == -1) {
+	    in->error = xstrdup(strerror(errno));
+	    break;
+	}
+	in->bytes_in += n;
+
+	/* the pipe must be empty again before the next read */
+	cmdtime_netstart();
+	while (n) {
+	    w = splice(p[0], NULL, out->fd, NULL, n,
+		       SPLICE_F_MOVE | (moved + n < len ? SPLICE_F_MORE : 0));
+	    if (w == -1 && errno == EINTR && !signals_poll()) continue;
+	    if (w == -1 && (errno == EINVAL || errno == ENOSYS)) {
+		/* 'out' won't take it this way: copy out what's in the
+		   pipe, and let our caller copy the rest */
+		char buf[PROT_BUFSIZE];
+
+		copy = 1;
+		while (n) {
+		    w = read(p[0], buf, n < (ssize_t) sizeof(buf) ?
+			     (size_t) n : sizeof(buf));
+		    if (w == -1 && errno == EINTR) continue;
+		    if (w <= 0) {
+			out->error = xstrdup(w ? strerror(errno) :
+					     "short read from pipe");
+			break;
+		    }
+		    if (prot_write(out, buf, w) == EOF) break;
+		    n -= w;
+		    moved += w;
+		}
+		break;
+	    }
+	    if (w <= 0) {
+		out->error = xstrdup(w ? strerror(errno) : "short write");
+		break;
+	    }
+	    n -= w;
+	    moved += w;
+	    out->bytes_out += w;
+	}
+	cmdtime_netend();
+	if (out->error || copy) break;
+    }
+
+    close(p[0]);
+    close(p[1]);
+
+    return moved;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * Copy 'len' bytes of input from 'in' to the output stream 'out', such
+ * as a literal being passed through a proxy.  Whatever 'in' has
+ * buffered goes first; if the rest is big enough and neither stream
+ * has a layer that needs to see it, it's moved socket to socket with
+ * splice(), else it's copied through the buffers.
+ */
+int prot_splice(struct protstream *in, struct protstream *out, unsigned len)
+{
+    char buf[PROT_BUFSIZE];
+    unsigned n;
+
+    assert(!in->write);
+    assert(out->write);
+
+    /* whatever's already been read goes first */
+    n = len < in->cnt ? len : in->cnt;
+    if (n) {
+	if (prot_write(out, (char *) in->ptr, n) == EOF) return EOF;
+	in->ptr += n;
+	in->cnt -= n;
+	in->can_unget += n;
+	in->bytes_in += n;
+	len -= n;
+    }
+
+#ifdef HAVE_SPLICE
+    if (len >= PROT_SENDFILE_MIN && !in->eof && !in->error &&
+	prot_cansplice(in, out)) {
+	/* the peer may be waiting on a continuation before it sends
+	   anything; this also leaves out->fd blocking */
+	if (in->flushonread) prot_flush_internal(in->flushonread, 1);
+	if (prot_flush_internal(out, 1) == EOF) return EOF;
+	out->boundary = 0;
+
+	n = prot_splice_fd(in, out, len);
+	len -= n;
+	if (n) in->can_unget = 0;
+	if (in->eof || in->error || out->error) return EOF;
+
+	/* if splice() couldn't handle these descriptors, copy the rest */
+    }
+#endif /* HAVE_SPLICE */
+
+    while (len) {
+	n = prot_read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+	if (!n) return EOF;
+	if (prot_write(out, buf, n) == EOF) return EOF;
+	len -= n;
+    }
+
+    return 0;
+}
+
 /*
  * Stripped-down version of printf() that works on protection streams
  * Only understands '%lld', '%llu', '%ld', '%lu', '%d', %u', '%s',
@@ -1227,7 +1794,7 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
     assert(s->write);
 
     while ((percent = strchr(fmt, '%')) != 0) {
-	prot_write(s, fmt, percent-fmt);
+	prot_putmem(s, fmt, percent-fmt);
 	switch (*++percent) {
 	case '%':
 	    (void)prot_putc('%', s);
@@ -1238,13 +1805,12 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 	    case 'd':
 		l = va_arg(pvar, long);
 		snprintf(buf, sizeof(buf), "%ld", l);
-		prot_write(s, buf, strlen(buf));
+		prot_putmem(s, buf, strlen(buf));
 		break;
 
 	    case 'u':
 		ul = va_arg(pvar, long);
-		snprintf(buf, sizeof(buf), "%lu", ul);
-		prot_write(s, buf, strlen(buf));
+		prot_printnum(s, ul);
 		break;
 
             case 'l': {
@@ -1255,13 +1821,12 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 		case 'd':
 		    ll = va_arg(pvar, long long int);
 		    snprintf(buf, sizeof(buf), "%lld", ll);
-		    prot_write(s, buf, strlen(buf));
+		    prot_putmem(s, buf, strlen(buf));
 		    break;
 
 		case 'u':
 		    ull = va_arg(pvar, unsigned long long int);
-		    snprintf(buf, sizeof(buf), "%llu", ull);
-		    prot_write(s, buf, strlen(buf));
+		    prot_printnum(s, ull);
 		    break;
 
 	        default:
@@ -1278,13 +1843,12 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 	case 'd':
 	    i = va_arg(pvar, int);
 	    snprintf(buf, sizeof(buf), "%d", i);
-	    prot_write(s, buf, strlen(buf));
+	    prot_putmem(s, buf, strlen(buf));
 	    break;
 
 	case 'u':
 	    u = va_arg(pvar, int);
-	    snprintf(buf, sizeof(buf), "%u", u);
-	    prot_write(s, buf, strlen(buf));
+	    prot_printnum(s, u);
 	    break;
 
 	case 't': {
@@ -1294,14 +1858,13 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 	    switch (*++percent) {
 	    case 'u':
 		tu = va_arg(pvar, size_t);
-		snprintf(buf, sizeof(buf), "%tu", tu);
-		prot_write(s, buf, strlen(buf));
+		prot_printnum(s, tu);
 		break;
 
 	    case 'd':
 		td = va_arg(pvar, ssize_t);
 		snprintf(buf, sizeof(buf), "%td", td);
-		prot_write(s, buf, strlen(buf));
+		prot_putmem(s, buf, strlen(buf));
 		break;
 
 	    default:
@@ -1312,7 +1875,7 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 
 	case 's':
 	    p = va_arg(pvar, char *);
-	    prot_write(s, p, strlen(p));
+	    prot_putmem(s, p, strlen(p));
 	    break;
 
 	case 'c':
@@ -1325,7 +1888,7 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 	}
 	fmt = percent+1;
     }
-    prot_write(s, fmt, strlen(fmt));
+    prot_putmem(s, fmt, strlen(fmt));
     va_end(pvar);
     if (s->error || s->eof) return EOF;
     return 0;
@@ -1333,12 +1896,9 @@ int prot_printf(struct protstream *s, const char *fmt, ...)
 
 int prot_printliteral(struct protstream *out, const char *s, size_t size)
 {
-    int r;
-    if (out->isclient)
-	r = prot_printf(out, "{" SIZE_T_FMT "+}\r\n", size);
-    else
-	r = prot_printf(out, "{" SIZE_T_FMT "}\r\n", size);
-    if (r) return r;
+    prot_putc('{', out);
+    prot_printnum(out, size);
+    if (prot_printatom(out, out->isclient ? "+}\r\n" : "}\r\n")) return EOF;
     return prot_write(out, s, size);
 }
 
@@ -1350,7 +1910,7 @@ int prot_printstring(struct protstream *out, const char *s)
     const char *p;
     int len = 0;
 
-    if (!s) return prot_printf(out, "NIL");
+    if (!s) return prot_printatom(out, "NIL");
 
     /* Look for any non-QCHAR characters */
     for (p = s; *p && len < 1024; p++) {
@@ -1364,7 +1924,9 @@ int prot_printstring(struct protstream *out, const char *s)
 	return prot_printliteral(out, s, strlen(s));
     }
 
-    return prot_printf(out, "\"%s\"", s);
+    prot_putc('"', out);
+    prot_putmem(out, s, len);
+    return prot_putmem(out, "\"", 1);
 }
 
 /*
@@ -1372,11 +1934,11 @@ int prot_printstring(struct protstream *out, const char *s)
  */
 int prot_printastring(struct protstream *out, const char *s)
 {
-    if (!s) return prot_printf(out, "NIL");
+    if (!s) return prot_printatom(out, "NIL");
 
     /* special cases for atoms */
-    if (!*s) return prot_printf(out, "\"\"");
-    if (imparse_isatom(s)) return prot_printf(out, "%s", s);
+    if (!*s) return prot_printatom(out, "\"\"");
+    if (imparse_isatom(s)) return prot_printatom(out, s);
 
     /* not an atom, so pass to printstring */
     return prot_printstring(out, s);
@@ -1418,6 +1980,220 @@ int prot_read(struct protstream *s, char *buf, unsigned size)
  *
  * Only works for readable protstreams
  */ 
+#ifdef HAVE_SYS_EPOLL_H
+/* Register 'fd' with the group's epoll instance, with 's' (NULL for
+ * the extra_read_fd) as the data returned when it's readable.  This
+ * is level-triggered: protstreams don't read until EAGAIN, so input
+ * left in the kernel after a command must still wake us up. */
+static int protgroup_watchfd(struct protgroup *group, int fd,
+			     struct protstream *s)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+
+    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	/* another protstream on the same descriptor */
+	if (errno != EEXIST ||
+	    epoll_ctl(group->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static void protgroup_unwatch(struct protgroup *group)
+{
+    if (group->epfd != -1) {
+	close(group->epfd);
+	group->epfd = -1;
+	group->extra_fd = PROT_NO_FD;
+    }
+    group->ncheck = 0;
+    group->next_timeout = 0;
+}
+
+/* Have the next prot_select() look at 's' again */
+static void protgroup_check(struct protgroup *group, struct protstream *s)
+{
+    if (group->ncheck == group->checkalloc) {
+	group->checkalloc = group->checkalloc ? 2 * group->checkalloc
+					      : PROTGROUP_SIZE_DEFAULT;
+	group->check = xrealloc(group->check,
+				group->checkalloc * sizeof(struct protstream *));
+    }
+    group->check[group->ncheck++] = s;
+}
+
+/* Make sure the group's epoll instance is set up, with the members and
+ * 'extra_read_fd' registered.  Returns -1 if we should use select()
+ * instead. */
+static int protgroup_watch(struct protgroup *group, int extra_read_fd)
+{
+    unsigned i;
+
+    if (group->epfd == -1) {
+	group->epfd = epoll_create(group->nalloced + 1);
+	if (group->epfd == -1) return -1;
+	(void) fcntl(group->epfd, F_SETFD, FD_CLOEXEC);
+
+	for (i = 0; i < group->next_element; i++) {
+	    if (!group->group[i]) continue;
+	    if (protgroup_watchfd(group, group->group[i]->fd,
+				  group->group[i]) == -1) {
+		protgroup_unwatch(group);
+		return -1;
+	    }
+	    protgroup_check(group, group->group[i]);
+	}
+    }
+
+    if (extra_read_fd != group->extra_fd) {
+	if (group->extra_fd != PROT_NO_FD) {
+	    (void) epoll_ctl(group->epfd, EPOLL_CTL_DEL, group->extra_fd, NULL);
+	    group->extra_fd = PROT_NO_FD;
+	}
+	if (extra_read_fd != PROT_NO_FD) {
+	    if (protgroup_watchfd(group, extra_read_fd, NULL) == -1) {
+		protgroup_unwatch(group);
+		return -1;
+	    }
+	    group->extra_fd = extra_read_fd;
+	}
+    }
+
+    if (group->nevents < group->next_element + 1) {
+	group->nevents = group->nalloced + 1;
+	group->events = xrealloc(group->events,
+				 group->nevents * sizeof(struct epoll_event));
+    }
+
+    return 0;
+}
+
+/* When prot_select() has to wake up for 's' (a read timeout or a wait
+ * event), or 0 */
+static time_t prot_nexttimeout(struct protstream *s)
+{
+    struct prot_waitevent *event;
+    time_t mark = 0;
+
+    if (s->dontblock) return 0;
+
+    for (event = s->waitevent; event; event = event->next) {
+	if (!mark || event->mark < mark) mark = event->mark;
+    }
+    if (s->read_timeout && (!mark || s->timeout_mark < mark)) {
+	mark = s->timeout_mark;
+    }
+
+    return mark;
+}
+
+/* Note the next timeout of 's', and add it to 'retval' if it already
+ * has input for us or its timeout is due */
+static void protgroup_examine(struct protgroup *group, struct protstream *s,
+			      time_t now, struct protgroup **retval)
+{
+    time_t mark = prot_nexttimeout(s);
+
+    if (mark && (!group->next_timeout || mark < group->next_timeout)) {
+	group->next_timeout = mark;
+    }
+
+    if (s->cnt > 0 || (mark && mark <= now)
+#ifdef HAVE_SSL
+	|| (s->tls_conn != NULL && SSL_pending(s->tls_conn))
+#endif
+	) {
+	if (!*retval) *retval = protgroup_new(0);
+	protgroup_insert(*retval, s);
+    }
+}
+
+/* prot_select() for a watched group.  Rather than every member, we only
+ * look at those which were inserted or returned since the last call,
+ * and the kernel tells us which others are readable.  Every member is
+ * looked at again once the earliest timeout we know of is due. */
+static int prot_select_watched(struct protgroup *group,
+			       struct protgroup **out, int *extra_read_flag,
+			       struct timeval *timeout)
+{
+    struct protgroup *retval = NULL;
+    struct protstream *s;
+    time_t now = time(NULL);
+    size_t i, ncheck;
+    int found_fds = 0, n, ms;
+
+    if (extra_read_flag) *extra_read_flag = 0;
+
+    if (group->next_timeout && group->next_timeout <= now) {
+	/* someone's timeout is due, but the one we noted may have
+	 * changed since; look at them all */
+	group->ncheck = 0;
+	for (i = 0; i < group->next_element; i++) {
+	    if (group->group[i]) protgroup_check(group, group->group[i]);
+	}
+	group->next_timeout = 0;
+    }
+
+    ncheck = group->ncheck;
+    group->ncheck = 0;
+    for (i = 0; i < ncheck; i++) {
+	protgroup_examine(group, group->check[i], now, &retval);
+    }
+
+    if (!retval) {
+	ms = -1;
+	if (group->next_timeout) {
+	    ms = (group->next_timeout - now) * 1000;
+	}
+	if (timeout &&
+	    (ms == -1 || timeout->tv_sec * 1000 + timeout->tv_usec / 1000 < ms)) {
+	    ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+	}
+
+	n = epoll_wait(group->epfd, group->events, group->nevents, ms);
+	if (n == -1) return -1;
+
+	for (i = 0; i < (unsigned) n; i++) {
+	    s = group->events[i].data.ptr;
+	    if (!s) {
+		*extra_read_flag = 1;
+		found_fds++;
+		continue;
+	    }
+
+	    if (!retval) retval = protgroup_new(n + 1);
+	    protgroup_insert(retval, s);
+	}
+
+	now = time(NULL);
+	if (group->next_timeout && group->next_timeout <= now) {
+	    /* woke up for a timeout */
+	    group->next_timeout = 0;
+	    for (i = 0; i < group->next_element; i++) {
+		if (group->group[i]) {
+		    protgroup_examine(group, group->group[i], now, &retval);
+		}
+	    }
+	}
+    }
+
+    /* the caller is about to read these */
+    for (i = 0; retval && i < retval->next_element; i++) {
+	protgroup_check(group, retval->group[i]);
+	found_fds++;
+    }
+
+    *out = retval;
+    return found_fds;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 int prot_select(struct protgroup *readstreams, int extra_read_fd,
 		struct protgroup **out, int *extra_read_flag,
 		struct timeval *timeout) 
@@ -1442,6 +2218,13 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
     found_fds = 0;
     FD_ZERO(&rfds);
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (readstreams && readstreams->watched &&
+	protgroup_watch(readstreams, extra_read_fd) == 0) {
+	return prot_select_watched(readstreams, out, extra_read_flag, timeout);
+    }
+#endif
+
     /* If extra_read_fd is PROT_NO_FD, then the first protstream
      * will override it */
     max_fd = extra_read_fd;
@@ -1607,6 +2390,25 @@ struct protgroup *protgroup_new(size_t size)
     ret->nalloced = size;
     ret->next_element = 0;
     ret->group = xzmalloc(size * sizeof(struct protstream *));
+    ret->watched = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    ret->epfd = -1;
+    ret->extra_fd = PROT_NO_FD;
+    ret->events = NULL;
+    ret->nevents = 0;
+    ret->check = NULL;
+    ret->ncheck = ret->checkalloc = 0;
+    ret->next_timeout = 0;
+#endif
+
+    return ret;
+}
+
+struct protgroup *protgroup_new_watched(size_t size)
+{
+    struct protgroup *ret = protgroup_new(size);
+
+    ret->watched = 1;
 
     return ret;
 }
@@ -1629,6 +2431,9 @@ void protgroup_reset(struct protgroup *group)
 	memset(group->group, 0,
 	       group->nalloced * sizeof(struct protstream *));
 	group->next_element = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	protgroup_unwatch(group);
+#endif
     }
 }
 
@@ -1637,6 +2442,11 @@ void protgroup_free(struct protgroup *group)
     if(group) {
 	assert(group->group);
 	free(group->group);
+#ifdef HAVE_SYS_EPOLL_H
+	protgroup_unwatch(group);
+	if (group->events) free(group->events);
+	if (group->check) free(group->check);
+#endif
 	free(group);
     }
 }
@@ -1651,7 +2461,12 @@ void protgroup_insert(struct protgroup *group, struct protstream *item)
     /* See if we already have this protstream */
     for (i = 0, empty = group->next_element; i < group->next_element; i++) {
 	if (!group->group[i]) empty = i;
-	else if (group->group[i] == item) return;
+	else if (group->group[i] == item) {
+#ifdef HAVE_SYS_EPOLL_H
+	    if (group->epfd != -1) protgroup_check(group, item);
+#endif
+	    return;
+	}
     }
     /* Double size of the protgroup if we're at our limit */ 
     if (empty == group->next_element &&
@@ -1662,6 +2477,16 @@ void protgroup_insert(struct protgroup *group, struct protstream *item)
     }
     /* Insert the item at the empty location */
     group->group[empty] = item;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (group->epfd != -1) {
+	if (protgroup_watchfd(group, item->fd, item) == -1) {
+	    /* next prot_select() starts over */
+	    protgroup_unwatch(group);
+	}
+	else protgroup_check(group, item);
+    }
+#endif
 }
 
 void protgroup_delete(struct protgroup *group, struct protstream *item) 
@@ -1674,6 +2499,21 @@ void protgroup_delete(struct protgroup *group, struct protstream *item)
     /* find the protstream */
     for (i = 0; i < group->next_element; i++) {
 	if (group->group[i] == item) {
+#ifdef HAVE_SYS_EPOLL_H
+	    if (group->epfd != -1) {
+		unsigned j, k;
+
+		/* may already be gone if the descriptor was closed */
+		(void) epoll_ctl(group->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+
+		for (j = k = 0; j < group->ncheck; j++) {
+		    if (group->check[j] != item) {
+			group->check[k++] = group->check[j];
+		    }
+		}
+		group->ncheck = k;
+	    }
+#endif
 	    /* slide all remaining elements down one slot */
 	    group->next_element--;
 	    for (; i < group->next_element; i++) {
@@ -102,6 +102,14 @@ struct protstream {
     /* Compress parameters */
     int zlevel;
     int zflush;
+    int zstrategy;
+    int zidle;		/* free the compressor after each flush */
+    int zreleased;	/* compressor freed, start a new one before use */
+    /* Level for ordinary data, adjusted by what it achieves and costs */
+    int zadaptlevel;
+    unsigned long zadapt_in;
+    unsigned long zadapt_out;
+    unsigned long zadapt_usec;
 #endif /* HAVE_ZLIB */
 
     /* Big Buffer Information */
@@ -113,6 +121,7 @@ struct protstream {
     /* Status Flags */
     int eof;
     int boundary; /* Type of data is about to change */
+    int datahint; /* What the data is known to be (PROT_DATA_*) */
     int fixedsize;
     char *error;
 
@@ -217,9 +226,20 @@ int prot_setisclient(struct protstream *s, int val);
 int prot_setcompress(struct protstream *s);
 #endif /* HAVE_ZLIB */
 
+/* Tell an output protstream that it's about to sit idle for a while
+ * (or is no longer idle), so it can free what it can recreate */
+int prot_setidle(struct protstream *s, int idle);
+
 /* Tell the protstream that the type of data is about to change. */
 int prot_data_boundary(struct protstream *s);
 
+/* Tell the protstream what the data written from now on is known to
+ * be, until told PROT_DATA_UNKNOWN again */
+#define PROT_DATA_UNKNOWN	0
+#define PROT_DATA_COMPRESSED	1	/* e.g. a JPEG or a ZIP file */
+#define PROT_DATA_ENCODED	2	/* the same, but base64 encoded */
+int prot_data_hint(struct protstream *s, int hint);
+
 /* Set a timeout for the connection (in seconds) */
 extern int prot_settimeout(struct protstream *s, int timeout);
 
@@ -253,12 +273,29 @@ extern int prot_flush(struct protstream *s);
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
+
+/* Write a region of a file which is also mapped at 'base', straight
+ * from the file if the stream has no SASL, TLS, compression or
+ * telemetry layer, and the region is at least PROT_SENDFILE_MIN bytes */
+#define PROT_SENDFILE_MIN (16 * PROT_BUFSIZE)
+extern int prot_cansendfile(struct protstream *s);
+extern int prot_sendfile(struct protstream *s, int fd, const char *base,
+			 off_t offset, unsigned len);
+/* Copy 'len' bytes from an input stream to an output stream, socket
+ * to socket with splice() when neither has a layer in the way */
+extern int prot_cansplice(struct protstream *in, struct protstream *out);
+extern int prot_splice(struct protstream *in, struct protstream *out,
+		       unsigned len);
 extern int prot_printf(struct protstream *, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
 #else
     ;
 #endif
+/* Pieces of a response, written straight into the output buffer
+ * without going through prot_printf()'s format parsing */
+extern int prot_printnum(struct protstream *s, unsigned long long n);
+extern int prot_printatom(struct protstream *s, const char *atom);
 extern int prot_printliteral(struct protstream *out, const char *s,
 			     size_t size);
 extern int prot_printstring(struct protstream *out, const char *s);
@@ -277,6 +314,15 @@ extern int prot_select(struct protgroup *readstreams, int extra_read_fd,
 struct protgroup *protgroup_new(size_t size);
 struct protgroup *protgroup_copy(struct protgroup *src);
 
+/* Create a protgroup for waiting on many protstreams, each of which is
+ * only read after prot_select() returns it.  Where epoll is available,
+ * prot_select() keeps the members registered with the kernel between
+ * calls, and only looks at the buffers and timeouts of the members it
+ * returned last time and those inserted since.  So a member that's read,
+ * or whose timeout or wait events change, any other way must be
+ * protgroup_insert()ed again. */
+struct protgroup *protgroup_new_watched(size_t size);
+
 /* Cleanup a protgroup but don't release the allocated memory (so it can
  * be reused) */
 void protgroup_reset(struct protgroup *group);
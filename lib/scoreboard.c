@@ -0,0 +1,352 @@
+/* scoreboard.c -- per-child state shared with master and cyr_info
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "libconfig.h"
+#include "scoreboard.h"
+#include "xstrlcpy.h"
+
+#define SCOREBOARD_MAGIC "Cyrus scoreboard"
+
+struct scoreboard_header {
+    char magic[20];
+    unsigned nslots;
+    unsigned slotsize;
+    time_t created;		/* when master started */
+};
+
+static char *sb_base = NULL;
+static size_t sb_size = 0;
+static struct scoreboard_slot *sb_self = NULL;
+
+#define SB_HEADER ((struct scoreboard_header *) sb_base)
+#define SB_SLOT(n) ((struct scoreboard_slot *) \
+		    (sb_base + sizeof(struct scoreboard_header)) + (n))
+
+static const char *scoreboard_fname(void)
+{
+    static char fname[PATH_MAX];
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, FNAME_SCOREBOARD);
+    return fname;
+}
+
+/*
+ * A slot is only ever written by the process holding it (or by master,
+ * once that process is gone), so writers just bump the sequence number
+ * around their stores.  Readers copy the slot and try again if the
+ * sequence number was odd or changed under them.  A process claiming
+ * a slot holds it under its negated pid until it has filled it in, so
+ * nobody takes the previous owner's details for the new one's.
+ */
+static void sb_begin(struct scoreboard_slot *s)
+{
+    s->seq++;
+    __sync_synchronize();
+}
+
+static void sb_end(struct scoreboard_slot *s)
+{
+    __sync_synchronize();
+    s->seq++;
+}
+
+int scoreboard_create(unsigned nslots)
+{
+    const char *fname = scoreboard_fname();
+    struct scoreboard_header *hdr;
+    int fd;
+
+    scoreboard_detach();
+    sb_size = sizeof(struct scoreboard_header) +
+	nslots * sizeof(struct scoreboard_slot);
+
+    /* a new file, so any processes of an earlier master keep theirs */
+    unlink(fname);
+    fd = open(fname, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+	return -1;
+    }
+    if (ftruncate(fd, sb_size) == -1) {
+	syslog(LOG_ERR, "IOERROR: sizing %s: %m", fname);
+	close(fd);
+	unlink(fname);
+	return -1;
+    }
+
+    sb_base = mmap(NULL, sb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sb_base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+	sb_base = NULL;
+	unlink(fname);
+	return -1;
+    }
+
+    /* the file is all zeroes, ie all slots are free */
+    hdr = SB_HEADER;
+    hdr->nslots = nslots;
+    hdr->slotsize = sizeof(struct scoreboard_slot);
+    hdr->created = time(NULL);
+    __sync_synchronize();
+    memcpy(hdr->magic, SCOREBOARD_MAGIC, sizeof(SCOREBOARD_MAGIC));
+
+    return 0;
+}
+
+int scoreboard_attach(int rw)
+{
+    const char *fname = scoreboard_fname();
+    struct scoreboard_header *hdr;
+    struct stat sbuf;
+    int fd;
+
+    scoreboard_detach();
+
+    /* no scoreboard is fine, master just wasn't asked for one */
+    fd = open(fname, rw ? O_RDWR : O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &sbuf) == -1 ||
+	(size_t) sbuf.st_size < sizeof(struct scoreboard_header)) {
+	close(fd);
+	return -1;
+    }
+
+    sb_size = sbuf.st_size;
+    sb_base = mmap(NULL, sb_size, rw ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+    close(fd);
+    if (sb_base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+	sb_base = NULL;
+	return -1;
+    }
+
+    hdr = SB_HEADER;
+    if (memcmp(hdr->magic, SCOREBOARD_MAGIC, sizeof(SCOREBOARD_MAGIC)) ||
+	hdr->slotsize != sizeof(struct scoreboard_slot) ||
+	sb_size != sizeof(struct scoreboard_header) +
+		   hdr->nslots * sizeof(struct scoreboard_slot)) {
+	syslog(LOG_ERR, "%s is not a scoreboard we understand", fname);
+	scoreboard_detach();
+	return -1;
+    }
+
+    return 0;
+}
+
+void scoreboard_detach(void)
+{
+    if (!sb_base) return;
+
+    munmap(sb_base, sb_size);
+    sb_base = NULL;
+    sb_size = 0;
+    sb_self = NULL;
+}
+
+int scoreboard_claim(const char *service)
+{
+    struct scoreboard_slot *s;
+    unsigned n, i;
+    pid_t pid, old;
+    int pass;
+
+    if (!sb_base) return -1;
+    if (sb_self) return 0;
+
+    pid = getpid();
+    n = SB_HEADER->nslots;
+
+    /* look for a free slot first, then for one whose process is gone
+     * without master noticing */
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < n; i++) {
+	    s = SB_SLOT((pid + i) % n);
+	    old = s->pid;
+	    if (old && (!pass || kill(old < 0 ? -old : old, 0) == 0 ||
+			errno != ESRCH))
+		continue;
+	    if (__sync_bool_compare_and_swap(&s->pid, old, -pid))
+		goto claimed;
+	}
+    }
+
+    syslog(LOG_WARNING, "scoreboard is full, not tracking %s process %d",
+	   service, (int) pid);
+    return -1;
+
+ claimed:
+    sb_begin(s);
+    s->state = SCOREBOARD_READY;
+    s->started = s->since = time(NULL);
+    s->cmdtime = 0;
+    s->bytes_in = s->bytes_out = 0;
+    strlcpy(s->service, service, sizeof(s->service));
+    s->client[0] = s->user[0] = s->mailbox[0] = s->command[0] = '\0';
+    sb_end(s);
+    s->pid = pid;
+
+    sb_self = s;
+    return 0;
+}
+
+void scoreboard_release(pid_t pid)
+{
+    struct scoreboard_slot *s;
+    unsigned n, i;
+    pid_t old;
+
+    if (!sb_base || pid <= 0) return;
+
+    n = SB_HEADER->nslots;
+    for (i = 0; i < n; i++) {
+	s = SB_SLOT((pid + i) % n);
+	old = s->pid;
+	if (old != pid && old != -pid) continue;
+
+	/* a slot with no pid is free whatever else it says, so clearing
+	 * the pid is all it takes.  if that fails, another process has
+	 * just taken the slot over, and the rest of it is now theirs */
+	(void) __sync_bool_compare_and_swap(&s->pid, old, 0);
+	return;
+    }
+}
+
+static void scoreboard_state(int state)
+{
+    struct scoreboard_slot *s = sb_self;
+
+    sb_begin(s);
+    s->state = state;
+    s->since = time(NULL);
+    s->cmdtime = 0;
+    s->bytes_in = s->bytes_out = 0;
+    s->client[0] = s->user[0] = s->mailbox[0] = s->command[0] = '\0';
+    sb_end(s);
+}
+
+void scoreboard_ready(void)
+{
+    if (sb_self) scoreboard_state(SCOREBOARD_READY);
+}
+
+void scoreboard_busy(void)
+{
+    if (sb_self) scoreboard_state(SCOREBOARD_BUSY);
+}
+
+void scoreboard_session(const char *client, const char *user,
+			const char *mailbox)
+{
+    struct scoreboard_slot *s = sb_self;
+
+    if (!s) return;
+
+    sb_begin(s);
+    strlcpy(s->client, client ? client : "", sizeof(s->client));
+    strlcpy(s->user, user ? user : "", sizeof(s->user));
+    strlcpy(s->mailbox, mailbox ? mailbox : "", sizeof(s->mailbox));
+    sb_end(s);
+}
+
+void scoreboard_command(const char *cmd,
+			unsigned long bytes_in, unsigned long bytes_out)
+{
+    struct scoreboard_slot *s = sb_self;
+
+    if (!s) return;
+
+    sb_begin(s);
+    strlcpy(s->command, cmd, sizeof(s->command));
+    s->cmdtime = time(NULL);
+    s->bytes_in = bytes_in;
+    s->bytes_out = bytes_out;
+    sb_end(s);
+}
+
+unsigned scoreboard_nslots(void)
+{
+    return sb_base ? SB_HEADER->nslots : 0;
+}
+
+int scoreboard_read(unsigned n, struct scoreboard_slot *copy)
+{
+    const struct scoreboard_slot *s;
+    unsigned seq;
+    int tries;
+
+    if (n >= scoreboard_nslots()) return -1;
+
+    s = SB_SLOT(n);
+    for (tries = 0; tries < 100; tries++) {
+	__sync_synchronize();
+	seq = s->seq;
+	if (seq & 1) continue;
+
+	__sync_synchronize();
+	memcpy(copy, s, sizeof(struct scoreboard_slot));
+	__sync_synchronize();
+	if (s->seq != seq) continue;
+
+	return (copy->pid > 0 && copy->state != SCOREBOARD_FREE) ? 0 : -1;
+    }
+
+    return -1;
+}
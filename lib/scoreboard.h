@@ -0,0 +1,107 @@
+/* scoreboard.h -- per-child state shared with master and cyr_info
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_SCOREBOARD_H
+#define INCLUDED_SCOREBOARD_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * The scoreboard is a file in the configuration directory, created by
+ * master and mapped shared by every service process.  Each process
+ * claims a slot and keeps what it's doing there up to date with plain
+ * stores, so anyone mapping the file (cyr_info top) can watch the
+ * whole server without asking anybody.
+ */
+#define FNAME_SCOREBOARD "/scoreboard.shm"
+
+enum {
+    SCOREBOARD_FREE = 0,
+    SCOREBOARD_READY,		/* waiting for a connection */
+    SCOREBOARD_BUSY		/* serving a connection */
+};
+
+struct scoreboard_slot {
+    pid_t pid;			/* 0 if free, -pid while being claimed */
+    unsigned seq;		/* odd while the slot is being updated */
+    int state;
+    time_t started;		/* when the process claimed the slot */
+    time_t since;		/* when the current state was entered */
+    time_t cmdtime;		/* when the current command started */
+    unsigned long bytes_in;	/* on the current connection */
+    unsigned long bytes_out;
+    char service[32];
+    char client[80];
+    char user[64];
+    char mailbox[128];
+    char command[16];
+};
+
+/* master: make a new, empty scoreboard with room for 'nslots' processes */
+extern int scoreboard_create(unsigned nslots);
+
+/* map the existing scoreboard; only services should ask for 'rw' */
+extern int scoreboard_attach(int rw);
+extern void scoreboard_detach(void);
+
+/* service: claim a slot for this process, for 'service' */
+extern int scoreboard_claim(const char *service);
+
+/* master: free whatever slot 'pid' held, once it has exited */
+extern void scoreboard_release(pid_t pid);
+
+/* service: report on our own slot; these do nothing without one */
+extern void scoreboard_ready(void);
+extern void scoreboard_busy(void);
+extern void scoreboard_session(const char *client, const char *user,
+			       const char *mailbox);
+extern void scoreboard_command(const char *cmd,
+			       unsigned long bytes_in, unsigned long bytes_out);
+
+/* readers: the number of slots, and a consistent copy of slot 'n';
+ * returns 0 if it's in use, -1 if it's free or wouldn't hold still */
+extern unsigned scoreboard_nslots(void);
+extern int scoreboard_read(unsigned n, struct scoreboard_slot *copy);
+
+#endif /* INCLUDED_SCOREBOARD_H */
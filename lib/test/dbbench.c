@@ -0,0 +1,688 @@
+/* dbbench: concurrent benchmark for the cyrusdb backends
+ *
+ * Loads a database, then runs a mix of fetch/foreach/store operations
+ * against it from several processes at once, and reports throughput
+ * and latency percentiles for fetch, foreach, store and commit.
+ *
+ * Keys look like mailbox names ("user.uNNNNNN.fNNNN"), and foreach
+ * walks one user's folders the way LIST does.  Alternatively the keys
+ * and values can be taken from a dump of a real database (as written
+ * by "cyr_dbtool ... show" or "ctl_mboxlist -d").
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../cyrusdb.h"
+#include "../libcyr_cfg.h"
+#include "../util.h"
+#include "../xmalloc.h"
+#include "../exitcodes.h"
+
+enum {
+    OP_FETCH = 0,
+    OP_FOREACH,
+    OP_STORE,
+    OP_COMMIT,
+    NUM_OPS
+};
+
+static const char *opnames[NUM_OPS] = { "fetch", "foreach", "store", "commit" };
+
+enum {
+    DIST_UNIFORM = 0,
+    DIST_ZIPF,
+    DIST_SEQ
+};
+
+/* workload settings */
+static const char *dir = "dbbench.tmp";
+static unsigned nrecords = 10000;
+static unsigned nops = 10000;
+static unsigned nprocs = 1;
+static unsigned folders = 20;		/* synthetic folders per user */
+static int dist = DIST_UNIFORM;
+static double theta = 0.99;
+static unsigned minval = 10, maxval = 100;
+static unsigned pct_fetch = 80, pct_foreach = 5;	/* rest is store */
+static unsigned txnsize = 1;
+static unsigned seed = 1;
+static const char *sqlengine = "sqlite";
+static int keepfiles = 0;
+static int quotavals = 0;		/* values must look like quotas */
+
+/* keys (and values, if loaded from a file) */
+static char **keys = NULL;
+static char **vals = NULL;
+static unsigned *perm = NULL;		/* rank -> key, for zipf */
+static double *zipfcdf = NULL;
+
+/* per-process results */
+struct latencies {
+    unsigned count;
+    unsigned alloc;
+    unsigned *usec;
+};
+
+static struct latencies lat[NUM_OPS];
+
+void fatal(const char *msg, int code)
+{
+    fprintf(stderr, "dbbench: fatal: %s\n", msg);
+    exit(code);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "usage: dbbench [-b backend]... [-d dir] [-n records] [-o ops]\n"
+	    "               [-p procs] [-k uniform|zipf|seq] [-z theta]\n"
+	    "               [-u folders] [-l min:max] [-r fetch%%]\n"
+	    "               [-f foreach%%] [-t stores/txn] [-i dumpfile]\n"
+	    "               [-S sqlengine] [-s seed] [-K]\n");
+    exit(EC_USAGE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void record(int op, double start)
+{
+    struct latencies *l = &lat[op];
+    double usec = (now() - start) * 1000000.0;
+
+    if (l->count == l->alloc) {
+	l->alloc = l->alloc ? 2 * l->alloc : 1024;
+	l->usec = xrealloc(l->usec, l->alloc * sizeof(unsigned));
+    }
+    l->usec[l->count++] = usec < 0 ? 0 : (unsigned) usec;
+}
+
+static void genkeys(void)
+{
+    unsigned i;
+
+    keys = xmalloc(nrecords * sizeof(char *));
+    for (i = 0; i < nrecords; i++) {
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "user.u%06u.f%04u",
+		 i / folders, i % folders);
+	keys[i] = xstrdup(buf);
+    }
+}
+
+static void loadkeys(const char *fname)
+{
+    struct buf line = BUF_INITIALIZER;
+    unsigned alloc = 0;
+    FILE *f;
+
+    f = fopen(fname, "r");
+    if (!f) {
+	perror(fname);
+	exit(EC_NOINPUT);
+    }
+
+    nrecords = 0;
+    while (buf_getline(&line, f)) {
+	const char *str = buf_cstring(&line);
+	const char *tab = strchr(str, '\t');
+
+	if (!line.len || str[0] == '#' || tab == str) continue;
+
+	if (nrecords == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    keys = xrealloc(keys, alloc * sizeof(char *));
+	    vals = xrealloc(vals, alloc * sizeof(char *));
+	}
+	if (tab) {
+	    keys[nrecords] = xstrndup(str, tab - str);
+	    vals[nrecords] = xstrdup(tab + 1);
+	} else {
+	    keys[nrecords] = xstrdup(str);
+	    vals[nrecords] = xstrdup("");
+	}
+	nrecords++;
+    }
+
+    fclose(f);
+    buf_free(&line);
+
+    if (!nrecords) fatal("no records in input file", EC_DATAERR);
+}
+
+static void setupzipf(void)
+{
+    double sum = 0;
+    unsigned i;
+
+    zipfcdf = xmalloc(nrecords * sizeof(double));
+    for (i = 0; i < nrecords; i++) {
+	sum += 1.0 / pow(i + 1, theta);
+	zipfcdf[i] = sum;
+    }
+    for (i = 0; i < nrecords; i++) zipfcdf[i] /= sum;
+
+    /* spread the hot keys over the keyspace */
+    perm = xmalloc(nrecords * sizeof(unsigned));
+    for (i = 0; i < nrecords; i++) perm[i] = i;
+    for (i = nrecords - 1; i > 0; i--) {
+	unsigned j = random() % (i + 1);
+	unsigned t = perm[i];
+
+	perm[i] = perm[j];
+	perm[j] = t;
+    }
+}
+
+static unsigned pickkey(unsigned *seq)
+{
+    double u;
+    unsigned lo, hi;
+
+    switch (dist) {
+    case DIST_SEQ:
+	return (*seq)++ % nrecords;
+
+    case DIST_ZIPF:
+	u = (double) random() / RAND_MAX;
+	lo = 0;
+	hi = nrecords - 1;
+	while (lo < hi) {
+	    unsigned mid = (lo + hi) / 2;
+	    if (zipfcdf[mid] < u) lo = mid + 1;
+	    else hi = mid;
+	}
+	return perm[lo];
+
+    default:
+	return random() % nrecords;
+    }
+}
+
+/* the prefix foreach uses for 'key': everything up to and including
+ * its second separator, i.e. the user's part of a mailbox name */
+static int prefixlen(const char *key)
+{
+    const char *p = strchr(key, '.');
+
+    if (p) p = strchr(p + 1, '.');
+    return p ? (p - key) + 1 : (int) strlen(key);
+}
+
+static void genval(char *buf)
+{
+    unsigned len = minval;
+    unsigned i;
+
+    if (quotavals) {
+	/* quotalegacy only stores "used limit" */
+	sprintf(buf, "%ld %ld", random(), random() % 1000000);
+	return;
+    }
+
+    if (maxval > minval) len += random() % (maxval - minval + 1);
+    for (i = 0; i < len; i++) buf[i] = 'a' + (random() % 26);
+    buf[len] = '\0';
+}
+
+static int count_cb(void *rock,
+		    const char *key __attribute__((unused)),
+		    int keylen __attribute__((unused)),
+		    const char *data __attribute__((unused)),
+		    int datalen __attribute__((unused)))
+{
+    (*(unsigned *) rock)++;
+    return 0;
+}
+
+static void check(int r, const char *what, struct cyrusdb_backend *db)
+{
+    if (r && r != CYRUSDB_NOTFOUND) {
+	fprintf(stderr, "dbbench: %s: %s failed: %d\n", db->name, what, r);
+	exit(EC_SOFTWARE);
+    }
+}
+
+static void dbpaths(struct cyrusdb_backend *backend,
+		    char *dbdir, size_t dlen, char *fname, size_t flen)
+{
+    snprintf(dbdir, dlen, "%s/%s", dir, backend->name);
+
+    if (!strcmp(backend->name, "sql")) {
+	/* the "file name" is the table */
+	snprintf(fname, flen, "bench");
+    }
+    else if (!strcmp(backend->name, "quotalegacy")) {
+	/* one file per key below this directory */
+	snprintf(fname, flen, "%s/quota/bench", dbdir);
+    }
+    else {
+	snprintf(fname, flen, "%s/bench.db", dbdir);
+    }
+}
+
+static void load(struct cyrusdb_backend *backend,
+		 const char *dbdir, const char *fname)
+{
+    struct db *db = NULL;
+    struct txn *tid = NULL;
+    char *val = xmalloc(maxval + 32);
+    double start = now(), elapsed;
+    unsigned i;
+
+    check(backend->init(dbdir, CYRUSDB_RECOVER), "init", backend);
+    check(backend->open(fname, CYRUSDB_CREATE, &db), "open", backend);
+
+    for (i = 0; i < nrecords; i++) {
+	const char *v = val;
+
+	if (vals) v = vals[i];
+	else genval(val);
+
+	check(backend->store(db, keys[i], strlen(keys[i]), v, strlen(v), &tid),
+	      "store", backend);
+	if ((i % 1000) == 999) {
+	    check(backend->commit(db, tid), "commit", backend);
+	    tid = NULL;
+	}
+    }
+    if (tid) check(backend->commit(db, tid), "commit", backend);
+
+    check(backend->close(db), "close", backend);
+    backend->done();
+
+    elapsed = now() - start;
+    printf("%s: loaded %u records in %.3fs (%.0f/s)\n", backend->name,
+	   nrecords, elapsed, elapsed > 0 ? nrecords / elapsed : 0);
+
+    free(val);
+}
+
+/*
+ * The backend gave up on our transaction (CYRUSDB_AGAIN, a deadlock
+ * with another process): abort it if it hasn't already, and store the
+ * 'npending' keys in 'pending' again in a new one.
+ */
+static void retry(struct cyrusdb_backend *backend, struct db *db,
+		  struct txn **tid, const unsigned *pending, unsigned npending,
+		  char *val)
+{
+    unsigned j;
+    int r = 0;
+
+    do {
+	if (*tid) backend->abort(db, *tid);
+	*tid = NULL;
+
+	for (j = 0; j < npending; j++) {
+	    genval(val);
+	    r = backend->store(db, keys[pending[j]], strlen(keys[pending[j]]),
+			       val, strlen(val), tid);
+	    if (r == CYRUSDB_AGAIN) break;
+	    check(r, "store", backend);
+	}
+    } while (r == CYRUSDB_AGAIN);
+}
+
+/* the body of each benchmark process */
+static void runchild(struct cyrusdb_backend *backend, int child,
+		     const char *dbdir, const char *fname, int startfd)
+{
+    struct db *db = NULL;
+    struct txn *tid = NULL;
+    char *val = xmalloc(maxval + 32);
+    unsigned seq = child * (nrecords / nprocs);
+    unsigned *pending = xmalloc(txnsize * sizeof(unsigned));
+    unsigned npending = 0;
+    unsigned i;
+    int r;
+    char latfile[1024];
+    FILE *f;
+    char c;
+    int op;
+
+    srandom(seed + child + 1);
+
+    check(backend->init(dbdir, 0), "init", backend);
+    check(backend->open(fname, 0, &db), "open", backend);
+
+    /* wait for all of the processes to be ready */
+    while (read(startfd, &c, 1) < 0 && errno == EINTR);
+    close(startfd);
+
+    for (i = 0; i < nops; i++) {
+	unsigned k = pickkey(&seq);
+	unsigned mix = random() % 100;
+	double start;
+
+	if (mix < pct_fetch) {
+	    const char *data;
+	    int datalen;
+
+	    start = now();
+	    while ((r = backend->fetch(db, keys[k], strlen(keys[k]),
+				       &data, &datalen, tid ? &tid : NULL))
+		   == CYRUSDB_AGAIN) {
+		retry(backend, db, &tid, pending, npending, val);
+	    }
+	    check(r, "fetch", backend);
+	    record(OP_FETCH, start);
+	}
+	else if (mix < pct_fetch + pct_foreach) {
+	    unsigned count = 0;
+
+	    start = now();
+	    while ((r = backend->foreach(db, keys[k], prefixlen(keys[k]),
+					 NULL, count_cb, &count,
+					 tid ? &tid : NULL))
+		   == CYRUSDB_AGAIN) {
+		retry(backend, db, &tid, pending, npending, val);
+		count = 0;
+	    }
+	    check(r, "foreach", backend);
+	    record(OP_FOREACH, start);
+	}
+	else {
+	    genval(val);
+
+	    start = now();
+	    while ((r = backend->store(db, keys[k], strlen(keys[k]),
+				       val, strlen(val), &tid))
+		   == CYRUSDB_AGAIN) {
+		retry(backend, db, &tid, pending, npending, val);
+	    }
+	    check(r, "store", backend);
+	    record(OP_STORE, start);
+	    pending[npending++] = k;
+
+	    if (npending >= txnsize) {
+		start = now();
+		while ((r = backend->commit(db, tid)) == CYRUSDB_AGAIN) {
+		    tid = NULL;
+		    retry(backend, db, &tid, pending, npending, val);
+		}
+		check(r, "commit", backend);
+		record(OP_COMMIT, start);
+		tid = NULL;
+		npending = 0;
+	    }
+	}
+    }
+
+    if (tid) {
+	double start = now();
+	while ((r = backend->commit(db, tid)) == CYRUSDB_AGAIN) {
+	    tid = NULL;
+	    retry(backend, db, &tid, pending, npending, val);
+	}
+	check(r, "commit", backend);
+	record(OP_COMMIT, start);
+    }
+
+    check(backend->close(db), "close", backend);
+    backend->done();
+
+    /* hand our latencies to the parent */
+    snprintf(latfile, sizeof(latfile), "%s/lat.%d", dbdir, child);
+    f = fopen(latfile, "w");
+    if (!f) {
+	perror(latfile);
+	exit(EC_IOERR);
+    }
+    for (op = 0; op < NUM_OPS; op++) {
+	fwrite(&lat[op].count, sizeof(unsigned), 1, f);
+	fwrite(lat[op].usec, sizeof(unsigned), lat[op].count, f);
+    }
+    if (fclose(f)) {
+	perror(latfile);
+	exit(EC_IOERR);
+    }
+
+    exit(0);
+}
+
+static int cmpunsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static unsigned percentile(struct latencies *l, double p)
+{
+    unsigned i;
+
+    if (!l->count) return 0;
+    i = (unsigned) (p * l->count);
+    if (i >= l->count) i = l->count - 1;
+    return l->usec[i];
+}
+
+static void report(struct cyrusdb_backend *backend, const char *dbdir,
+		   double elapsed)
+{
+    struct latencies all[NUM_OPS];
+    unsigned total = 0;
+    unsigned child;
+    int op;
+
+    memset(all, 0, sizeof(all));
+
+    for (child = 0; child < nprocs; child++) {
+	char latfile[1024];
+	FILE *f;
+
+	snprintf(latfile, sizeof(latfile), "%s/lat.%u", dbdir, child);
+	f = fopen(latfile, "r");
+	if (!f) {
+	    perror(latfile);
+	    exit(EC_IOERR);
+	}
+	for (op = 0; op < NUM_OPS; op++) {
+	    unsigned n;
+
+	    if (fread(&n, sizeof(unsigned), 1, f) != 1) n = 0;
+	    all[op].usec = xrealloc(all[op].usec,
+				    (all[op].count + n) * sizeof(unsigned));
+	    if (fread(all[op].usec + all[op].count,
+		      sizeof(unsigned), n, f) != n) {
+		fprintf(stderr, "dbbench: short read on %s\n", latfile);
+		exit(EC_IOERR);
+	    }
+	    all[op].count += n;
+	}
+	fclose(f);
+	unlink(latfile);
+    }
+
+    for (op = 0; op < NUM_OPS; op++) {
+	if (op != OP_COMMIT) total += all[op].count;
+    }
+
+    printf("%s: %u process%s, %u operations in %.3fs (%.0f ops/s)\n",
+	   backend->name, nprocs, nprocs == 1 ? "" : "es", total, elapsed,
+	   elapsed > 0 ? total / elapsed : 0);
+    printf("    %-8s %9s %10s %9s %9s %9s %9s\n", "op", "count", "ops/s",
+	   "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+    for (op = 0; op < NUM_OPS; op++) {
+	struct latencies *l = &all[op];
+
+	if (!l->count) continue;
+	qsort(l->usec, l->count, sizeof(unsigned), cmpunsigned);
+	printf("    %-8s %9u %10.0f %9u %9u %9u %9u\n", opnames[op], l->count,
+	       elapsed > 0 ? l->count / elapsed : 0,
+	       percentile(l, 0.50), percentile(l, 0.99),
+	       percentile(l, 0.999), l->usec[l->count - 1]);
+	free(l->usec);
+    }
+}
+
+static void bench(struct cyrusdb_backend *backend)
+{
+    char dbdir[1024], fname[1024], sqlpath[1024];
+    int startpipe[2];
+    pid_t *pids;
+    double start;
+    unsigned child;
+    int failed = 0;
+
+    dbpaths(backend, dbdir, sizeof(dbdir), fname, sizeof(fname));
+    quotavals = !strcmp(backend->name, "quotalegacy");
+
+    /* cyrus_mkdir() creates the parents of its argument */
+    snprintf(sqlpath, sizeof(sqlpath), "%s/x", dbdir);
+    if (cyrus_mkdir(sqlpath, 0755) == -1 ||
+	(mkdir(dbdir, 0755) == -1 && errno != EEXIST)) {
+	perror(dbdir);
+	exit(EC_IOERR);
+    }
+
+    if (!strcmp(backend->name, "sql")) {
+	snprintf(sqlpath, sizeof(sqlpath), "%s/bench.sqlite", dbdir);
+	libcyrus_config_setstring(CYRUSOPT_SQL_ENGINE, sqlengine);
+	libcyrus_config_setstring(CYRUSOPT_SQL_DATABASE, sqlpath);
+    }
+
+    load(backend, dbdir, fname);
+
+    if (pipe(startpipe) == -1) {
+	perror("pipe");
+	exit(EC_OSERR);
+    }
+
+    fflush(stdout);
+    pids = xmalloc(nprocs * sizeof(pid_t));
+    for (child = 0; child < nprocs; child++) {
+	pids[child] = fork();
+	if (pids[child] == -1) {
+	    perror("fork");
+	    exit(EC_OSERR);
+	}
+	if (!pids[child]) {
+	    close(startpipe[1]);
+	    runchild(backend, child, dbdir, fname, startpipe[0]);
+	}
+    }
+
+    /* give the children a moment to open the database, then start
+     * them all at once by closing the pipe */
+    close(startpipe[0]);
+    sleep(1);
+    start = now();
+    close(startpipe[1]);
+
+    for (child = 0; child < nprocs; child++) {
+	int status;
+
+	while (waitpid(pids[child], &status, 0) == -1 && errno == EINTR);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+    }
+    free(pids);
+
+    if (failed) {
+	fprintf(stderr, "dbbench: %s: benchmark process failed\n",
+		backend->name);
+	exit(EC_SOFTWARE);
+    }
+
+    report(backend, dbdir, now() - start);
+
+    if (!keepfiles) {
+	char cmd[2048];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dbdir);
+	if (system(cmd)) fprintf(stderr, "dbbench: couldn't remove %s\n", dbdir);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct cyrusdb_backend *backends[32];
+    const char *infile = NULL;
+    int nbackends = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "b:d:n:o:p:k:z:u:l:r:f:t:i:S:s:K")) != EOF) {
+	switch (opt) {
+	case 'b':
+	    if (nbackends == 32) usage();
+	    backends[nbackends++] = cyrusdb_fromname(optarg);
+	    break;
+	case 'd': dir = optarg; break;
+	case 'n': nrecords = atoi(optarg); break;
+	case 'o': nops = atoi(optarg); break;
+	case 'p': nprocs = atoi(optarg); break;
+	case 'k':
+	    if (!strcmp(optarg, "uniform")) dist = DIST_UNIFORM;
+	    else if (!strcmp(optarg, "zipf")) dist = DIST_ZIPF;
+	    else if (!strcmp(optarg, "seq")) dist = DIST_SEQ;
+	    else usage();
+	    break;
+	case 'z': theta = atof(optarg); break;
+	case 'u': folders = atoi(optarg); break;
+	case 'l':
+	    if (sscanf(optarg, "%u:%u", &minval, &maxval) != 2) usage();
+	    break;
+	case 'r': pct_fetch = atoi(optarg); break;
+	case 'f': pct_foreach = atoi(optarg); break;
+	case 't': txnsize = atoi(optarg); break;
+	case 'i': infile = optarg; break;
+	case 'S': sqlengine = optarg; break;
+	case 's': seed = atoi(optarg); break;
+	case 'K': keepfiles = 1; break;
+	default:
+	    usage();
+	}
+    }
+
+    if (optind != argc || !nprocs || !folders || !txnsize ||
+	minval > maxval || pct_fetch + pct_foreach > 100) {
+	usage();
+    }
+
+    /* default to every backend we were built with */
+    if (!nbackends) {
+	for (i = 0; cyrusdb_backends[i] && i < 32; i++) {
+	    backends[nbackends++] = cyrusdb_backends[i];
+	}
+    }
+
+    srandom(seed);
+
+    if (infile) loadkeys(infile);
+    else if (nrecords) genkeys();
+    else usage();
+
+    if (dist == DIST_ZIPF) setupzipf();
+
+    printf("%u records, %u operations x %u process%s, "
+	   "%u%% fetch / %u%% foreach / %u%% store, %u store%s per txn\n",
+	   nrecords, nops, nprocs, nprocs == 1 ? "" : "es",
+	   pct_fetch, pct_foreach, 100 - pct_fetch - pct_foreach,
+	   txnsize, txnsize == 1 ? "" : "s");
+
+    for (i = 0; i < nbackends; i++) {
+	bench(backends[i]);
+	fflush(stdout);
+    }
+
+    return 0;
+}
@@ -51,12 +51,16 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/poll.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/param.h>
@@ -110,12 +114,20 @@
   int deny_severity = LOG_ERR;
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H) && \
+    !defined(HAVE_UCDSNMP) && !defined(HAVE_NETSNMP)
+/* the SNMP agent hands us an fd_set, so it keeps the select() loop */
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "masterconf.h"
 
 #include "master.h"
 #include "service.h"
 
 #include "cyr_lock.h"
+#include "scoreboard.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
@@ -138,6 +150,16 @@ const char *MASTER_CONFIG_FILENAME = DEFAULT_MASTER_CONFIG_FILENAME;
 #define SERVICE_MAX  INT_MAX-10
 #define SERVICENAME(x) ((x) ? x : "unknown")
 
+#define ZYGOTE_TIMEOUT 1000	/* msecs to wait for a ready zygote to fork */
+#define PREFORK_INTERVAL 1	/* secs between sizing prefork pools */
+#define PREFORK_SMOOTHING 0.25	/* weight of the latest sample */
+#define NOTIFY_BATCH 64		/* status messages per read() */
+#define MASTER_EVENTS 64	/* events per epoll_wait() */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 struct service *Services = NULL;
 static int allocservices = 0;
 int nservices = 0;
@@ -155,7 +177,10 @@ struct event {
     char *const *exec;
     struct event *next;
 };
-static struct event *schedule = NULL;
+/* pending events, a binary heap ordered by mark */
+static struct event **schedule = NULL;
+static int nschedule = 0;
+static int allocschedule = 0;
 
 enum sstate {
     SERVICE_STATE_UNKNOWN = 0,  /* duh */
@@ -172,6 +197,8 @@ struct centry {
     enum sstate service_state;	/* SERVICE_STATE_* */
     time_t janitor_deadline;	/* cleanup deadline */
     int si;			/* Services[] index */
+    int dispatch_fd;		/* where we hand it connections, or -1 */
+    struct timeval spawned;	/* when we forked it, until it starts */
     struct centry *next;
 };
 static struct centry *ctable[child_table_size];
@@ -183,6 +210,7 @@ static struct timeval janitor_mark;	/* Last time janitor did a sweep */
 
 static void limit_fds(rlim_t);
 static void schedule_event(struct event *a);
+static void unwatch_zygote(const int si);
 
 void fatal(const char *msg, int code)
 {
@@ -260,10 +288,20 @@ static struct centry *get_centry(void)
     cfreelist = cfreelist->next;
 
     t->janitor_deadline = 0;
+    t->dispatch_fd = -1;
+    timerclear(&t->spawned);
 
     return t;
 }
 
+static struct centry *find_centry(pid_t p)
+{
+    struct centry *c = ctable[p % child_table_size];
+
+    while (c && c->pid != p) c = c->next;
+    return c;
+}
+
 /* see if 'listen' parameter has both hostname and port, or just port */
 static char *parse_listen(char *listen)
 {
@@ -423,6 +461,11 @@ static void service_create(struct service *s)
 	if (s->socket > 0) {
 	    memcpy(&service, &service0, sizeof(struct service));
 	    s = &service;
+
+	    /* an associate has children of its own */
+	    s->idle = NULL;
+	    s->nidle = s->idlealloc = 0;
+	    s->watch_stat = s->watch_listen = s->watch_zygote = 0;
 	}
 
 	s->socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
@@ -565,23 +608,358 @@ static void run_startup(char **cmd)
 static void fcntl_unset(int fd, int flag)
 {
     int fdflags = fcntl(fd, F_GETFD, 0);
-    if (fdflags != -1) fdflags = fcntl(STATUS_FD, F_SETFD, 
-				       fdflags & ~flag);
+    if (fdflags != -1) fdflags = fcntl(fd, F_SETFD, fdflags & ~flag);
     if (fdflags == -1) {
 	syslog(LOG_ERR, "fcntl(): unable to unset %d: %m", flag);
     }
 }
 
+/* exec the service in a freshly forked child; lfd becomes its LISTEN_FD
+ * and zfd is the zygote's request socket, or -1 for an ordinary child */
+static void exec_service(struct service *s, int lfd, int zfd)
+{
+    int i;
+    char path[PATH_MAX];
+    static char name_env[100], name_env2[100];
+
+    /* Child - Release our pidfile lock. */
+    if(pidfd != -1) close(pidfd);
+
+    if (become_cyrus() != 0) {
+	syslog(LOG_ERR, "can't change to the cyrus user");
+	exit(1);
+    }
+
+    get_prog(path, sizeof(path), s->exec);
+    if (dup2(s->stat[1], STATUS_FD) < 0) {
+	syslog(LOG_ERR, "can't duplicate status fd: %m");
+	exit(1);
+    }
+    if (dup2(lfd, LISTEN_FD) < 0) {
+	syslog(LOG_ERR, "can't duplicate listener fd: %m");
+	exit(1);
+    }
+    if (lfd != s->socket && lfd != LISTEN_FD) close(lfd);
+    if (zfd != -1 && dup2(zfd, ZYGOTE_FD) < 0) {
+	syslog(LOG_ERR, "can't duplicate zygote fd: %m");
+	exit(1);
+    }
+
+    fcntl_unset(STATUS_FD, FD_CLOEXEC);
+    fcntl_unset(LISTEN_FD, FD_CLOEXEC);
+    if (zfd != -1) {
+	fcntl_unset(ZYGOTE_FD, FD_CLOEXEC);
+	if (zfd != ZYGOTE_FD) close(zfd);
+    }
+
+    /* close all listeners */
+    for (i = 0; i < nservices; i++) {
+	if (Services[i].socket > 0) close(Services[i].socket);
+	if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
+	if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
+    }
+    limit_fds(s->maxfds);
+
+    syslog(LOG_DEBUG, "about to exec %s", path);
+
+    /* add service name to environment */
+    snprintf(name_env, sizeof(name_env), "CYRUS_SERVICE=%s", s->name);
+    putenv(name_env);
+    snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
+    putenv(name_env2);
+    if (zfd != -1) putenv("CYRUS_ZYGOTE=1");
+    if (s->dispatch) putenv("CYRUS_DISPATCH=1");
+
+    execv(path, s->exec);
+    syslog(LOG_ERR, "couldn't exec %s: %m", path);
+    exit(EX_OSERR);
+}
+
+/* remember that child p of service s is ready for a connection */
+static void dispatch_idle(struct service *s, pid_t p)
+{
+    struct centry *c;
+    int i, n;
+
+    if (s->nidle == s->idlealloc) {
+	/* drop children that have moved on since we saw them idle */
+	for (i = n = 0; i < s->nidle; i++) {
+	    c = find_centry(s->idle[i]);
+	    if (c && c->service_state == SERVICE_STATE_READY &&
+		c->dispatch_fd != -1) {
+		s->idle[n++] = s->idle[i];
+	    }
+	}
+	s->nidle = n;
+    }
+    if (s->nidle == s->idlealloc) {
+	s->idlealloc += 16;
+	s->idle = xrealloc(s->idle, s->idlealloc * sizeof(pid_t));
+    }
+    s->idle[s->nidle++] = p;
+}
+
+/* account for a new (ready) child of service si; dfd is our end of
+ * its dispatch socket, or -1 */
+static void add_worker(const int si, pid_t p, int dfd)
+{
+    struct service * const s = &Services[si];
+    struct centry *c;
+
+    s->ready_workers++;
+    s->interval_forks++;
+    s->nforks++;
+    s->nactive++;
+
+    /* add to child table */
+    c = get_centry();
+    c->pid = p;
+    c->service_state = SERVICE_STATE_READY;
+    c->si = si;
+    c->dispatch_fd = dfd;
+    gettimeofday(&c->spawned, NULL);
+    c->next = ctable[p % child_table_size];
+    ctable[p % child_table_size] = c;
+
+    if (dfd != -1) dispatch_idle(s, p);
+}
+
+/* send a byte, and descriptor fd (unless it's -1), down socket sock */
+static int send_fd(int sock, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char c = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1) {
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == 1 ? 0 : -1;
+}
+
+/* is there a connection waiting on listener fd? */
+static int conn_pending(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/*
+ * Accept the connections waiting for service si (dispatch=1) and hand
+ * each one to an idle child over its dispatch socket, most recently
+ * idle first.  The children never touch the listener, so there's no
+ * accept lock and no herd of them woken for each connection.
+ */
+static void dispatch_conns(const int si)
+{
+    struct service * const s = &Services[si];
+    struct centry *c;
+    pid_t p;
+    int fd = -1;
+
+    while (s->nidle > 0) {
+	p = s->idle[--s->nidle];
+	c = find_centry(p);
+	if (!c || c->si != si || c->service_state != SERVICE_STATE_READY ||
+	    c->dispatch_fd == -1) {
+	    continue;
+	}
+
+	if (fd == -1) {
+	    if (!conn_pending(s->socket) ||
+		(fd = accept(s->socket, NULL, NULL)) < 0) {
+		s->idle[s->nidle++] = p;
+		break;
+	    }
+	}
+
+	if (send_fd(c->dispatch_fd, fd) < 0) {
+	    syslog(LOG_ERR, "can't hand connection to service %s pid %d: %m",
+		   SERVICENAME(s->name), p);
+	    close(c->dispatch_fd);
+	    c->dispatch_fd = -1;
+	    continue;
+	}
+	close(fd);
+	fd = -1;
+
+	/* it tells us when it's done, as usual */
+	c->service_state = SERVICE_STATE_BUSY;
+	s->ready_workers--;
+    }
+
+    if (fd != -1) {
+	syslog(LOG_WARNING, "no child of service %s to take connection",
+	       SERVICENAME(s->name));
+	close(fd);
+    }
+}
+
+/* retire the zygote of service si; we keep its pid until we've reaped it */
+static void zygote_stop(const int si)
+{
+    struct service * const s = &Services[si];
+
+    s->zygote_ready = 0;
+    if (!s->zygote_pid || s->zygote_fd == -1) return;
+
+    /* it exits once it reads EOF */
+    unwatch_zygote(si);
+    close(s->zygote_fd);
+    s->zygote_fd = -1;
+}
+
+/*
+ * Start a zygote for service si: an instance of the service that is
+ * exec'd and configured once, then forks a worker each time we write
+ * a byte down its socket, answering with the worker's pid.
+ * The worker's parent exits straight away, so the worker is reparented
+ * to us (we're a child subreaper) and reaped like any other child.
+ * The zygote writes its own pid once it's configured; the main loop
+ * watches for that (zygote_hello), and we fork directly until then.
+ */
+static int zygote_start(const int si)
+{
+    struct service * const s = &Services[si];
+    int sv[2];
+    pid_t p;
+
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_CHILD_SUBREAPER)
+    static int subreaper = 0;
+
+    if (!subreaper) {
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+	    syslog(LOG_WARNING, "can't become a child subreaper: %m; "
+		   "zygotes disabled");
+	    subreaper = -1;
+	}
+	else subreaper = 1;
+    }
+    if (subreaper < 0) return -1;
+#else
+    return -1;
+#endif
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	syslog(LOG_ERR, "can't create zygote socket for service %s: %m",
+	       s->name);
+	return -1;
+    }
+
+    switch (p = fork()) {
+    case -1:
+	syslog(LOG_ERR, "can't fork zygote for service %s: %m", s->name);
+	close(sv[0]);
+	close(sv[1]);
+	return -1;
+
+    case 0:
+	close(sv[0]);
+	exec_service(s, s->socket, sv[1]);
+	/* NOTREACHED */
+
+    default:			/* parent */
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	s->zygote_pid = p;
+	s->zygote_fd = sv[0];
+	syslog(LOG_DEBUG, "started zygote %d for service %s", p, s->name);
+	break;
+    }
+
+    return 0;
+}
+
+/* the zygote of service si has spoken before it was asked: it's ready,
+ * or (EOF) it died initializing */
+static void zygote_hello(const int si)
+{
+    struct service * const s = &Services[si];
+    pid_t p = 0;
+    ssize_t n;
+
+    do {
+	n = read(s->zygote_fd, &p, sizeof(p));
+    } while (n == -1 && errno == EINTR);
+
+    if (n != sizeof(p) || p != s->zygote_pid) {
+	syslog(LOG_WARNING, "zygote %d for service %s failed to start",
+	       s->zygote_pid, SERVICENAME(s->name));
+	zygote_stop(si);
+	kill(s->zygote_pid, SIGTERM);
+	return;
+    }
+
+    syslog(LOG_DEBUG, "zygote %d for service %s is ready",
+	   s->zygote_pid, SERVICENAME(s->name));
+    s->zygote_ready = 1;
+}
+
+/* ask the zygote of service si for a worker, handing it dispatch socket
+ * lfd (unless it's -1) as its LISTEN_FD; returns 1 if we got one,
+ * 0 if the caller should fork the child itself */
+static int zygote_spawn(const int si, int lfd, int dfd)
+{
+    struct service * const s = &Services[si];
+    struct pollfd pfd;
+    pid_t p = 0;
+    int r;
+
+    /* a new zygote is initializing; the main loop hears when it's done */
+    if (!s->zygote_pid) zygote_start(si);
+    if (!s->zygote_ready) return 0;
+
+    if (send_fd(s->zygote_fd, lfd) < 0) goto fail;
+
+    /* it's only a fork away, but don't wait on it forever */
+    pfd.fd = s->zygote_fd;
+    pfd.events = POLLIN;
+    do {
+	r = poll(&pfd, 1, ZYGOTE_TIMEOUT);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) goto fail;
+
+    if (read(s->zygote_fd, &p, sizeof(p)) != sizeof(p) || p <= 0) goto fail;
+
+    add_worker(si, p, dfd);
+    return 1;
+
+ fail:
+    syslog(LOG_WARNING, "zygote %d for service %s failed; forking directly",
+	   s->zygote_pid, s->name);
+    zygote_stop(si);
+    kill(s->zygote_pid, SIGTERM);
+    return 0;
+}
+
 static void spawn_service(const int si)
 {
     /* Note that there is logic that depends on this being 2 */
     const int FORKRATE_INTERVAL = 2;
 
     pid_t p;
-    int i;
-    char path[PATH_MAX];
-    static char name_env[100], name_env2[100];
-    struct centry *c;
+    int sv[2] = { -1, -1 };
     struct service * const s = &Services[si];
     time_t now = time(NULL);
 
@@ -630,66 +1008,37 @@ static void spawn_service(const int si)
 	return;
     }
 
+    /* we'll hand connections to the child ourselves */
+    if (s->dispatch) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	    syslog(LOG_ERR, "can't create dispatch socket for service %s: %m",
+		   s->name);
+	    return;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* hand the request to the zygote, if it's up to it */
+    if (s->zygote && zygote_spawn(si, sv[1], sv[0])) {
+	if (sv[1] != -1) close(sv[1]);
+	return;
+    }
+
     switch (p = fork()) {
     case -1:
 	syslog(LOG_ERR, "can't fork process to run service %s: %m", s->name);
+	if (sv[0] != -1) close(sv[0]);
+	if (sv[1] != -1) close(sv[1]);
 	break;
 
     case 0:
-	/* Child - Release our pidfile lock. */
-	if(pidfd != -1) close(pidfd);
-
-	if (become_cyrus() != 0) {
-	    syslog(LOG_ERR, "can't change to the cyrus user");
-	    exit(1);
-	}
-
-	get_prog(path, sizeof(path), s->exec);
-	if (dup2(s->stat[1], STATUS_FD) < 0) {
-	    syslog(LOG_ERR, "can't duplicate status fd: %m");
-	    exit(1);
-	}
-	if (dup2(s->socket, LISTEN_FD) < 0) {
-	    syslog(LOG_ERR, "can't duplicate listener fd: %m");
-	    exit(1);
-	}
-
-	fcntl_unset(STATUS_FD, FD_CLOEXEC);
-	fcntl_unset(LISTEN_FD, FD_CLOEXEC);
-
-	/* close all listeners */
-	for (i = 0; i < nservices; i++) {
-	    if (Services[i].socket > 0) close(Services[i].socket);
-	    if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
-	    if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
-	}
-	limit_fds(s->maxfds);
-
-	syslog(LOG_DEBUG, "about to exec %s", path);
-
-	/* add service name to environment */
-	snprintf(name_env, sizeof(name_env), "CYRUS_SERVICE=%s", s->name);
-	putenv(name_env);
-	snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
-	putenv(name_env2);
-
-	execv(path, s->exec);
-	syslog(LOG_ERR, "couldn't exec %s: %m", path);
-	exit(EX_OSERR);
+	if (sv[0] != -1) close(sv[0]);
+	exec_service(s, sv[1] != -1 ? sv[1] : s->socket, -1);
+	/* NOTREACHED */
 
     default:			/* parent */
-	s->ready_workers++;
-	s->interval_forks++;
-	s->nforks++;
-	s->nactive++;
-
-	/* add to child table */
-	c = get_centry();
-	c->pid = p;
-	c->service_state = SERVICE_STATE_READY;
-	c->si = si;
-	c->next = ctable[p % child_table_size];
-	ctable[p % child_table_size] = c;
+	if (sv[1] != -1) close(sv[1]);
+	add_worker(si, p, sv[0]);
 	break;
     }
 
@@ -697,24 +1046,46 @@ static void spawn_service(const int si)
 
 static void schedule_event(struct event *a)
 {
-    struct event *ptr;
+    int i, parent;
 
     if (! a->name)
 	fatal("Serious software bug found: schedule_event() called on unnamed event!",
 		EX_SOFTWARE);
 
-    if (!schedule || a->mark < schedule->mark) {
-	a->next = schedule;
-	schedule = a;
-	
-	return;
+    if (nschedule == allocschedule) {
+	allocschedule += 16;
+	schedule = xrealloc(schedule, allocschedule * sizeof(struct event *));
     }
-    for (ptr = schedule; ptr->next && ptr->next->mark <= a->mark; 
-	 ptr = ptr->next) ;
 
-    /* insert a */
-    a->next = ptr->next;
-    ptr->next = a;
+    /* sift a up from the bottom */
+    for (i = nschedule++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (schedule[parent]->mark <= a->mark) break;
+	schedule[i] = schedule[parent];
+    }
+    schedule[i] = a;
+}
+
+/* remove and return the earliest event; the schedule must not be empty */
+static struct event *unschedule_event(void)
+{
+    struct event *first = schedule[0];
+    struct event *last = schedule[--nschedule];
+    int i = 0, child;
+
+    /* sift the last event down from the top */
+    while ((child = 2 * i + 1) < nschedule) {
+	if (child + 1 < nschedule &&
+	    schedule[child + 1]->mark < schedule[child]->mark) {
+	    child++;
+	}
+	if (last->mark <= schedule[child]->mark) break;
+	schedule[i] = schedule[child];
+	i = child;
+    }
+    schedule[i] = last;
+
+    return first;
 }
 
 static void spawn_schedule(time_t now)
@@ -727,20 +1098,16 @@ static void spawn_schedule(time_t now)
 
     a = NULL;
     /* update schedule accordingly */
-    while (schedule && schedule->mark <= now) {
+    while (nschedule && schedule[0]->mark <= now) {
 	/* delete from schedule, insert into a */
-	struct event *ptr = schedule;
-
-	/* delete */
-	schedule = schedule->next;
+	struct event *ptr = unschedule_event();
 
-	/* insert */
 	ptr->next = a;
 	a = ptr;
     }
 
     /* run all events */
-    while (a && a != schedule) {
+    while (a) {
 	/* if a->exec is NULL, we just used the event to wake up,
 	 * so we actually don't need to exec anything at the moment */
 	if(a->exec) {
@@ -829,7 +1196,7 @@ static void spawn_schedule(time_t now)
 
 static void reap_child(void)
 {
-    int status;
+    int i, status;
     pid_t pid;
     struct centry *c;
     struct service *s;
@@ -845,6 +1212,18 @@ static void reap_child(void)
 		   pid, WTERMSIG(status));
 	}
 
+	/* a zygote isn't in the child table; the next spawn starts another */
+	for (i = 0; i < nservices; i++) {
+	    if (Services[i].zygote_pid == pid) break;
+	}
+	if (i < nservices) {
+	    syslog(LOG_DEBUG, "zygote %d for service %s exited",
+		   pid, SERVICENAME(Services[i].name));
+	    zygote_stop(i);
+	    Services[i].zygote_pid = 0;
+	    continue;
+	}
+
 	/* account for the child */
 	c = ctable[pid % child_table_size];
 	while(c && c->pid != pid) c = c->next;
@@ -852,6 +1231,14 @@ static void reap_child(void)
 	if (c && c->pid == pid) {
 	    s = ((c->si) != SERVICE_NONE) ? &Services[c->si] : NULL;
 
+	    if (c->dispatch_fd != -1) {
+		close(c->dispatch_fd);
+		c->dispatch_fd = -1;
+	    }
+
+	    /* whatever it was doing, it isn't any more */
+	    if (s) scoreboard_release(pid);
+
 	    /* paranoia */
 	    switch (c->service_state) {
 	    case SERVICE_STATE_READY:
@@ -941,6 +1328,111 @@ static void reap_child(void)
     }
 }
 
+static double smooth(double avg, double sample)
+{
+    return avg + PREFORK_SMOOTHING * (sample - avg);
+}
+
+/* ask a ready child of service si to go away */
+static void retire_child(const int si)
+{
+    struct service * const s = &Services[si];
+    struct centry *c;
+    int i;
+
+    if (s->dispatch) {
+	/* hang up on the one that's been idle longest */
+	for (i = 0; i < s->nidle; i++) {
+	    c = find_centry(s->idle[i]);
+	    if (c && c->si == si && c->service_state == SERVICE_STATE_READY &&
+		c->dispatch_fd != -1) {
+		close(c->dispatch_fd);
+		c->dispatch_fd = -1;
+		break;
+	    }
+	}
+	if (i == s->nidle) return;
+    }
+    else {
+	/* one that has reported in, so it's ready for the signal */
+	for (i = 0; i < child_table_size; i++) {
+	    for (c = ctable[i]; c; c = c->next) {
+		if (c->si == si && c->service_state == SERVICE_STATE_READY &&
+		    !timerisset(&c->spawned))
+		    break;
+	    }
+	    if (c) break;
+	}
+	if (!c) return;
+
+	/* it won't tell us it's going.  if it has just taken a
+	 * connection it ignores the signal, and tells us it's ready
+	 * again once it's done */
+	c->service_state = SERVICE_STATE_BUSY;
+	s->ready_workers--;
+	kill(c->pid, SIGUSR2);
+    }
+
+    if (verbose)
+	syslog(LOG_DEBUG, "service %s pid %d: retiring idle child",
+	       SERVICENAME(s->name), c->pid);
+}
+
+/*
+ * Size the pool of ready children for services with a maxprefork.
+ * Each connection takes a ready child, and its replacement is only
+ * ready spawn_latency secs later, so we keep enough for the connections
+ * arriving in that time; more when most children are busy, as few will
+ * come back to the pool soon.  The pool grows at once, but idle
+ * children are retired one at a time, once there's been a surplus for
+ * a while.
+ */
+static void adapt_prefork(time_t now)
+{
+    struct service *s;
+    double n, latency;
+    int i, conns, target;
+
+    for (i = 0; i < nservices; i++) {
+	s = &Services[i];
+	if (!s->exec || s->prefork_max <= s->prefork_min) continue;
+	if (now < s->prefork_mark + PREFORK_INTERVAL) continue;
+
+	if (s->prefork_mark) {
+	    conns = s->nconnections - s->prefork_conns;
+	    if (conns < 0) conns = 0;
+	    s->arrival_rate = smooth(s->arrival_rate,
+				     (double) conns / (now - s->prefork_mark));
+	    s->busy_ratio = smooth(s->busy_ratio, s->nactive ?
+		(double) (s->nactive - s->ready_workers) / s->nactive : 0);
+	}
+	s->prefork_mark = now;
+	s->prefork_conns = s->nconnections;
+
+	/* until a child has told us, assume the worst */
+	latency = s->spawn_latency ? s->spawn_latency : PREFORK_INTERVAL;
+	n = s->arrival_rate * latency * (1 + s->busy_ratio);
+	target = (int) n + 1;
+	if (target < s->prefork_min) target = s->prefork_min;
+	if (target > s->prefork_max) target = s->prefork_max;
+
+	if (target != s->desired_workers) {
+	    syslog(LOG_INFO, "service %s: prefork %d -> %d "
+		   "(%.1f conn/s, %d%% busy, %d ms to spawn)",
+		   SERVICENAME(s->name), s->desired_workers, target,
+		   s->arrival_rate, (int) (s->busy_ratio * 100),
+		   (int) (s->spawn_latency * 1000));
+	    s->desired_workers = target;
+	}
+
+	s->ready_surplus = smooth(s->ready_surplus,
+				  s->ready_workers - s->desired_workers);
+	if (s->ready_surplus > 0.5 && s->ready_workers > s->desired_workers) {
+	    retire_child(i);
+	}
+    }
+}
+
 static void init_janitor(void)
 {
     struct event *evt = (struct event *) malloc(sizeof(struct event));
@@ -958,6 +1450,27 @@ static void init_janitor(void)
     schedule_event(evt);
 }
 
+static void init_prefork(void)
+{
+    struct event *evt;
+    int i;
+
+    for (i = 0; i < nservices; i++) {
+	if (Services[i].exec &&
+	    Services[i].prefork_max > Services[i].prefork_min) break;
+    }
+    if (i == nservices) return;
+
+    evt = (struct event *) xmalloc(sizeof(struct event));
+    memset(evt, 0, sizeof(struct event));
+
+    evt->name = xstrdup("prefork periodic wakeup call");
+    evt->period = PREFORK_INTERVAL;
+    evt->periodic = 1;
+    evt->mark = time(NULL) + PREFORK_INTERVAL;
+    schedule_event(evt);
+}
+
 static void child_janitor(time_t now)
 {
     int i;
@@ -1117,33 +1630,33 @@ static void sighandler_setup(void)
 }
 
 /*
- * Receives a message from a service.
+ * Receives up to n messages from a service with a single read().
  *
- * Returns zero if all goes well
- * 1 if no msg available
- * 2 if bad message received (incorrectly sized)
+ * Returns the number of messages received, 0 if none are available,
+ * -2 if a bad message was received (incorrectly sized)
  * -1 on error (errno set)
  */
-static int read_msg(int fd, struct notify_message *msg)
+static int read_msgs(int fd, struct notify_message *msgs, int n)
 {
     ssize_t r;
-    size_t off = 0;
-    int s = sizeof(struct notify_message);
-
-    while (s > 0) {
-        do
-            r = read(fd, msg + off, s);
-        while ((r == -1) && (errno == EINTR));
-        if (r <= 0) break;
-        s -= r;
-        off += r;
-    }
-    if ( ((r == 0) && (off == 0)) ||
-         ((r == -1) && (errno == EAGAIN)) )
-        return 1;
-    if (r == -1) return -1;
-    if (s != 0) return 2;
-    return 0;
+    size_t off;
+    const size_t s = sizeof(struct notify_message);
+
+    do
+	r = read(fd, msgs, n * s);
+    while ((r == -1) && (errno == EINTR));
+    if ((r == -1) && (errno == EAGAIN)) return 0;
+    if (r <= 0) return r;
+
+    /* each message is a single atomic write, but let's be careful */
+    for (off = r; off % s; off += r) {
+	do
+	    r = read(fd, (char *) msgs + off, s - off % s);
+	while ((r == -1) && (errno == EINTR));
+	if (r <= 0) return -2;
+    }
+
+    return off / s;
 }
 
 static void process_msg(const int si, struct notify_message *msg) 
@@ -1224,6 +1737,7 @@ static void process_msg(const int si, struct notify_message *msg)
 		   "service %s pid %d in UNKNOWN state: now available and in READY state",
 		   SERVICENAME(s->name), c->pid);
 	    c->service_state = SERVICE_STATE_READY;
+	    if (c->dispatch_fd != -1) dispatch_idle(s, c->pid);
 	    break;
 	    
 	case SERVICE_STATE_BUSY:
@@ -1233,6 +1747,7 @@ static void process_msg(const int si, struct notify_message *msg)
 		       SERVICENAME(s->name), c->pid);
 	    c->service_state = SERVICE_STATE_READY;
 	    s->ready_workers++;
+	    if (c->dispatch_fd != -1) dispatch_idle(s, c->pid);
 	    break;
 
 	case SERVICE_STATE_DEAD:
@@ -1246,6 +1761,13 @@ static void process_msg(const int si, struct notify_message *msg)
 	break;
 
     case MASTER_SERVICE_UNAVAILABLE:
+	/* a dispatched child is on its way out: hang up, so it knows
+	 * there are no more connections coming */
+	if (c->dispatch_fd != -1) {
+	    close(c->dispatch_fd);
+	    c->dispatch_fd = -1;
+	}
+
 	switch (c->service_state) {
 	case SERVICE_STATE_BUSY:
 	    /* duplicate message? */
@@ -1359,6 +1881,21 @@ static void process_msg(const int si, struct notify_message *msg)
 	}
 	break;
 	
+    case MASTER_SERVICE_STARTED:
+	/* how long it took to get going */
+	if (timerisset(&c->spawned)) {
+	    struct timeval now;
+	    double latency;
+
+	    gettimeofday(&now, NULL);
+	    latency = (now.tv_sec - c->spawned.tv_sec) +
+		(now.tv_usec - c->spawned.tv_usec) / 1000000.0;
+	    s->spawn_latency = s->spawn_latency ?
+		smooth(s->spawn_latency, latency) : latency;
+	    timerclear(&c->spawned);
+	}
+	break;
+
     default:
 	syslog(LOG_CRIT, "service %s pid %d: Software bug: unrecognized message 0x%x", 
 	       SERVICENAME(s->name), c->pid, msg->message);
@@ -1370,6 +1907,117 @@ static void process_msg(const int si, struct notify_message *msg)
 	       SERVICENAME(s->name), s->ready_workers);
 }
 
+/* handle everything service si has told us */
+static void read_service_msgs(const int si)
+{
+    struct notify_message msgs[NOTIFY_BATCH];
+    int r, i;
+
+    while ((r = read_msgs(Services[si].stat[0], msgs, NOTIFY_BATCH)) > 0) {
+	for (i = 0; i < r; i++)
+	    process_msg(si, &msgs[i]);
+    }
+
+    if (r == -2) {
+	syslog(LOG_ERR,
+	       "got incorrectly sized response from child: %x", si);
+    }
+    if (r == -1) {
+	syslog(LOG_ERR,
+	       "error while receiving message from child %x: %m", si);
+    }
+}
+
+/* does service s want us to watch its listener? */
+static int want_connections(const struct service *s)
+{
+    if (s->socket <= 0) return 0;
+
+    return (s->dispatch && s->nidle) ||
+	(s->ready_workers == 0 && s->nactive < s->max_workers);
+}
+
+/* what a watched fd is to its service */
+enum {
+    WATCH_STAT = 0,		/* its status pipe */
+    WATCH_LISTEN = 1,		/* its listener */
+    WATCH_ZYGOTE = 2		/* its zygote, which isn't ready yet */
+};
+
+/* is service s waiting to hear from its zygote? */
+static int want_zygote(const struct service *s)
+{
+    return s->zygote_pid && !s->zygote_ready && s->zygote_fd > 0;
+}
+
+#ifdef USE_EPOLL
+static int epfd = -1;
+
+/* point the registration *watched at fd (0 for none), tagged with
+ * service si and what fd is to it */
+static void watch_fd(int *watched, int fd, int si, int what)
+{
+    struct epoll_event ev;
+
+    if (*watched == fd) return;
+
+    if (*watched > 0 &&
+	epoll_ctl(epfd, EPOLL_CTL_DEL, *watched, NULL) == -1) {
+	syslog(LOG_ERR, "unable to unwatch %s fd %d: %m",
+	       SERVICENAME(Services[si].name), *watched);
+    }
+    *watched = 0;
+
+    if (fd > 0) {
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = (si << 2) | what;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	    syslog(LOG_ERR, "unable to watch %s fd %d: %m",
+		   SERVICENAME(Services[si].name), fd);
+	}
+	else *watched = fd;
+    }
+}
+
+/* bring the event set in line with what each service wants;
+ * only changes cost a system call */
+static void watch_services(void)
+{
+    int i;
+
+    for (i = 0; i < nservices; i++) {
+	struct service *s = &Services[i];
+
+	watch_fd(&s->watch_stat, s->stat[0], i, WATCH_STAT);
+	watch_fd(&s->watch_listen, want_connections(s) ? s->socket : 0,
+		 i, WATCH_LISTEN);
+	watch_fd(&s->watch_zygote, want_zygote(s) ? s->zygote_fd : 0,
+		 i, WATCH_ZYGOTE);
+    }
+}
+#endif /* USE_EPOLL */
+
+/* drop service si from the event set; call before closing its fds */
+static void unwatch_service(const int si)
+{
+#ifdef USE_EPOLL
+    watch_fd(&Services[si].watch_stat, 0, si, WATCH_STAT);
+    watch_fd(&Services[si].watch_listen, 0, si, WATCH_LISTEN);
+#endif
+    unwatch_zygote(si);
+}
+
+/* drop service si's zygote from the event set; call before closing it */
+static void unwatch_zygote(const int si)
+{
+#ifdef USE_EPOLL
+    watch_fd(&Services[si].watch_zygote, 0, si, WATCH_ZYGOTE);
+#else
+    (void) si;
+#endif
+}
+
 static char **tokenize(const char *p)
 {
     return strarray_takevf(strarray_split(p, NULL));
@@ -1403,6 +2051,9 @@ static void add_service(const char *name, struct entry *e, void *rock)
     char *proto = xstrdup(masterconf_getstring(e, "proto", "tcp"));
     char *max = xstrdup(masterconf_getstring(e, "maxchild", "-1"));
     rlim_t maxfds = (rlim_t) masterconf_getint(e, "maxfds", 256);
+    int zygote = masterconf_getswitch(e, "zygote", 0);
+    int dispatch = masterconf_getswitch(e, "dispatch", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
     int reconfig = 0;
     int i, j;
 
@@ -1486,12 +2137,16 @@ static void add_service(const char *name, struct entry *e, void *rock)
 
     Services[i].maxforkrate = maxforkrate;
     Services[i].maxfds = maxfds;
+    Services[i].zygote = zygote;
 
     if (!strcmp(Services[i].proto, "tcp") ||
 	!strcmp(Services[i].proto, "tcp4") ||
 	!strcmp(Services[i].proto, "tcp6")) {
 	Services[i].desired_workers = prefork;
+	Services[i].prefork_min = prefork;
+	Services[i].prefork_max = maxprefork > prefork ? maxprefork : prefork;
 	Services[i].babysit = babysit;
+	Services[i].dispatch = dispatch;
 	Services[i].max_workers = atoi(max);
 	if (Services[i].max_workers < 0) {
 	    Services[i].max_workers = INT_MAX;
@@ -1500,6 +2155,8 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	/* udp */
 	if (prefork > 1) prefork = 1;
 	Services[i].desired_workers = prefork;
+	Services[i].prefork_min = Services[i].prefork_max = prefork;
+	Services[i].dispatch = 0;
 	Services[i].max_workers = 1;
     }
  
@@ -1511,8 +2168,12 @@ static void add_service(const char *name, struct entry *e, void *rock)
 		Services[j].maxforkrate = Services[i].maxforkrate;
 		Services[j].exec = Services[i].exec;
 		Services[j].desired_workers = Services[i].desired_workers;
+		Services[j].prefork_min = Services[i].prefork_min;
+		Services[j].prefork_max = Services[i].prefork_max;
 		Services[j].babysit = Services[i].babysit;
 		Services[j].max_workers = Services[i].max_workers;
+		Services[j].zygote = Services[i].zygote;
+		Services[j].dispatch = Services[i].dispatch;
 	    }
 	}
     }
@@ -1634,12 +2295,15 @@ static void limit_fds(rlim_t x)
 static void reread_conf(void)
 {
     int i,j;
-    struct event *ptr;
     struct centry *c;
 
     /* disable all services -
-       they will be re-enabled if they appear in config file */
-    for (i = 0; i < nservices; i++) Services[i].exec = NULL;
+       they will be re-enabled if they appear in config file;
+       zygotes are running with the old config, so retire them */
+    for (i = 0; i < nservices; i++) {
+	Services[i].exec = NULL;
+	zygote_stop(i);
+    }
 
     /* read services */
     masterconf_getsection("SERVICES", &add_service, (void*) 1);
@@ -1675,6 +2339,7 @@ static void reread_conf(void)
 	    }
 
 	    /* close all listeners */
+	    unwatch_service(i);
 	    if (Services[i].socket > 0) {
 		shutdown(Services[i].socket, SHUT_RDWR);
 		close(Services[i].socket);
@@ -1693,18 +2358,17 @@ static void reread_conf(void)
     }
 
     /* remove existing events */
-    while (schedule) {
-	ptr = schedule;
-	schedule = schedule->next;
-	event_free(ptr);
+    for (i = 0; i < nschedule; i++) {
+	event_free(schedule[i]);
     }
-    schedule = NULL;
+    nschedule = 0;
 
     /* read events */
     masterconf_getsection("EVENTS", &add_event, (void*) 1);
 
     /* reinit child janitor */
     init_janitor();
+    init_prefork();
 
     /* send some feedback to admin */
     syslog(LOG_NOTICE,
@@ -1730,7 +2394,9 @@ int main(int argc, char **argv)
     char *alt_config = NULL;
     
     int fd;
+#ifndef USE_EPOLL
     fd_set rfds;
+#endif
     char *p = NULL;
 
 #ifdef HAVE_NETSNMP
@@ -2019,17 +2685,33 @@ int main(int argc, char **argv)
 	}
     }
 
+    /* set up the scoreboard, once we're the cyrus user */
+    if (config_getint(IMAPOPT_SCOREBOARD_SIZE) > 0)
+	scoreboard_create(config_getint(IMAPOPT_SCOREBOARD_SIZE));
+
     /* init ctable janitor */
     init_janitor();
+    init_prefork();
+
+#ifdef USE_EPOLL
+    epfd = epoll_create(2 * nservices + 1);
+    if (epfd == -1) fatal("unable to create epoll instance: %m", 1);
+    (void) fcntl(epfd, F_SETFD, FD_CLOEXEC);
+#endif
     
     /* ok, we're going to start spawning like mad now */
     syslog(LOG_NOTICE, "ready for work");
 
     now = time(NULL);
     for (;;) {
-	int r, i, maxfd, total_children = 0;
+	int r, i, j, total_children = 0;
+#ifdef USE_EPOLL
+	struct epoll_event events[MASTER_EVENTS];
+	int timeout;
+#else
+	int maxfd;
 	struct timeval tv, *tvptr;
-	struct notify_message msg;
+#endif
 #if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
 	int blockp = 0;
 #endif
@@ -2044,6 +2726,10 @@ int main(int argc, char **argv)
 	    gotsigchld = 0;
 	    reap_child();
 	}
+
+	/* resize prefork pools from what we've seen lately */
+	if (!in_shutdown)
+	    adapt_prefork(now);
 	
 	/* do we have any services undermanned? */
 	for (i = 0; i < nservices; i++) {
@@ -2077,8 +2763,10 @@ int main(int argc, char **argv)
 		    Services[i].nforks = 0;
 		    Services[i].nactive = 0;
 		    Services[i].nconnections = 0;
+		    Services[i].nidle = 0;
 		    Services[i].associate = 0;
     
+		    unwatch_service(i);
 		    if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
 		    if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
 		    memset(Services[i].stat, 0, sizeof(Services[i].stat));
@@ -2097,6 +2785,41 @@ int main(int argc, char **argv)
 	    reread_conf();
 	}
 
+#ifdef USE_EPOLL
+	watch_services();
+
+	/* how long to wait? - do now so that any scheduled wakeup
+	 * calls get accounted for*/
+	timeout = -1;
+	if (nschedule) {
+	    if (now < schedule[0]->mark)
+		timeout = (schedule[0]->mark - now) * 1000;
+	    else timeout = 0;
+	}
+
+	r = epoll_wait(epfd, events, MASTER_EVENTS, timeout);
+	if (r == -1 && errno == EINTR) continue;
+	if (r == -1) {
+	    /* uh oh */
+	    fatal("epoll_wait failed: %m", 1);
+	}
+
+	for (j = 0; j < r; j++) {
+	    i = events[j].data.u32 >> 2;
+
+	    switch (events[j].data.u32 & 3) {
+	    case WATCH_STAT:
+		read_service_msgs(i);
+		break;
+	    case WATCH_LISTEN:
+		Services[i].listen_ready = 1;
+		break;
+	    case WATCH_ZYGOTE:
+		if (want_zygote(&Services[i])) zygote_hello(i);
+		break;
+	    }
+	}
+#else
 	FD_ZERO(&rfds);
 	maxfd = 0;
 	for (i = 0; i < nservices; i++) {
@@ -2114,8 +2837,7 @@ int main(int argc, char **argv)
 	    if (x > maxfd) maxfd = x;
 
 	    /* connections */
-	    if (y > 0 && Services[i].ready_workers == 0 &&
-		Services[i].nactive < Services[i].max_workers) {
+	    if (want_connections(&Services[i])) {
 		if (verbose > 2)
 		    syslog(LOG_DEBUG, "listening for connections for %s", 
 			   Services[i].name);
@@ -2123,10 +2845,11 @@ int main(int argc, char **argv)
 		if (y > maxfd) maxfd = y;
 	    }
 
-	    /* paranoia */
-	    if (Services[i].ready_workers < 0) {
-		syslog(LOG_ERR, "%s has %d workers?!?", Services[i].name,
-		       Services[i].ready_workers);
+	    /* zygote readiness */
+	    if (want_zygote(&Services[i])) {
+		FD_SET(Services[i].zygote_fd, &rfds);
+		if (Services[i].zygote_fd > maxfd)
+		    maxfd = Services[i].zygote_fd;
 	    }
 	}
 	maxfd++;		/* need 1 greater than maxfd */
@@ -2134,8 +2857,8 @@ int main(int argc, char **argv)
 	/* how long to wait? - do now so that any scheduled wakeup
 	 * calls get accounted for*/
 	tvptr = NULL;
-	if (schedule) {
-	    if (now < schedule->mark) tv.tv_sec = schedule->mark - now;
+	if (nschedule) {
+	    if (now < schedule[0]->mark) tv.tv_sec = schedule[0]->mark - now;
 	    else tv.tv_sec = 0;
 	    tv.tv_usec = 0;
 	    tvptr = &tv;
@@ -2162,22 +2885,26 @@ int main(int argc, char **argv)
 	for (i = 0; i < nservices; i++) {
 	    int x = Services[i].stat[0];
 	    int y = Services[i].socket;
-	    int j;
 
-	    if (FD_ISSET(x, &rfds)) {
-		while ((r = read_msg(x, &msg)) == 0)
-		    process_msg(i, &msg);
+	    if (x > 0 && FD_ISSET(x, &rfds))
+		read_service_msgs(i);
+	    if (y > 0 && FD_ISSET(y, &rfds))
+		Services[i].listen_ready = 1;
+	    if (want_zygote(&Services[i]) &&
+		FD_ISSET(Services[i].zygote_fd, &rfds))
+		zygote_hello(i);
+	}
+#endif /* USE_EPOLL */
 
-		if (r == 2) {
-		    syslog(LOG_ERR,
-			"got incorrectly sized response from child: %x", i);
-		    continue;
-		}
-		if (r < 0) {
-		    syslog(LOG_ERR,
-			"error while receiving message from child %x: %m", i);
-		    continue;
-		}
+	for (i = 0; i < nservices; i++) {
+	    /* paranoia */
+	    if (Services[i].ready_workers < 0) {
+		syslog(LOG_ERR, "%s has %d workers?!?", Services[i].name,
+		       Services[i].ready_workers);
+	    }
+
+	    if (Services[i].dispatch && Services[i].listen_ready) {
+		dispatch_conns(i);
 	    }
 
 	    if (!in_shutdown && Services[i].exec &&
@@ -2191,11 +2918,12 @@ int main(int argc, char **argv)
 		}
 
 		if (Services[i].ready_workers == 0 && 
-		    FD_ISSET(y, &rfds)) {
+		    Services[i].listen_ready) {
 		    /* huh, someone wants to talk to us */
 		    spawn_service(i);
 		}
 	    }
+	    Services[i].listen_ready = 0;
 	}
 	now = time(NULL);
 	child_janitor(now);
@@ -26,9 +26,18 @@ struct service {
 
     /* limits */
     int desired_workers;	/* num child processes to have ready */
+    int prefork_min;		/* fewest to have ready (prefork) */
+    int prefork_max;		/* most to have ready (maxprefork) */
     int max_workers;		/* max num child processes to spawn */
     rlim_t maxfds;		/* max num file descriptors to use */
     unsigned int maxforkrate;	/* max rate to spawn children */
+    int zygote;			/* fork children from a zygote? */
+    int dispatch;		/* hand connections to children? */
+
+    /* zygote info */
+    pid_t zygote_pid;		/* pre-initialized child, or 0 */
+    int zygote_fd;		/* our end of its request socket */
+    int zygote_ready;		/* has it finished initializing? */
 
     /* stats */
     int ready_workers;		/* num child processes ready for service */
@@ -37,6 +46,25 @@ struct service {
     int nconnections;		/* num connections made to children */
     unsigned int forkrate;	/* rate at which we're spawning children */
 
+    /* children ready for a connection, most recent last (dispatch=1) */
+    pid_t *idle;
+    int nidle;
+    int idlealloc;
+
+    /* prefork pool sizing, smoothed */
+    time_t prefork_mark;	/* when we last sized the pool */
+    int prefork_conns;		/* nconnections at prefork_mark */
+    double arrival_rate;	/* connections per second */
+    double busy_ratio;		/* busy / active children */
+    double spawn_latency;	/* secs from fork to accepting */
+    double ready_surplus;	/* ready children beyond desired_workers */
+
+    /* fds registered with the main loop's event set, 0 if none */
+    int watch_stat;
+    int watch_listen;
+    int watch_zygote;
+    int listen_ready;		/* listener polled readable this round */
+
     /* fork rate computation */
     time_t last_interval_start;
     unsigned int interval_forks;
@@ -75,7 +75,9 @@
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "strarray.h"
+#include "scoreboard.h"
 #include "signals.h"
+#include "cyrusdb.h"
 
 extern int optind, opterr;
 extern char *optarg;
@@ -156,6 +158,29 @@ static int libwrap_ask(struct request_info *r __attribute__((unused)),
 
 extern void cyrus_init(const char *, const char *, unsigned);
 
+static volatile sig_atomic_t retire = 0;
+
+static void retire_handler(int sig __attribute__((unused)))
+{
+    retire = 1;
+}
+
+/* master sends SIGUSR2 to retire an idle child.  we only act on it
+ * while we're waiting for a connection, so one that crosses with a
+ * connection we've just accepted is dropped, not the connection. */
+static void retire_catch(int flag)
+{
+    struct sigaction action;
+
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;	/* interrupt accept() and the lock wait */
+    action.sa_handler = flag ? retire_handler : SIG_IGN;
+    if (sigaction(SIGUSR2, &action, NULL) < 0) {
+	syslog(LOG_ERR, "unable to set SIGUSR2 handler: %m");
+    }
+    if (!flag) retire = 0;
+}
+
 static int getlockfd(char *service, int id)
 {
     char lockfile[1024];
@@ -190,9 +215,15 @@ static int lockaccept(void)
 	alockinfo.l_type = F_WRLCK;
 	while ((rc = fcntl(lockfd, F_SETLKW, &alockinfo)) < 0 && 
 	       errno == EINTR &&
-	       !signals_poll())
+	       !signals_poll() && !retire)
 	    /* noop */;
 	
+	if (rc < 0 && retire) {
+	    /* master has already counted us out */
+	    service_abort(0);
+	    return -1;
+	}
+
 	if (rc < 0 && signals_poll()) {
 	    if (MESSAGE_MASTER_ON_EXIT) 
 		notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
@@ -241,6 +272,139 @@ static int unlockaccept(void)
     return 0;
 }
 
+/* read a byte, and the descriptor master may have sent with it, from
+ * socket sock; *fdp is -1 if there was none */
+static ssize_t recv_fd(int sock, int *fdp)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char c;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fdp = -1;
+    n = recvmsg(sock, &msg, 0);
+    if (n <= 0) return n;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+	    memcpy(fdp, CMSG_DATA(cmsg), sizeof(int));
+	}
+    }
+
+    return n;
+}
+
+/*
+ * master has accepted another connection for us (dispatch=1) after we
+ * told it we're going, and will hang up once it's heard; returns the
+ * connection, or -1 if there wasn't one.
+ */
+static int dispatch_drain(void)
+{
+    ssize_t n;
+    int fd;
+
+    alarm(0);
+    do {
+	n = recv_fd(LISTEN_FD, &fd);
+    } while ((n == -1 && errno == EINTR) || (n > 0 && fd == -1));
+
+    return n > 0 ? fd : -1;
+}
+
+/*
+ * Run as a zygote: the process is exec'd and configured once, then
+ * each byte master writes to ZYGOTE_FD asks for a worker.  The worker
+ * is forked from a short-lived intermediate child, which reports its
+ * pid to master and exits, so the worker is reparented to master.  A
+ * descriptor sent with the request becomes the worker's LISTEN_FD.
+ * We start by writing our own pid, so master knows we're ready; it
+ * forks children itself until then.  Returns only in the worker.
+ *
+ * Database handles (a Berkeley DB environment, an SQLite connection)
+ * mustn't be shared across fork(), so we close the environment
+ * cyrus_init() opened before forking anything, and each worker opens
+ * its own and then runs service_init() itself.  So all a worker is
+ * spared is the exec, dynamic linking and reading the config; what
+ * service_init() sets up isn't shared copy-on-write.
+ */
+static void zygote(const char *path, ino_t ino, off_t size, time_t mtime)
+{
+    struct stat sbuf;
+    pid_t p, worker;
+    ssize_t n;
+    int lfd;
+
+    signals_add_handlers(0);
+    cyrusdb_done();
+
+    p = getpid();
+    if (write(ZYGOTE_FD, &p, sizeof(p)) != sizeof(p)) {
+	syslog(LOG_ERR, "zygote: can't report for duty: %m");
+	service_abort(0);
+    }
+
+    for (;;) {
+	n = recv_fd(ZYGOTE_FD, &lfd);
+	if (n == -1 && errno == EINTR) {
+	    if (signals_poll()) break;
+	    continue;
+	}
+	if (n <= 0) break;	/* master's done with us */
+
+	/* a new binary needs a new zygote */
+	stat(path, &sbuf);
+	if (sbuf.st_ino != ino || sbuf.st_size != size ||
+	    sbuf.st_mtime != mtime) {
+	    syslog(LOG_INFO, "process file has changed");
+	    break;
+	}
+
+	p = fork();
+	if (p != 0 && lfd != -1) close(lfd);
+	if (p == -1) {
+	    syslog(LOG_ERR, "zygote: can't fork: %m");
+	    break;
+	}
+	if (p == 0) {
+	    worker = fork();
+	    if (worker != 0 && lfd != -1) close(lfd);
+	    if (worker == 0) {
+		if (lfd != -1) {
+		    dup2(lfd, LISTEN_FD);
+		    close(lfd);
+		    fcntl(LISTEN_FD, F_SETFD, FD_CLOEXEC);
+		}
+		close(ZYGOTE_FD);
+		unsetenv("CYRUS_ZYGOTE");
+		cyrusdb_init();
+		return;
+	    }
+	    if (worker == -1) syslog(LOG_ERR, "zygote: can't fork: %m");
+	    if (write(ZYGOTE_FD, &worker, sizeof(worker)) != sizeof(worker)) {
+		syslog(LOG_ERR, "zygote: can't report worker: %m");
+	    }
+	    _exit(0);
+	}
+	while (waitpid(p, NULL, 0) == -1 && errno == EINTR);
+    }
+
+    service_abort(0);
+}
+
 int main(int argc, char **argv, char **envp)
 {
     int fdflags;
@@ -253,6 +417,7 @@ int main(int argc, char **argv, char **envp)
     int max_use = MAX_USE;
     int reuse_timeout = REUSE_TIMEOUT;
     int soctype;
+    int dispatch, hungup = 0;
     socklen_t typelen = sizeof(soctype);
     strarray_t newargv = STRARRAY_INITIALIZER;
     int id;
@@ -329,11 +494,6 @@ int main(int argc, char **argv, char **envp)
     }
     id = atoi(p);
 
-    /* pick a random timeout between reuse_timeout -> 2*reuse_timeout
-     * to avoid massive IO overload if the network connection goes away */
-    srand(time(NULL) * getpid());
-    reuse_timeout = reuse_timeout + (rand() % reuse_timeout);
-
     cyrus_init(alt_config, service, 0);
 
     if (call_debugger) {
@@ -379,12 +539,6 @@ int main(int argc, char **argv, char **envp)
 	return 1;
     }
 
-    if (service_init(newargv.count, newargv.data, envp) != 0) {
-	if (MESSAGE_MASTER_ON_EXIT) 
-	    notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
-	return 1;
-    }
-
     /* determine initial process file inode, size and mtime */
     if (newargv.data[0][0] == '/')
 	strlcpy(path, newargv.data[0], sizeof(path));
@@ -396,13 +550,48 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    /* master asked for a zygote; we return from it as a fresh worker */
+    if (getenv("CYRUS_ZYGOTE")) {
+	zygote(path, start_ino, start_size, start_mtime);
+    }
+
+    if (service_init(newargv.count, newargv.data, envp) != 0) {
+	if (MESSAGE_MASTER_ON_EXIT) 
+	    notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
+	return 1;
+    }
+
+    /* pick a random timeout between reuse_timeout -> 2*reuse_timeout
+     * to avoid massive IO overload if the network connection goes away */
+    srand(time(NULL) * getpid());
+    reuse_timeout = reuse_timeout + (rand() % reuse_timeout);
+
+    /* master hands us connections over LISTEN_FD: no accept lock */
+    dispatch = getenv("CYRUS_DISPATCH") != NULL;
+
+    if (!dispatch) getlockfd(service, id);
+
+    /* keep our slot on the scoreboard up to date, if master made one */
+    if (config_getint(IMAPOPT_SCOREBOARD_SIZE) > 0 &&
+	scoreboard_attach(1) == 0) {
+	scoreboard_claim(service);
+    }
+
+    /* master won't retire us until it hears this, but we're not
+     * ready for that yet */
+    retire_catch(0);
+
+    /* let master know how long we took to get here */
+    notify_master(STATUS_FD, MASTER_SERVICE_STARTED);
+
     for (;;) {
 	/* ok, listen to this socket until someone talks to us */
 
 	/* (re)set signal handlers, including SIGALRM */
 	signals_add_handlers(SIGALRM);
 
+	retire_catch(1);
+
 	if (use_count > 0) {
 	    /* we want to time out after 60 seconds, set an alarm */
 	    alarm(reuse_timeout);
@@ -412,7 +601,7 @@ int main(int argc, char **argv, char **envp)
 	lockaccept();
 
 	fd = -1;
-	while (fd < 0 && !signals_poll()) { /* loop until we succeed */
+	while (fd < 0 && !signals_poll() && !retire) { /* loop until we succeed */
 	    /* check current process file inode, size and mtime */
 	    stat(path, &sbuf);
 	    if (sbuf.st_ino != start_ino || sbuf.st_size != start_size ||
@@ -422,7 +611,20 @@ int main(int argc, char **argv, char **envp)
 		break;
 	    }
 
-	    if (soctype == SOCK_STREAM) {
+	    if (dispatch) {
+		ssize_t n = recv_fd(LISTEN_FD, &fd);
+
+		if (n == 0) {
+		    /* master doesn't want us any more */
+		    hungup = 1;
+		    break;
+		}
+		if (n < 0 && errno != EINTR) {
+		    syslog(LOG_ERR, "recvmsg failed: %m");
+		    notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
+		    service_abort(EX_OSERR);
+		}
+	    } else if (soctype == SOCK_STREAM) {
 		fd = accept(LISTEN_FD, NULL, NULL);
 		if (fd < 0) {
 		    switch (errno) {
@@ -463,6 +665,7 @@ int main(int argc, char **argv, char **envp)
 		fromlen = sizeof(from);
 		r = recvfrom(LISTEN_FD, (void *) &ch, 1, MSG_PEEK,
 			     (struct sockaddr *) &from, &fromlen);
+		if (r == -1 && errno == EINTR) continue;
 		if (r == -1) {
 		    syslog(LOG_ERR, "recvfrom failed: %m");
 		    if (MESSAGE_MASTER_ON_EXIT) 
@@ -476,11 +679,22 @@ int main(int argc, char **argv, char **envp)
 	/* unlock */
 	unlockaccept();
 
-	if (fd < 0 && (signals_poll() || newfile)) {
+	if (fd < 0 && retire) {
+	    /* master has already counted us out */
+	    service_abort(0);
+	}
+	/* too late to go now */
+	retire_catch(0);
+
+	if (fd < 0 && (signals_poll() || newfile || hungup)) {
 	    /* timed out (SIGALRM), SIGHUP, or new process file */
-	    if (MESSAGE_MASTER_ON_EXIT) 
+	    if (MESSAGE_MASTER_ON_EXIT || dispatch) 
 		notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
-	    service_abort(0);
+	    if (dispatch && !hungup) fd = dispatch_drain();
+	    if (fd < 0) service_abort(0);
+
+	    /* serve this last one, then go */
+	    use_count = max_use;
 	}
 	if (fd < 0) {
 	    /* how did this happen? - we might have caught a signal. */
@@ -501,6 +715,8 @@ int main(int argc, char **argv, char **envp)
 		/* connection denied! */
 		shutdown(fd, SHUT_RDWR);
 		close(fd);
+		if (dispatch)
+		    notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
 		continue;
 	    }
 
@@ -544,7 +760,8 @@ int main(int argc, char **argv, char **envp)
 	    }
 	}
 
-	notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
+	/* master already counts a dispatched child as busy */
+	if (!dispatch) notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
 	syslog(LOG_DEBUG, "accepted connection");
 
 	if (fd != 0 && dup2(fd, 0) < 0) {
@@ -567,8 +784,10 @@ int main(int argc, char **argv, char **envp)
 	
 	notify_master(STATUS_FD, MASTER_SERVICE_CONNECTION);
 	use_count++;
+	scoreboard_busy();
 	service_main(newargv.count, newargv.data, envp);
 	/* if we returned, we can service another client with this process */
+	scoreboard_ready();
 
 	if (signals_poll() || use_count >= max_use) {
 	    /* caught SIGHUP or exceeded max use count */